@@ -1,5 +1,6 @@
 #include <getopt.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -11,7 +12,6 @@
 #include <math.h>
 #include <drm_fourcc.h>
 #include <assert.h>
-#include <limits.h>
 
 #include <wlr/backend.h>
 #include <wlr/render/allocator.h>
@@ -51,6 +51,36 @@
 static double start_time = 0;
 static int frame_count = 0;
 
+// How many frames of damage we remember. Buffers older than this get
+// repainted completely.
+#define DAMAGE_RING_LEN 4
+// Blur and bloom smear every pixel over about this many pixels, so damage is
+// grown by this much
+#define DAMAGE_PADDING 128
+
+// Damage of the previous frames, newest first
+static pixman_region32_t damage_ring[DAMAGE_RING_LEN];
+static bool damage_ring_initialized = false;
+
+// Changing any of these changes every pixel
+static int last_width = 0, last_height = 0;
+static int last_postprocess_mode = -1;
+static int last_compute_blur = -1;
+static float last_colorscheme_ratio = -1;
+static int last_src_colorscheme_idx = -1, last_dst_colorscheme_idx = -1;
+
+// Every surface, sorted by Z. It's kept between frames since Z hardly ever
+// changes, so draw_frame doesn't have to allocate or sort anything.
+static struct {
+        struct Surface **surfaces;
+        int count, capacity;
+        // draw_frame's scratch space, same capacity as surfaces
+        int *layers;
+        VkRect2D *rects;
+        // Set when a surface was added or a Z changed
+        bool unsorted;
+} draw_list;
+
 struct RenderData {
 	struct wlr_output *output;
 	pixman_region32_t *damage;
@@ -64,6 +94,7 @@ void render_rect_simple(struct wlr_renderer *wlr_renderer, const float color[4],
                 int x, int y, int width, int height, bool clear) {
 	struct wlr_vk_renderer *renderer = (struct wlr_vk_renderer *) wlr_renderer;
         struct wlr_vk_render_buffer *render_buf = renderer->current_render_buffer;
+        struct wlr_vk_transient_set *transient = vulkan_transient_set(renderer);
 
         int screen_width = render_buf->wlr_buffer->width;
         int screen_height = render_buf->wlr_buffer->height;
@@ -72,10 +103,7 @@ void render_rect_simple(struct wlr_renderer *wlr_renderer, const float color[4],
         assert(render_buf != NULL);
         assert(cbuf != NULL);
 
-        // There might have already been a rect drawn, so reset the timers
-        vkCmdResetQueryPool(cbuf, renderer->query_pool, TIMER_RENDER_RECT, 2);
-
-        vulkan_start_timer(cbuf, renderer->query_pool, TIMER_RENDER_RECT);
+        gpu_scope_begin(cbuf, "rect");
 
         // Bind pipeline, if necessary
         VkPipeline pipe = render_buf->render_setup->quad_pipe;
@@ -84,12 +112,17 @@ void render_rect_simple(struct wlr_renderer *wlr_renderer, const float color[4],
                 renderer->bound_pipe = pipe;
         };
 
-        VkRect2D rect = {{0, 0}, {screen_width, screen_height}};
+        VkRect2D rect = renderer->damage_rect;
         renderer->scissor = rect;
 
-        VkRenderPass rpass = clear ? render_buf->render_setup->quad_clear_rpass
-                : render_buf->render_setup->quad_rpass;
-        begin_render_pass(cbuf, render_buf->framebuffer,
+        // Only throw away the old contents if all of it is getting repainted
+        VkRenderPass rpass = render_buf->render_setup->quad_rpass;
+        if (clear && rect.extent.width == screen_width && rect.extent.height == screen_height) {
+                rpass = render_buf->render_setup->quad_clear_rpass;
+        } else if (clear) {
+                rpass = render_buf->render_setup->quad_damage_rpass;
+        }
+        begin_render_pass(cbuf, transient->framebuffer,
                 rpass, rect, screen_width, screen_height);
 
         // We don't bother rendering from one surface to the other because we
@@ -128,42 +161,24 @@ void render_rect_simple(struct wlr_renderer *wlr_renderer, const float color[4],
 
         vkCmdEndRenderPass(cbuf);
 
-        vulkan_end_timer(cbuf, renderer->query_pool, TIMER_RENDER_RECT);
+        gpu_scope_end(cbuf);
 }
 
 void debug_images(struct wlr_renderer *wlr_renderer) {
 	struct wlr_vk_renderer *renderer = (struct wlr_vk_renderer *) wlr_renderer;
-        struct wlr_vk_render_buffer *render_buf = renderer->current_render_buffer;
+        struct wlr_vk_transient_set *transient = vulkan_transient_set(renderer);
 
-        wlr_log(WLR_DEBUG, "Intermediate image is at %p", render_buf->intermediate);
-        wlr_log(WLR_DEBUG, "UV is at %p", render_buf->uv);
+        wlr_log(WLR_DEBUG, "Intermediate image is at %p", transient->intermediate);
+        wlr_log(WLR_DEBUG, "UV is at %p", transient->uv);
+        wlr_log(WLR_DEBUG, "ID is at %p", transient->id);
 }
 
 // Sometimes we want to set a tight scissor around a window that might be
-// rotated weirdly. This figures out the screen coordinates.
-void get_rect_for_matrix(int screen_width, int screen_height, mat4 matrix, int padding,
+// rotated weirdly. This turns one of the boxes calc_matrices works out into
+// one, clamped to the screen.
+static void box_to_rect(int screen_width, int screen_height, pixman_box32_t box, int padding,
                 VkRect2D *rect) {
-        // Figure out where the corners end up
-        float corners[4][4] = {
-                {0, 0, 0, 1},
-                {1, 0, 0, 1},
-                {0, 1, 0, 1},
-                {1, 1, 0, 1}
-        };
-        int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
-        for (int i = 0; i < 4; i++) {
-                float dest[4];
-                glm_mat4_mulv(matrix, corners[i], dest);
-                dest[0] /= dest[3];
-                dest[1] /= dest[3];
-                int x = (dest[0] * 0.5 + 0.5) * screen_width;
-                int y = (dest[1] * 0.5 + 0.5) * screen_height;
-
-                if (x < min_x) min_x = x;
-                if (y < min_y) min_y = y;
-                if (x > max_x) max_x = x;
-                if (y > max_y) max_y = y;
-        }
+        int min_x = box.x1, min_y = box.y1, max_x = box.x2, max_y = box.y2;
 
         min_x -= padding;
         min_y -= padding;
@@ -183,33 +198,308 @@ void get_rect_for_matrix(int screen_width, int screen_height, mat4 matrix, int p
         rect->extent.height = max_y - min_y;
 }
 
+// Shrinks rect to the part that's also inside clip. If they don't overlap,
+// returns false and leaves rect alone.
+static bool clip_rect(VkRect2D *rect, VkRect2D clip) {
+        int x1 = rect->offset.x, y1 = rect->offset.y;
+        int x2 = x1 + rect->extent.width, y2 = y1 + rect->extent.height;
+
+        if (clip.offset.x > x1) x1 = clip.offset.x;
+        if (clip.offset.y > y1) y1 = clip.offset.y;
+        if (clip.offset.x + (int) clip.extent.width < x2) x2 = clip.offset.x + clip.extent.width;
+        if (clip.offset.y + (int) clip.extent.height < y2) y2 = clip.offset.y + clip.extent.height;
+
+        if (x2 <= x1 || y2 <= y1) return false;
+
+        rect->offset.x = x1;
+        rect->offset.y = y1;
+        rect->extent.width = x2 - x1;
+        rect->extent.height = y2 - y1;
+        return true;
+}
+
+// Adds box to damage, grown by DAMAGE_PADDING so the blur around it gets
+// repainted too
+static void add_damage(pixman_region32_t *damage, pixman_box32_t box) {
+        pixman_region32_union_rect(damage, damage,
+                box.x1 - DAMAGE_PADDING, box.y1 - DAMAGE_PADDING,
+                box.x2 - box.x1 + 2 * DAMAGE_PADDING, box.y2 - box.y1 + 2 * DAMAGE_PADDING);
+}
+
+// Whether any of the surface can end up on screen, i.e. it's not completely
+// behind the camera or outside the viewport
+static bool in_frustum(struct Surface *surface, int screen_width, int screen_height) {
+        // w of the corners of the unit square. Behind the camera it's
+        // negative and box is meaningless.
+        int behind_count = 0;
+        for (int corner = 0; corner < 4; corner++) {
+                float x = corner & 1, y = corner >> 1;
+                float w = surface->matrix[0][3] * x + surface->matrix[1][3] * y
+                        + surface->matrix[3][3];
+                if (w <= 0) behind_count++;
+        }
+        if (behind_count == 4) return false;
+        // Partly behind, play it safe
+        if (behind_count > 0) return true;
+
+        pixman_box32_t box = surface->box;
+        return box.x2 > 0 && box.y2 > 0 && box.x1 < screen_width && box.y1 < screen_height;
+}
+
+static bool is_culled(struct Surface *surface) {
+        return surface->visibility == SURFACE_OFF_SCREEN
+                || surface->visibility == SURFACE_SUB_PIXEL;
+}
+
+static bool boxes_overlap(pixman_box32_t a, pixman_box32_t b) {
+        return a.x1 < b.x2 && b.x1 < a.x2 && a.y1 < b.y2 && b.y1 < a.y2;
+}
+
+// Sets the visibility of every surface in the draw list, which has to be
+// sorted
+static void update_visibility(int screen_width, int screen_height) {
+        for (int i = 0; i < draw_list.count; i++) {
+                struct Surface *surface = draw_list.surfaces[i];
+                pixman_box32_t inner = surface->inner_box;
+
+                // Not mapped yet or no buffer, nothing to judge. Leave it
+                // visible so it gets frame done events like before.
+                if ((TRANSFORM(surface, width) == 0 && TRANSFORM(surface, height) == 0)
+                                || wlr_surface_get_texture(surface->wlr_surface) == NULL) {
+                        surface->visibility = SURFACE_VISIBLE;
+                } else if (!in_frustum(surface, screen_width, screen_height)) {
+                        surface->visibility = SURFACE_OFF_SCREEN;
+                } else if (inner.x2 - inner.x1 < 1 || inner.y2 - inner.y1 < 1) {
+                        surface->visibility = SURFACE_SUB_PIXEL;
+                } else if (inner.x1 < 0 || inner.y1 < 0
+                                || inner.x2 > screen_width || inner.y2 > screen_height) {
+                        surface->visibility = SURFACE_PARTIALLY_OCCLUDED;
+                } else {
+                        surface->visibility = SURFACE_VISIBLE;
+                }
+        }
+
+        // Anything nearer that overlaps. Nothing is opaque, so this never
+        // hides a surface completely.
+        for (int i = 0; i < draw_list.count; i++) {
+                struct Surface *surface = draw_list.surfaces[i];
+                if (surface->visibility != SURFACE_VISIBLE) continue;
+                if (TRANSFORM(surface, width) == 0 && TRANSFORM(surface, height) == 0) continue;
+
+                for (int j = i + 1; j < draw_list.count; j++) {
+                        struct Surface *nearer = draw_list.surfaces[j];
+                        if (is_culled(nearer)) continue;
+                        if (TRANSFORM(nearer, width) == 0 && TRANSFORM(nearer, height) == 0) continue;
+                        if (boxes_overlap(surface->inner_box, nearer->inner_box)) {
+                                surface->visibility = SURFACE_PARTIALLY_OCCLUDED;
+                                break;
+                        }
+                }
+        }
+}
+
+// Adds everything that changed about the surfaces since the last frame to
+// damage, in screen coordinates
+static void collect_surface_damage(struct wl_list *surfaces, struct Surface *focused_surface,
+                int screen_width, int screen_height, pixman_region32_t *damage) {
+        struct Surface *surface;
+	wl_list_for_each(surface, surfaces, link) {
+                // Same check as draw_frame and render_layer
+                bool visible = !(TRANSFORM(surface, width) == 0 && TRANSFORM(surface, height) == 0)
+                        && wlr_surface_get_texture(surface->wlr_surface) != NULL
+                        && !is_culled(surface);
+                bool is_focused = surface == focused_surface;
+
+                pixman_box32_t box = {0};
+                if (visible) box = surface->box;
+
+                bool changed = visible != surface->drawn;
+                if (visible && surface->drawn) {
+                        changed = is_focused != surface->drawn_focused || surface->moved;
+                }
+
+                if (changed) {
+                        // Repaint where it was and where it is now
+                        if (surface->drawn) add_damage(damage, surface->drawn_box);
+                        if (visible) add_damage(damage, box);
+                } else if (visible && pixman_region32_not_empty(&surface->damage)) {
+                        // Only the contents changed. The damage is relative
+                        // to the window without its border, which is what
+                        // inner_matrix maps the unit square to.
+                        float width = surface->wlr_surface->current.width;
+                        float height = surface->wlr_surface->current.height;
+
+                        int rect_count;
+                        pixman_box32_t *rects =
+                                pixman_region32_rectangles(&surface->damage, &rect_count);
+                        for (int i = 0; i < rect_count && width > 0 && height > 0; i++) {
+                                pixman_box32_t projected;
+                                project_box(screen_width, screen_height, surface->inner_matrix,
+                                        rects[i].x1 / width, rects[i].y1 / height,
+                                        rects[i].x2 / width, rects[i].y2 / height, &projected);
+                                add_damage(damage, projected);
+                        }
+                }
+
+                pixman_region32_clear(&surface->damage);
+                surface->drawn = visible;
+                surface->drawn_focused = is_focused;
+                surface->drawn_box = box;
+                surface->moved = false;
+        }
+}
+
+// Works out what has to be repainted in a buffer that's buffer_age frames old,
+// then remembers frame_damage for the frames after this one.
+static void get_repaint_region(pixman_region32_t *frame_damage, int buffer_age,
+                int screen_width, int screen_height, pixman_region32_t *repaint) {
+        if (!damage_ring_initialized) {
+                for (int i = 0; i < DAMAGE_RING_LEN; i++) {
+                        pixman_region32_init(&damage_ring[i]);
+                }
+                damage_ring_initialized = true;
+        }
+
+        pixman_region32_copy(repaint, frame_damage);
+        if (buffer_age <= 0 || buffer_age > DAMAGE_RING_LEN + 1) {
+                // Either the contents are garbage or we forgot what happened
+                // since then
+                pixman_region32_union_rect(repaint, repaint, 0, 0, screen_width, screen_height);
+        } else {
+                // An age of 1 means it has last frame's contents, so it only
+                // needs this frame's damage
+                for (int i = 0; i < buffer_age - 1; i++) {
+                        pixman_region32_union(repaint, repaint, &damage_ring[i]);
+                }
+        }
+
+        // Shift everything along, reusing the oldest region for this frame
+        pixman_region32_t oldest = damage_ring[DAMAGE_RING_LEN - 1];
+        for (int i = DAMAGE_RING_LEN - 1; i > 0; i--) {
+                damage_ring[i] = damage_ring[i - 1];
+        }
+        damage_ring[0] = oldest;
+        pixman_region32_copy(&damage_ring[0], frame_damage);
+}
+
+// Same as the loop in blur_image, but with a compute dispatch per level instead
+// of a render pass. Fills all of rect instead of just the part covered by
+// matrix.
+static void blur_image_compute(struct wlr_vk_renderer *renderer,
+                int screen_width, int screen_height, int pass_count, VkDescriptorSet *src_image_set,
+                VkRect2D rect, bool with_threshold) {
+        VkCommandBuffer cbuf = renderer->cb;
+        struct wlr_vk_transient_set *transient = vulkan_transient_set(renderer);
+
+        vkCmdBindPipeline(cbuf, VK_PIPELINE_BIND_POINT_COMPUTE, renderer->blur_compute_pipe);
+
+        int last_image_idx = 0;
+        for (int i = 0; i < 2 * pass_count - 1; i++) {
+                int image_idx;
+                if (i < pass_count) {
+                        image_idx = i;
+                } else {
+                        image_idx = 2 * pass_count - i - 2;
+                }
+
+                float blur_scale = 1.0 / (2 << image_idx);
+                int width = screen_width * blur_scale;
+                int height = screen_height * blur_scale;
+
+                struct BlurComputePushConstants push_constants = {0};
+                push_constants.offset[0] = rect.offset.x * blur_scale;
+                push_constants.offset[1] = rect.offset.y * blur_scale;
+                push_constants.extent[0] = rect.extent.width * blur_scale;
+                push_constants.extent[1] = rect.extent.height * blur_scale;
+                if (push_constants.extent[0] < 1) push_constants.extent[0] = 1;
+                if (push_constants.extent[1] < 1) push_constants.extent[1] = 1;
+                push_constants.dst_dims[0] = width;
+                push_constants.dst_dims[1] = height;
+                if (i >= pass_count) {
+                        push_constants.mode = 1;
+                } else if (i == 0 && with_threshold) {
+                        push_constants.mode = 2;
+                }
+
+                // Whatever read this level before (the last level of
+                // downsampling, or a previous surface) has to be done first
+                vulkan_image_transition_cbuf(cbuf,
+                        transient->blurs[image_idx], VK_IMAGE_ASPECT_COLOR_BIT,
+                        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+                        0, VK_ACCESS_SHADER_WRITE_BIT,
+                        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        1);
+
+                VkDescriptorSet desc_sets[] = {
+                        i == 0 ? *src_image_set : transient->blur_sets[last_image_idx],
+                        transient->blur_storage_sets[image_idx],
+                };
+                vkCmdBindDescriptorSets(cbuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                        renderer->compute_pipe_layout, 0,
+                        sizeof(desc_sets) / sizeof(desc_sets[0]), desc_sets, 0, NULL);
+                vkCmdPushConstants(cbuf, renderer->compute_pipe_layout,
+                        VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants), &push_constants);
+
+                gpu_scope_begin(cbuf, "pass %d", i);
+                // blur.comp works in 8x8 groups
+                vkCmdDispatch(cbuf, (push_constants.extent[0] + 7) / 8,
+                        (push_constants.extent[1] + 7) / 8, 1);
+                gpu_scope_end(cbuf);
+
+                // The next level reads it, and after the last one
+                // render_layer or the postprocess pass does
+                vulkan_image_transition_cbuf(cbuf,
+                        transient->blurs[image_idx], VK_IMAGE_ASPECT_COLOR_BIT,
+                        VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                        VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                        1);
+
+                last_image_idx = image_idx;
+        }
+}
+
 // Assumes image is in SHADER_READ_ONLY. If with_threshold is set, a threshold
 // will first be applied to the image. So you end up with just the bright parts
-// blurred.
+// blurred. Only the part of the image inside rect is blurred.
 void blur_image(struct wlr_vk_renderer *renderer,
                 int screen_width, int screen_height, int pass_count, VkDescriptorSet *src_image_set,
-                mat4 matrix, bool with_threshold) {
+                VkRect2D rect, bool with_threshold) {
         assert(pass_count <= BLUR_PASSES);
 
         VkCommandBuffer cbuf = renderer->cb;
         struct wlr_vk_render_buffer *render_buf = renderer->current_render_buffer;
+        struct wlr_vk_transient_set *transient = vulkan_transient_set(renderer);
 
         double start_time = get_time();
 
+        // The render area does the clipping, so the quad just covers everything
+        mat4 matrix = {{2, 0, 0, 0}, {0, 2, 0, 0}, {0, 0, 1, 0}, {-1, -1, 0, 1}};
 
-        VkRect2D rect;
-        // We need to clear a bigger area so junk from previous frames doesn't bleed into ours
-        int padding = 32;
-        get_rect_for_matrix(screen_width, screen_height, matrix, padding, &rect);
+        // Anything further than this from the damage can't end up in a pixel
+        // we repaint
+        VkRect2D clip = renderer->damage_rect;
+        clip.offset.x -= DAMAGE_PADDING;
+        clip.offset.y -= DAMAGE_PADDING;
+        clip.extent.width += 2 * DAMAGE_PADDING;
+        clip.extent.height += 2 * DAMAGE_PADDING;
+        clip_rect(&rect, clip);
 
-        // There might have already been a texture rendered, so reset the timers
-        vkCmdResetQueryPool(cbuf, renderer->query_pool, TIMER_BLUR, 2);
-        vkCmdResetQueryPool(cbuf, renderer->query_pool, TIMER_BLUR_1, 2);
+        gpu_scope_begin(cbuf, "blur");
 
-        vulkan_start_timer(cbuf, renderer->query_pool, TIMER_BLUR);
+        if (renderer->compute_blur) {
+                blur_image_compute(renderer, screen_width, screen_height, pass_count,
+                        src_image_set, rect, with_threshold);
+
+                gpu_scope_end(cbuf);
+                wlr_log(WLR_DEBUG, "\t[CPU] blur (compute): %5.3f ms",
+                        (get_time() - start_time) * 1000);
+                return;
+        }
 
         int last_image_idx = 0;
-        int idx_to_time = 1;
         for (int i = 0; i < 2 * pass_count - 1; i++) {
                 int image_idx;
                 if (i < pass_count) {
@@ -240,7 +530,7 @@ void blur_image(struct wlr_vk_renderer *renderer,
                 if (blur_rect.extent.width < 1) blur_rect.extent.width = 1;
                 if (blur_rect.extent.height < 1) blur_rect.extent.height = 1;
 
-                begin_render_pass(cbuf, render_buf->blur_framebuffers[image_idx],
+                begin_render_pass(cbuf, transient->blur_framebuffers[image_idx],
                         render_buf->render_setup->blur_rpass[image_idx],
                         blur_rect, width, height);
 
@@ -248,7 +538,7 @@ void blur_image(struct wlr_vk_renderer *renderer,
                 if (i == 0) {
                         in_set = src_image_set;
                 } else {
-                        in_set = &render_buf->blur_sets[last_image_idx];
+                        in_set = &transient->blur_sets[last_image_idx];
                 }
 
                 vkCmdBindDescriptorSets(cbuf, VK_PIPELINE_BIND_POINT_GRAPHICS,
@@ -270,203 +560,326 @@ void blur_image(struct wlr_vk_renderer *renderer,
                         VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
                         0, sizeof(push_constants), &push_constants);
 
-                if (i == idx_to_time) {
-                        vulkan_start_timer(cbuf, renderer->query_pool, TIMER_BLUR_1);
-                }
+                gpu_scope_begin(cbuf, "pass %d", i);
                 vkCmdDraw(cbuf, 4, 1, 0, 0);
-                if (i == idx_to_time) {
-                        vulkan_end_timer(cbuf, renderer->query_pool, TIMER_BLUR_1);
-                }
+                gpu_scope_end(cbuf);
 
                 vkCmdEndRenderPass(cbuf);
 
                 last_image_idx = image_idx;
         }
 
-        vulkan_end_timer(cbuf, renderer->query_pool, TIMER_BLUR);
+        gpu_scope_end(cbuf);
 
         wlr_log(WLR_DEBUG, "\t[CPU] blur: %5.3f ms", (get_time() - start_time) * 1000);
 }
 
-static void render_surface(struct wlr_output *output, struct Surface *surface, bool is_focused,
-                bool clear) {
-	struct wlr_texture *wlr_texture = wlr_surface_get_texture(surface->wlr_surface);
-        if (wlr_texture == NULL) {
-                return;
+// Queue family ownership transfer so we can sample a dmabuf someone else
+// wrote to
+static void acquire_foreign_texture(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_texture *texture) {
+        VkImageMemoryBarrier barrier = {0};
+
+        VkImageLayout src_layout = VK_IMAGE_LAYOUT_GENERAL;
+        if (!texture->transitioned) {
+                src_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+                texture->transitioned = true;
         }
 
-        wlr_log(WLR_DEBUG, "Render texture with dims %d %d", surface->width, surface->height);
-        // Only make the surface clickable if it's an XDG surface.
-        bool render_uv = surface->xdg_surface != NULL;
+        // Acquire: make sure it's in SHADER_READ_ONLY before any
+        // shader reads
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_FOREIGN_EXT;
+        barrier.dstQueueFamilyIndex = renderer->dev->queue_family;
+        barrier.image = texture->image;
+        barrier.oldLayout = src_layout;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcAccessMask = 0u; // ignored anyways
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.layerCount = 1;
+        barrier.subresourceRange.levelCount = 1;
+
+        vkCmdPipelineBarrier(renderer->cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
+                        | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                0, 0, NULL, 0, NULL, 1, &barrier);
+}
 
-        struct wlr_vk_renderer *renderer = (struct wlr_vk_renderer *) output->renderer;
-        float time_since_spawn = get_time() - surface->spawn_time;
+static void release_foreign_texture(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_texture *texture) {
+        // Release: put it back in LAYOUT_GENERAL? I guess we do it so
+        // they can write a new image? idk.
+        VkImageMemoryBarrier barrier = {0};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = renderer->dev->queue_family;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_FOREIGN_EXT;
+        barrier.image = texture->image;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.dstAccessMask = 0u; // ignored anyways
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.layerCount = 1;
+        barrier.subresourceRange.levelCount = 1;
+
+        vkCmdPipelineBarrier(renderer->cb, VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
+                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL,
+                1, &barrier);
+
+        texture->owned = true;
+}
 
-        struct wlr_vk_render_buffer *render_buf = renderer->current_render_buffer;
+static VkRect2D rect_union(VkRect2D a, VkRect2D b) {
+        int x1 = a.offset.x < b.offset.x ? a.offset.x : b.offset.x;
+        int y1 = a.offset.y < b.offset.y ? a.offset.y : b.offset.y;
+        int a_x2 = a.offset.x + a.extent.width, b_x2 = b.offset.x + b.extent.width;
+        int a_y2 = a.offset.y + a.extent.height, b_y2 = b.offset.y + b.extent.height;
+        int x2 = a_x2 > b_x2 ? a_x2 : b_x2;
+        int y2 = a_y2 > b_y2 ? a_y2 : b_y2;
 
-        double start_time = get_time();
+        return (VkRect2D) {{x1, y1}, {x2 - x1, y2 - y1}};
+}
 
-        int screen_width = render_buf->wlr_buffer->width;
-        int screen_height = render_buf->wlr_buffer->height;
+static bool rects_overlap(VkRect2D a, VkRect2D b) {
+        return a.offset.x < b.offset.x + (int) b.extent.width
+                && b.offset.x < a.offset.x + (int) a.extent.width
+                && a.offset.y < b.offset.y + (int) b.extent.height
+                && b.offset.y < a.offset.y + (int) a.extent.height;
+}
 
+// Renders every surface with layers[i] == layer. They all sample the same
+// blur of the intermediate, so they must not overlap each other (or each
+// other's blur). rects[i] is where surfaces[i] gets drawn, already clipped to
+// the damage.
+static void render_layer(struct wlr_output *output, struct Surface **surfaces,
+                VkRect2D *rects, int *layers, int surface_count, int layer,
+                struct Surface *focused_surface) {
+        struct wlr_vk_renderer *renderer = (struct wlr_vk_renderer *) output->renderer;
+        struct wlr_vk_render_buffer *render_buf = renderer->current_render_buffer;
+        struct wlr_vk_transient_set *transient = vulkan_transient_set(renderer);
         VkCommandBuffer cbuf = renderer->cb;
         assert(render_buf != NULL);
         assert(cbuf != NULL);
 
-        // There might have already been a texture rendered, so reset the timers
-        vkCmdResetQueryPool(cbuf, renderer->query_pool, TIMER_RENDER_TEXTURE, 2);
-        vkCmdResetQueryPool(cbuf, renderer->query_pool, TIMER_RENDER_TEXTURE_1, 2);
-        // Start GPU timer
-        vulkan_start_timer(cbuf, renderer->query_pool, TIMER_RENDER_TEXTURE);
-
-        // Setup stuff for the texture we're about to render
-	struct wlr_vk_texture *texture = vulkan_get_texture(wlr_texture);
-	assert(texture->renderer == renderer);
-        bool is_foreign = texture->dmabuf_imported && !texture->owned;
-
-        if (is_foreign) {
-                // Acquire it
-	        VkImageMemoryBarrier barrier;
-
-		VkImageLayout src_layout = VK_IMAGE_LAYOUT_GENERAL;
-		if (!texture->transitioned) {
-			src_layout = VK_IMAGE_LAYOUT_UNDEFINED;
-			texture->transitioned = true;
-		}
+        double start_time = get_time();
 
-                // Acquire: make sure it's in SHADER_READ_ONLY before any
-                // shader reads
-		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_FOREIGN_EXT;
-		barrier.dstQueueFamilyIndex = renderer->dev->queue_family;
-		barrier.image = texture->image;
-		barrier.oldLayout = src_layout;
-		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		barrier.srcAccessMask = 0u; // ignored anyways
-		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		barrier.subresourceRange.layerCount = 1;
-		barrier.subresourceRange.levelCount = 1;
-
-                vkCmdPipelineBarrier(cbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
-                                | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                        0, 0, NULL, 0, NULL, 1, &barrier);
-        }
+        int screen_width = render_buf->wlr_buffer->width;
+        int screen_height = render_buf->wlr_buffer->height;
+
+        gpu_scope_begin(cbuf, "layer %d", layer);
 
-        VkRect2D rect;
-        get_rect_for_matrix(screen_width, screen_height, surface->matrix, 0, &rect);
+        // Figure out what the layer covers, and acquire its textures before
+        // any shader reads them
+        VkRect2D layer_rect, blur_rect;
+        int layer_size = 0;
+        for (int i = 0; i < surface_count; i++) {
+                if (layers[i] != layer) continue;
+                struct Surface *surface = surfaces[i];
+
+                // We need to blur a bigger area so junk from previous frames
+                // doesn't bleed into ours
+                VkRect2D inner_rect;
+                box_to_rect(screen_width, screen_height, surface->inner_box, 32, &inner_rect);
+
+                layer_rect = layer_size == 0 ? rects[i] : rect_union(layer_rect, rects[i]);
+                blur_rect = layer_size == 0 ? inner_rect : rect_union(blur_rect, inner_rect);
+                layer_size++;
+
+                struct wlr_vk_texture *texture =
+                        vulkan_get_texture(wlr_surface_get_texture(surface->wlr_surface));
+                assert(texture->renderer == renderer);
+                if (texture->dmabuf_imported && !texture->owned) {
+                        acquire_foreign_texture(renderer, texture);
+                }
+        }
+        assert(layer_size > 0);
 
         // Blur
         // Transition intermediate to SHADER_READ
-        vulkan_start_timer(cbuf, renderer->query_pool, TIMER_RENDER_TEXTURE_1);
         vulkan_image_transition_cbuf(cbuf,
-                render_buf->intermediate, VK_IMAGE_ASPECT_COLOR_BIT,
+                transient->intermediate, VK_IMAGE_ASPECT_COLOR_BIT,
                 VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
                 VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
                 1);
 
         blur_image(renderer, screen_width, screen_height, BLUR_PASSES,
-                &render_buf->intermediate_set, surface->inner_matrix, false);
+                &transient->intermediate_set, blur_rect, false);
 
-        wlr_log(WLR_DEBUG, "\t[CPU] render_texture subsection: %5.3f ms",
+        wlr_log(WLR_DEBUG, "\t[CPU] render_layer subsection: %5.3f ms",
                 (get_time() - start_time) * 1000);
 
-        // Transition blur image to SHADER_READ_ONLY
-        vulkan_image_transition_cbuf(cbuf,
-                render_buf->blurs[0], VK_IMAGE_ASPECT_COLOR_BIT,
-                VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-                VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
-                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                1);
-
-        vulkan_end_timer(cbuf, renderer->query_pool, TIMER_RENDER_TEXTURE_1);
+        // Transition blur image to SHADER_READ_ONLY. The compute blur already
+        // leaves it there.
+        if (!renderer->compute_blur) {
+                vulkan_image_transition_cbuf(cbuf,
+                        transient->blurs[0], VK_IMAGE_ASPECT_COLOR_BIT,
+                        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+                        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                        1);
+        }
 
-        // Bind pipeline and descriptor sets
+        // Bind pipeline
 	VkPipeline pipe = renderer->current_render_buffer->render_setup->tex_pipe;
 	if (pipe != renderer->bound_pipe) {
 		vkCmdBindPipeline(cbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipe);
 		renderer->bound_pipe = pipe;
 	}
 
-        // Starts the command buffer and enters the render pass
-        VkRenderPass rpass = clear ? render_buf->render_setup->rpass_clear
-                : render_buf->render_setup->rpass;
-        begin_render_pass(cbuf, render_buf->framebuffer,
-                rpass, rect, screen_width, screen_height);
-        renderer->scissor = rect;
+        // One render pass for the whole layer, each surface gets its own
+        // scissor
+        begin_render_pass(cbuf, transient->framebuffer,
+                render_buf->render_setup->rpass, layer_rect, screen_width, screen_height);
 
-        VkDescriptorSet desc_sets[] = {render_buf->blur_sets[0], texture->ds};
+        double now = get_time();
+        for (int i = 0; i < surface_count; i++) {
+                if (layers[i] != layer) continue;
+                struct Surface *surface = surfaces[i];
+                struct wlr_vk_texture *texture =
+                        vulkan_get_texture(wlr_surface_get_texture(surface->wlr_surface));
 
-	vkCmdBindDescriptorSets(cbuf, VK_PIPELINE_BIND_POINT_GRAPHICS,
-		renderer->pipe_layout, 0, sizeof(desc_sets) / sizeof(desc_sets[0]),
-                desc_sets, 0, NULL);
+                wlr_log(WLR_DEBUG, "Render texture with dims %d %d",
+                        TRANSFORM(surface, width), TRANSFORM(surface, height));
+                // Only make the surface clickable if it's an XDG surface.
+                bool render_uv = surface->xdg_surface != NULL;
 
-	// Draw
-        struct PushConstants push_constants = {0};
-        memcpy(push_constants.mat4, surface->matrix, sizeof(push_constants.mat4));
+                vkCmdSetScissor(cbuf, 0, 1, &rects[i]);
+                renderer->scissor = rects[i];
 
-        push_constants.surface_id[0] = surface->id;
-        push_constants.surface_id[1] = render_uv ? 1 : 0;
-        push_constants.surface_dims[0] = surface->width;
-        push_constants.surface_dims[1] = surface->height;
-        push_constants.screen_dims[0] = screen_width;
-        push_constants.screen_dims[1] = screen_height;
-        push_constants.is_focused = is_focused;
-        push_constants.time_since_spawn = time_since_spawn;
+                VkDescriptorSet desc_sets[] = {transient->blur_sets[0], texture->ds};
 
-	vkCmdPushConstants(cbuf, renderer->pipe_layout,
-		VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
-                0, sizeof(push_constants), &push_constants);
+                vkCmdBindDescriptorSets(cbuf, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                        renderer->pipe_layout, 0, sizeof(desc_sets) / sizeof(desc_sets[0]),
+                        desc_sets, 0, NULL);
 
-        // This costs about 0.8ms in fullscreen.
-	vkCmdDraw(cbuf, 4, 1, 0, 0);
+                // Draw
+                struct PushConstants push_constants = {0};
+                memcpy(push_constants.mat4, surface->matrix, sizeof(push_constants.mat4));
+
+                push_constants.surface_id[0] = surface->id;
+                push_constants.surface_id[1] = render_uv ? 1 : 0;
+                push_constants.surface_dims[0] = TRANSFORM(surface, width);
+                push_constants.surface_dims[1] = TRANSFORM(surface, height);
+                push_constants.screen_dims[0] = screen_width;
+                push_constants.screen_dims[1] = screen_height;
+                push_constants.is_focused = surface == focused_surface;
+                push_constants.time_since_spawn = now - TRANSFORM(surface, spawn_time);
+
+                vkCmdPushConstants(cbuf, renderer->pipe_layout,
+                        VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+                        0, sizeof(push_constants), &push_constants);
+
+                // This costs about 0.8ms in fullscreen.
+                gpu_scope_begin(cbuf, "surface %u", surface->id);
+                vkCmdDraw(cbuf, 4, 1, 0, 0);
+                gpu_scope_end(cbuf);
+        }
+
+        // Then UV and ID. Surfaces in a layer don't overlap, so doing it
+        // separately doesn't change anything and saves pipeline switches.
+        pipe = render_buf->render_setup->id_pipe;
+        vkCmdBindPipeline(cbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipe);
+        renderer->bound_pipe = pipe;
+        for (int i = 0; i < surface_count; i++) {
+                if (layers[i] != layer) continue;
+                struct Surface *surface = surfaces[i];
+
+                vkCmdSetScissor(cbuf, 0, 1, &rects[i]);
+                renderer->scissor = rects[i];
+
+                struct PushConstants push_constants = {0};
+                memcpy(push_constants.mat4, surface->matrix, sizeof(push_constants.mat4));
+                push_constants.surface_id[0] = surface->id;
+                push_constants.surface_dims[0] = TRANSFORM(surface, width);
+                push_constants.surface_dims[1] = TRANSFORM(surface, height);
+
+                vkCmdPushConstants(cbuf, renderer->pipe_layout,
+                        VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+                        0, sizeof(push_constants), &push_constants);
+                vkCmdDraw(cbuf, 4, 1, 0, 0);
+        }
 
         // Finish
 	vkCmdEndRenderPass(cbuf);
 
-        if (is_foreign) {
-                // Release: put it back in LAYOUT_GENERAL? I guess we do it so
-                // they can write a new image? idk.
-                VkImageMemoryBarrier barrier = {0};
-		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		barrier.srcQueueFamilyIndex = renderer->dev->queue_family;
-		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_FOREIGN_EXT;
-		barrier.image = texture->image;
-		barrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-		barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-		barrier.dstAccessMask = 0u; // ignored anyways
-		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		barrier.subresourceRange.layerCount = 1;
-		barrier.subresourceRange.levelCount = 1;
-
-                vkCmdPipelineBarrier(cbuf, VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
-                        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL,
-                        1, &barrier);
-
-                texture->owned = true;
+        for (int i = 0; i < surface_count; i++) {
+                if (layers[i] != layer) continue;
+                struct wlr_vk_texture *texture =
+                        vulkan_get_texture(wlr_surface_get_texture(surfaces[i]->wlr_surface));
+                if (texture->dmabuf_imported && !texture->owned) {
+                        release_foreign_texture(renderer, texture);
+                }
+
+                // I don't really know what this does, vulkan_texture_destroy uses it
+                texture->last_used = renderer->frame;
         }
 
-        // End GPU timer
-        vulkan_end_timer(cbuf, renderer->query_pool, TIMER_RENDER_TEXTURE);
+        gpu_scope_end(cbuf);
+
+        wlr_log(WLR_DEBUG, "\t[CPU] render_layer: %d surfaces, %5.3f ms", layer_size,
+                (get_time() - start_time) * 1000);
+}
 
-        // I don't really know what this does, vulkan_texture_destroy uses it
-        texture->last_used = renderer->frame;
+void draw_list_add(struct Surface *surface) {
+        if (draw_list.count == draw_list.capacity) {
+                draw_list.capacity = draw_list.capacity == 0 ? 64 : draw_list.capacity * 2;
+                draw_list.surfaces = realloc(draw_list.surfaces,
+                        draw_list.capacity * sizeof(draw_list.surfaces[0]));
+                draw_list.layers = realloc(draw_list.layers,
+                        draw_list.capacity * sizeof(draw_list.layers[0]));
+                draw_list.rects = realloc(draw_list.rects,
+                        draw_list.capacity * sizeof(draw_list.rects[0]));
+                assert(draw_list.surfaces != NULL && draw_list.layers != NULL
+                        && draw_list.rects != NULL);
+        }
 
-        wlr_log(WLR_DEBUG, "\t[CPU] render_texture: %5.3f ms", (get_time() - start_time) * 1000);
+        draw_list.surfaces[draw_list.count++] = surface;
+        draw_list.unsorted = true;
 }
 
-// Comparison function so we can qsort surfaces by Z.
-int surface_comp(const void *a, const void *b) {
-        // That's a lot of parentheses!
-        float a_z = (*((struct Surface **) a))->z;
-        float b_z = (*((struct Surface **) b))->z;
+void draw_list_remove(struct Surface *surface) {
+        for (int i = 0; i < draw_list.count; i++) {
+                if (draw_list.surfaces[i] != surface) continue;
+
+                // Shift the rest down so it stays sorted
+                memmove(&draw_list.surfaces[i], &draw_list.surfaces[i + 1],
+                        (draw_list.count - i - 1) * sizeof(draw_list.surfaces[0]));
+                draw_list.count--;
+                return;
+        }
+}
 
-        return (a_z > b_z) - (a_z < b_z);
+void draw_list_z_changed() {
+        draw_list.unsorted = true;
+}
+
+void draw_list_finish() {
+        free(draw_list.surfaces);
+        free(draw_list.layers);
+        free(draw_list.rects);
+        memset(&draw_list, 0, sizeof(draw_list));
+}
+
+// Insertion sort by Z. The list is almost always sorted already, in which
+// case this is one comparison per surface. It's also stable, so surfaces with
+// the same Z stay in the order they were created.
+static void draw_list_sort() {
+        for (int i = 1; i < draw_list.count; i++) {
+                struct Surface *surface = draw_list.surfaces[i];
+                float z = TRANSFORM(surface, z);
+                int j = i - 1;
+                while (j >= 0 && TRANSFORM(draw_list.surfaces[j], z) > z) {
+                        draw_list.surfaces[j + 1] = draw_list.surfaces[j];
+                        j--;
+                }
+                draw_list.surfaces[j + 1] = surface;
+        }
+
+        draw_list.unsorted = false;
 }
 
 // Inserts pipeline barriers so noone else is using our images before we do.
@@ -513,19 +926,27 @@ void render_begin(struct wlr_renderer *wlr_renderer, uint32_t width, uint32_t he
 	struct wlr_vk_renderer *renderer = vulkan_get_renderer(wlr_renderer);
 	assert(renderer->current_render_buffer);
         struct wlr_vk_render_buffer *render_buf = renderer->current_render_buffer;
+        struct wlr_vk_transient_set *transient = vulkan_transient_set(renderer);
         assert(render_buf != NULL);
-        VkCommandBuffer cbuf = renderer->cb;
 
         double start_time = get_time();
 
-        cbuf_begin_onetime(cbuf);
+        // Only slow the first time an output uses this format
+        vulkan_prepare_render_setup(renderer, render_buf->render_setup, WLR_VK_USAGE_FULL);
+
+        // Waits for a free frame slot, and for the GPU to be done with this
+        // render buffer. Also resets the timers.
+        vulkan_begin_frame(renderer);
+        VkCommandBuffer cbuf = renderer->cb;
 
-        // Reset timers
-        vkCmdResetQueryPool(cbuf, renderer->query_pool, 0, TIMER_COUNT * 2);
+        // For vulkan_transient_age next time this set comes around, and so
+        // it isn't destroyed while the GPU still uses it
+        transient->frame = renderer->frame;
+        transient->drawn = ++render_buf->transients->frame_count;
 
-        // Start GPU timers
-        vulkan_start_timer(cbuf, renderer->query_pool, TIMER_RENDER_BEGIN);
-        vulkan_start_timer(cbuf, renderer->query_pool, TIMER_EVERYTHING);
+        // Everything else this frame nests in here, it ends in render_end
+        gpu_scope_begin(cbuf, "frame");
+        gpu_scope_begin(cbuf, "render_begin");
 
 	renderer->render_width = width;
 	renderer->render_height = height;
@@ -534,8 +955,7 @@ void render_begin(struct wlr_renderer *wlr_renderer, uint32_t width, uint32_t he
         // Acquire images
         insert_acquire_barrier(renderer);
 
-        // End GPU timer
-        vulkan_end_timer(cbuf, renderer->query_pool, TIMER_RENDER_BEGIN);
+        gpu_scope_end(cbuf);
 
         wlr_log(WLR_DEBUG, "\t[CPU] render_begin: %5.3f ms", (get_time() - start_time) * 1000);
 }
@@ -545,6 +965,7 @@ void render_end(struct wlr_renderer *wlr_renderer, float colorscheme_ratio,
 	struct wlr_vk_renderer *renderer = vulkan_get_renderer(wlr_renderer);
 	assert(renderer->current_render_buffer);
         struct wlr_vk_render_buffer *render_buf = renderer->current_render_buffer;
+        struct wlr_vk_transient_set *transient = vulkan_transient_set(renderer);
         VkCommandBuffer cbuf = renderer->cb;
 
         double start_time = get_time();
@@ -552,13 +973,19 @@ void render_end(struct wlr_renderer *wlr_renderer, float colorscheme_ratio,
         int width = renderer->render_width;
         int height = renderer->render_height;
 
-        // Start GPU timer
-        vulkan_start_timer(cbuf, renderer->query_pool, TIMER_RENDER_END);
+        gpu_scope_begin(cbuf, "render_end");
 
-	// Copy UV to host-visible memory, but only the pixel under the cursor
-        // Transition UV to TRANSFER_SRC_OPTIMAL
+	// Copy UV and ID to host-visible memory, but only the pixel under the
+	// cursor
+        // Transition UV and ID to TRANSFER_SRC_OPTIMAL
         vulkan_image_transition_cbuf(cbuf,
-                render_buf->uv, VK_IMAGE_ASPECT_COLOR_BIT,
+                transient->uv, VK_IMAGE_ASPECT_COLOR_BIT,
+                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, 1);
+        vulkan_image_transition_cbuf(cbuf,
+                transient->id, VK_IMAGE_ASPECT_COLOR_BIT,
                 VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
                 VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
@@ -567,7 +994,19 @@ void render_end(struct wlr_renderer *wlr_renderer, float colorscheme_ratio,
         assert(renderer->cursor_x < width);
         assert(renderer->cursor_y < height);
 
+        // This frame's slot in the readback ring. The GPU is done with
+        // whatever frame used it last, vulkan_begin_frame waited for that.
+        struct wlr_vk_transients *transients = render_buf->transients;
+        struct wlr_vk_uv_readback *readback =
+                &transients->readbacks[renderer->frame_slot_idx];
+        VkDeviceSize readback_offset =
+                renderer->frame_slot_idx * sizeof(struct wlr_vk_uv_readback);
+        readback->frame = renderer->frame;
+        readback->cursor_x = renderer->cursor_x;
+        readback->cursor_y = renderer->cursor_y;
+
         VkBufferImageCopy uv_copy_region = {
+                .bufferOffset = readback_offset + offsetof(struct wlr_vk_uv_readback, u),
                 .bufferRowLength = 1, .bufferImageHeight = 1,
                 .imageSubresource = {
                         .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
@@ -579,48 +1018,72 @@ void render_end(struct wlr_renderer *wlr_renderer, float colorscheme_ratio,
         };
 
         vkCmdCopyImageToBuffer(cbuf,
-                render_buf->uv, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                render_buf->host_uv,
+                transient->uv, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                transients->readback,
                 1, &uv_copy_region);
 
-        VkRect2D rect = {{0, 0}, {width, height}};
+        // Both are 4 bytes per pixel, the ID goes right after the UV
+        VkBufferImageCopy id_copy_region = uv_copy_region;
+        id_copy_region.bufferOffset = readback_offset + offsetof(struct wlr_vk_uv_readback, id);
+        vkCmdCopyImageToBuffer(cbuf,
+                transient->id, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                transients->readback,
+                1, &id_copy_region);
+
+        // So check_uv_gpu sees the copies once the frame's fence has signalled
+        VkMemoryBarrier host_barrier = {
+                .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+        };
+        vkCmdPipelineBarrier(cbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &host_barrier, 0, NULL, 0, NULL);
+
+        VkRect2D rect = renderer->damage_rect;
         renderer->scissor = rect;
 
         // Transition intermediate to TRANSFER_SRC
         vulkan_image_transition_cbuf(cbuf,
-                render_buf->intermediate, VK_IMAGE_ASPECT_COLOR_BIT,
+                transient->intermediate, VK_IMAGE_ASPECT_COLOR_BIT,
                 VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
                 VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
                 1);
 
         // Blur entire intermediate
         // Only do 3 passes
-        mat4 matrix = {{2, 0, 0, 0}, {0, 2, 0, 0}, {0, 0, 1, 0}, {-1, -1, 0, 1}};
-        blur_image(renderer, width, height, 3, &render_buf->intermediate_set, matrix, true);
+        VkRect2D full_rect = {{0, 0}, {width, height}};
+        blur_image(renderer, width, height, 3, &transient->intermediate_set, full_rect, true);
 
         // Postprocess pass
         struct wlr_vk_render_format_setup *setup = render_buf->render_setup;
         vkCmdBindPipeline(cbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, setup->postprocess_pipe);
         renderer->bound_pipe = setup->postprocess_pipe;
 
-        // Transition UV to SHADER_READ_ONLY
+        // Transition UV to SHADER_READ_ONLY. ID isn't read by anything, but
+        // the next frame's render pass expects it in the same layout as UV.
         vulkan_image_transition_cbuf(cbuf,
-                render_buf->uv, VK_IMAGE_ASPECT_COLOR_BIT,
+                transient->uv, VK_IMAGE_ASPECT_COLOR_BIT,
                 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
                 VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_READ_BIT,
                 VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
                 1);
+        vulkan_image_transition_cbuf(cbuf,
+                transient->id, VK_IMAGE_ASPECT_COLOR_BIT,
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                VK_ACCESS_TRANSFER_READ_BIT, 0,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                1);
 
         // Begin render pass
         begin_postprocess_render_pass(renderer->cb,
-                render_buf->postprocess_framebuffer,
+                render_buf->postprocess_framebuffers[renderer->frame_slot_idx],
                 setup->postprocess_rpass, rect, width, height);
 
         // Bind descriptors
-        VkDescriptorSet desc_sets[] = {render_buf->intermediate_set,
-                render_buf->uv_set, render_buf->blur_sets[0]};
+        VkDescriptorSet desc_sets[] = {transient->intermediate_set,
+                transient->uv_set, transient->blur_sets[0]};
 
 	vkCmdBindDescriptorSets(cbuf, VK_PIPELINE_BIND_POINT_GRAPHICS,
 		renderer->pipe_layout, 0, sizeof(desc_sets) / sizeof(desc_sets[0]),
@@ -641,22 +1104,26 @@ void render_end(struct wlr_renderer *wlr_renderer, float colorscheme_ratio,
 	vkCmdPushConstants(cbuf, renderer->pipe_layout,
                 VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
                 12, 16, &dst_colorscheme_idx);
-        vulkan_start_timer(cbuf, renderer->query_pool, TIMER_RENDER_END_1);
+        gpu_scope_begin(cbuf, "postprocess");
         vkCmdDraw(cbuf, 4, 1, 0, 0);
-        vulkan_end_timer(cbuf, renderer->query_pool, TIMER_RENDER_END_1);
+        gpu_scope_end(cbuf);
 
         vkCmdEndRenderPass(cbuf);
 
-        // End GPU timers
-        vulkan_end_timer(cbuf, renderer->query_pool, TIMER_EVERYTHING);
-        vulkan_end_timer(cbuf, renderer->query_pool, TIMER_RENDER_END);
+        // render_end, then frame
+        gpu_scope_end(cbuf);
+        gpu_scope_end(cbuf);
 
         // Submit
         double pre_submit_time = get_time();
         double elapsed = (pre_submit_time - start_time) * 1000;
         wlr_log(WLR_DEBUG, "\t[CPU] render_end up to submit: %5.3f ms", elapsed);
 
-        cbuf_submit_wait(renderer->dev->queue, renderer->cb);
+        // Doesn't wait for the GPU. The timestamps are read once the frame
+        // is retired, which is also where the [GPU] logs come from.
+        if (!vulkan_submit_frame(renderer)) {
+                wlr_log(WLR_ERROR, "Couldn't submit frame");
+        }
 
         elapsed = (get_time() - pre_submit_time) * 1000;
         wlr_log(WLR_DEBUG, "\t[CPU] Submit: %5.2f ms", elapsed);
@@ -664,54 +1131,20 @@ void render_end(struct wlr_renderer *wlr_renderer, float colorscheme_ratio,
 	renderer->bound_pipe = VK_NULL_HANDLE;
 	renderer->render_width = 0;
 	renderer->render_height = 0;
-
-        // Check GPU timestamps
-        for (int i = 0; i < TIMER_COUNT; i++) {
-                // There's always the start and the end timer, so the index goes up by 2s.
-                int timer_idx = 2*i;
-                elapsed = vulkan_get_elapsed(renderer->dev->dev, renderer->query_pool,
-                        renderer->dev->instance->timestamp_period, timer_idx);
-                if (elapsed != -1) {
-                        renderer->timer_sums[i] += elapsed;
-                        renderer->timer_counts[i] ++;
-                }
-                float avg = renderer->timer_sums[i] / renderer->timer_counts[i];
-
-                wlr_log(WLR_DEBUG, "\t[GPU] %s: %5.3f ms (%5.3f ms avg)", TIMER_NAMES[i],
-                        elapsed * 1000, avg * 1000);
-        }
-
-        // Destroy pending textures
-        struct wlr_vk_texture *texture, *tmp_tex;
-        wl_list_for_each_safe(texture, tmp_tex, &renderer->destroy_textures, destroy_link) {
-                wlr_log(WLR_DEBUG, "Destroy texture %p", texture);
-                wlr_texture_destroy(&texture->wlr_texture);
-        }
-
-        // This marks it as the most recent I think
-        renderer->frame++;
-        render_buf->frame = renderer->frame;
-
-        // "release stage allocations", not sure what it really does
-	struct wlr_vk_shared_buffer *buf;
-	wl_list_for_each(buf, &renderer->stage.buffers, link) {
-		buf->allocs_size = 0u;
-	}
-
-        renderer->render_width = 0;
-        renderer->render_height = 0;
 }
 
 // `surfaces` should be a list of struct Surface, defined in vkwc.c
 // TODO: struct for colorscheme stuff
 bool draw_frame(struct wlr_output *output, struct wl_list *surfaces,
                 struct Surface *focused_surface, int cursor_x, int cursor_y,
-                float colorscheme_ratio, int src_colorscheme_idx, int dst_colorscheme_idx) {
+                float colorscheme_ratio, int src_colorscheme_idx, int dst_colorscheme_idx,
+                pixman_region32_t *damage) {
         if (start_time == 0) {
                 start_time = get_time();
         }
 
         double frame_start_time = get_time();
+        uint64_t frame_alloc_count = get_alloc_count();
 
 	// Get the renderer, i.e. Vulkan or GLES2
 	struct wlr_renderer *renderer =	output->renderer;
@@ -721,42 +1154,151 @@ bool draw_frame(struct wlr_output *output, struct wl_list *surfaces,
 	wlr_output_attach_render(output, &buffer_age);
 
 	struct wlr_vk_renderer *vk_renderer = (struct wlr_vk_renderer *) renderer;
-	render_begin(renderer, output->width, output->height);
+        // Only does anything the first time this buffer gets drawn to
+        vulkan_prepare_render_buffer(vk_renderer, vk_renderer->current_render_buffer);
+        int width = output->width;
+        int height = output->height;
+
+        // Work out what changed since the last frame
+        pixman_region32_t frame_damage;
+        pixman_region32_init(&frame_damage);
+        int rect_count;
+        pixman_box32_t *rects = pixman_region32_rectangles(damage, &rect_count);
+        for (int i = 0; i < rect_count; i++) {
+                add_damage(&frame_damage, rects[i]);
+        }
+        pixman_region32_clear(damage);
 
         // Sort the surfaces by distance from the camera
-        int surface_count = 0;
-        struct Surface *surface;
-	wl_list_for_each(surface, surfaces, link) {
-                surface_count++;
-	};
+        uint64_t sort_alloc_count = get_alloc_count();
+        if (draw_list.unsorted) draw_list_sort();
+        update_visibility(width, height);
+        if (get_alloc_count() != sort_alloc_count) {
+                wlr_log(WLR_ERROR, "Sorting made %lu allocations",
+                        (unsigned long) (get_alloc_count() - sort_alloc_count));
+        }
 
-        struct Surface **surfaces_sorted = malloc(sizeof(surfaces_sorted[0]) * surface_count);
-        int surface_idx = 0;
-	wl_list_for_each(surface, surfaces, link) {
-                surfaces_sorted[surface_idx++] = surface;
-	};
-        assert(surface_idx == surface_count);
+        collect_surface_damage(surfaces, focused_surface, width, height, &frame_damage);
+
+        if (width != last_width || height != last_height
+                        || vk_renderer->postprocess_mode != last_postprocess_mode
+                        || vk_renderer->compute_blur != last_compute_blur
+                        || colorscheme_ratio != last_colorscheme_ratio
+                        || src_colorscheme_idx != last_src_colorscheme_idx
+                        || dst_colorscheme_idx != last_dst_colorscheme_idx) {
+                pixman_region32_union_rect(&frame_damage, &frame_damage, 0, 0, width, height);
+                last_width = width;
+                last_height = height;
+                last_postprocess_mode = vk_renderer->postprocess_mode;
+                last_compute_blur = vk_renderer->compute_blur;
+                last_colorscheme_ratio = colorscheme_ratio;
+                last_src_colorscheme_idx = src_colorscheme_idx;
+                last_dst_colorscheme_idx = dst_colorscheme_idx;
+        }
+
+        // The frame counter changes every frame
+        add_damage(&frame_damage, (pixman_box32_t) {10, 10, 20, 20});
+
+        pixman_region32_intersect_rect(&frame_damage, &frame_damage, 0, 0, width, height);
+
+        if (!vk_renderer->current_render_buffer->transitioned) buffer_age = 0;
+        // The intermediate, UV and so on are shared between the output's
+        // render buffers and can be older or newer than the screen. Outside
+        // of the damage both have to be up to date, so the older one wins.
+        int transient_age = vulkan_transient_age(vk_renderer);
+        if (buffer_age <= 0 || transient_age <= 0) {
+                buffer_age = 0;
+        } else if (transient_age > buffer_age) {
+                buffer_age = transient_age;
+        }
 
-        qsort(surfaces_sorted, surface_count, sizeof(surfaces_sorted[0]), surface_comp);
+        pixman_region32_t repaint;
+        pixman_region32_init(&repaint);
+        get_repaint_region(&frame_damage, buffer_age, width, height, &repaint);
+
+        // Render passes only take one rect, so we repaint the bounding box
+        pixman_box32_t *extents = pixman_region32_extents(&repaint);
+        vk_renderer->damage_rect = (VkRect2D) {
+                {extents->x1, extents->y1},
+                {extents->x2 - extents->x1, extents->y2 - extents->y1}
+        };
+        pixman_region32_fini(&repaint);
+
+	render_begin(renderer, width, height);
 
         // Draw frame counter.
 	float color[4] = { rand()%2, rand()%2, rand()%2, 1.0 };
 	render_rect_simple(renderer, color, 10, 10, 10, 10, true);
         wlr_log(WLR_DEBUG, "----");
 
-	// Draw each surface
+        uint64_t alloc_count = get_alloc_count();
+        struct Surface **surfaces_sorted = draw_list.surfaces;
+        int surface_count = draw_list.count;
+
+	// Split the surfaces into layers. A surface goes one layer above the
+	// highest surface below it that it overlaps (counting the blur's reach),
+	// so each layer only needs one blur of the intermediate. Without
+	// layered_blur every surface is its own layer, which is what we used to
+	// do.
+        int *layers = draw_list.layers;
+        VkRect2D *rects = draw_list.rects;
+        int layer_count = 0;
+        int cull_count = 0;
         for (int i = 0; i < surface_count; i++) {
                 struct Surface *surface = surfaces_sorted[i];
-                if (surface->width == 0 && surface->height == 0) {
+                layers[i] = -1;
+                if (TRANSFORM(surface, width) == 0 && TRANSFORM(surface, height) == 0) {
                         wlr_log(WLR_DEBUG, "Skip surface, toplevel has dims %d %d",
-                                surface->toplevel->width, surface->toplevel->height);
+                                TRANSFORM(surface->toplevel, width), TRANSFORM(surface->toplevel, height));
+                        continue;
+                }
+                if (wlr_surface_get_texture(surface->wlr_surface) == NULL) continue;
+                if (is_culled(surface)) {
+                        cull_count++;
                         continue;
                 }
 
-                wlr_log(WLR_DEBUG, "Draw surface with dims %d %d",
-                        surface->width, surface->height);
-		render_surface(output, surface, surface == focused_surface, false);
-	};
+                box_to_rect(width, height, surface->box, 0, &rects[i]);
+                if (!clip_rect(&rects[i], vk_renderer->damage_rect)) {
+                        // None of it is being repainted
+                        continue;
+                }
+
+                if (!vk_renderer->layered_blur) {
+                        layers[i] = layer_count++;
+                        continue;
+                }
+
+                VkRect2D reach = rects[i];
+                reach.offset.x -= DAMAGE_PADDING;
+                reach.offset.y -= DAMAGE_PADDING;
+                reach.extent.width += 2 * DAMAGE_PADDING;
+                reach.extent.height += 2 * DAMAGE_PADDING;
+
+                int layer = 0;
+                for (int j = 0; j < i; j++) {
+                        if (layers[j] >= layer && rects_overlap(reach, rects[j])) {
+                                layer = layers[j] + 1;
+                        }
+                }
+                layers[i] = layer;
+                if (layer >= layer_count) layer_count = layer + 1;
+        }
+
+        // Everything up to here is ours, so it shouldn't need any memory
+        // once the draw list is big enough
+        if (get_alloc_count() != alloc_count) {
+                wlr_log(WLR_ERROR, "Layering made %lu allocations",
+                        (unsigned long) (get_alloc_count() - alloc_count));
+        }
+
+	// Draw each layer
+        for (int i = 0; i < layer_count; i++) {
+                render_layer(output, surfaces_sorted, rects, layers, surface_count, i,
+                        focused_surface);
+        }
+        wlr_log(WLR_DEBUG, "Drew %d surfaces in %d layers, %d culled", surface_count,
+                layer_count, cull_count);
         wlr_log(WLR_DEBUG, "----");
 
 	// Finish
@@ -777,8 +1319,15 @@ bool draw_frame(struct wlr_output *output, struct wl_list *surfaces,
 	wlr_output_transformed_resolution(output, &tr_width, &tr_height);
 
         wlr_log(WLR_DEBUG, "Average FPS: %10.5f, ms this frame: %5.2f", framerate, frame_ms);
+        // Counts pixman, wlroots and the driver too, so this won't be 0
+        wlr_log(WLR_DEBUG, "Allocations this frame: %lu",
+                (unsigned long) (get_alloc_count() - frame_alloc_count));
 
         frame_count++;
 
+        // Lets the display skip the rest, e.g. with KMS FB_DAMAGE_CLIPS
+        wlr_output_set_damage(output, &frame_damage);
+        pixman_region32_fini(&frame_damage);
+
 	return wlr_output_commit(output);
 }
@@ -2,15 +2,27 @@
 #define render_h_INCLUDED
 
 #include <wayland-server-core.h>
+#include <pixman-1/pixman.h>
 
 #include "surface.h"
 
 // surfaces has type struct Surface from surface.h
+// damage is anything else that changed on screen since the last frame, it
+// gets cleared.
 bool draw_frame(struct wlr_output *output, struct wl_list *surfaces,
                 struct Surface *focused_surface, int cursor_x, int cursor_y,
-                float colorscheme_ratio, int src_colorscheme_idx, int dst_colorscheme_idx);
+                float colorscheme_ratio, int src_colorscheme_idx, int dst_colorscheme_idx,
+                pixman_region32_t *damage);
 
 void print_scene_graph(struct wlr_scene_node *node, int	level);
 
+// draw_frame keeps its own list of surfaces sorted by Z. create_surface and
+// surface_handle_destroy add and remove surfaces, and anything that changes
+// a Z has to call draw_list_z_changed.
+void draw_list_add(struct Surface *surface);
+void draw_list_remove(struct Surface *surface);
+void draw_list_z_changed();
+void draw_list_finish();
+
 #endif // render_h_INCLUDED
 
@@ -11,6 +11,7 @@
 #include <wlr/render/interface.h>
 
 #include "../vulkan/error.h"
+#include "../vulkan/memory.h"
 #include "../vulkan/timer.h"
 
 #define WLR_VK_RENDER_MODE_COUNT 3
@@ -18,6 +19,11 @@
 // This is in a single direction (so downsample or upsample). Total passes is
 // double this.
 #define BLUR_PASSES 5
+// How many frames the CPU may record ahead of the GPU. wlroots swapchains are
+// double buffered in the common case, so this is one slot per render buffer
+// that can actually be in flight. Setting it to 1 gets the old fully
+// serialized behaviour back.
+#define FRAMES_IN_FLIGHT 2
 
 // Used for all shaders
 struct PushConstants {
@@ -28,13 +34,21 @@ struct PushConstants {
         // surface ID, second component is alpha (should be 0 or 1). Alpha will
         // be 1 except for textures we want to draw without them absorbing
         // clicks, like Firefox's weird subsurface setup.
-        float surface_id[2];
+        uint32_t surface_id[2];
         float surface_dims[2];
         float screen_dims[2];
         float is_focused;
         float time_since_spawn;
 };
 
+// Push constants for blur.comp
+struct BlurComputePushConstants {
+        int32_t offset[2];
+        int32_t extent[2];
+        float dst_dims[2];
+        float mode;
+};
+
 struct wlr_vk_descriptor_pool;
 
 // Central vulkan state that should only be needed once per compositor.
@@ -80,14 +94,32 @@ struct wlr_vk_device {
 	size_t extension_count;
 	const char **extensions;
 
-	// we only ever need one queue for rendering and transfer commands
+	// rendering, and transfers if there's no separate transfer queue
 	uint32_t queue_family;
 	VkQueue queue;
 
+        // Separate queue for shm uploads and screencopy readbacks, so they
+        // can run on the copy engine next to rendering. Either from a
+        // transfer-only family or a second queue of queue_family. Needs
+        // timeline semaphores to sync with the graphics queue.
+        bool has_transfer_queue;
+        uint32_t transfer_queue_family;
+        VkQueue transfer_queue;
+
 	struct {
 		PFN_vkGetMemoryFdPropertiesKHR getMemoryFdPropertiesKHR;
+		PFN_vkGetSemaphoreFdKHR getSemaphoreFdKHR;
 	} api;
 
+        // Whether we can give KMS a sync_file to wait on instead of waiting
+        // for the GPU ourselves before every commit. Needs
+        // VK_KHR_external_semaphore_fd and DMA_BUF_IOCTL_IMPORT_SYNC_FILE.
+        bool implicit_sync_interop;
+
+        // Queried once, vulkan_find_mem_type and the allocator look at these
+        VkPhysicalDeviceMemoryProperties mem_props;
+        VkDeviceSize buffer_image_granularity;
+
 	uint32_t format_prop_count;
 	struct wlr_vk_format_props *format_props;
 	struct wlr_drm_format_set dmabuf_render_formats;
@@ -152,73 +184,143 @@ struct wlr_vk_format_modifier_props *vulkan_format_props_find_modifier(
 	struct wlr_vk_format_props *props, uint64_t mod, bool render);
 void vulkan_format_props_finish(struct wlr_vk_format_props *props);
 
+// What a render buffer gets drawn with. The cursor only needs the simple
+// pipeline, outputs need everything else.
+enum wlr_vk_render_usage {
+        WLR_VK_USAGE_SIMPLE = 1 << 0,
+        WLR_VK_USAGE_FULL = 1 << 1,
+};
+
 // For each format we want to render, we need a separate renderpass
-// and therefore also separate pipelines.
-// TODO: Maybe get rid of this? It means I create all kinds of unnecessary shit
-// just for the cursor, for example.
+// and therefore also separate pipelines. The render passes are cheap and the
+// framebuffers need them, so they're always made. Pipelines are only made
+// for the usages a buffer of this format has actually been drawn with, see
+// vulkan_prepare_render_setup.
 struct wlr_vk_render_format_setup {
 	struct wl_list link;
 	VkFormat render_format; // used in renderpass
+        // Which wlr_vk_render_usage pipelines exist
+        uint32_t usages;
         // These names suck but I'm too lazy to fix it. TODO: fix it.
 	VkRenderPass rpass;
 	VkRenderPass rpass_clear;
 	VkRenderPass quad_rpass;
 	VkRenderPass quad_clear_rpass;
+        // Like quad_clear_rpass, but only clears the render area and keeps
+        // last frame's contents everywhere else
+	VkRenderPass quad_damage_rpass;
 	VkRenderPass postprocess_rpass;
 	VkRenderPass simple_rpass;
 	VkRenderPass blur_rpass[BLUR_PASSES];
 
 	VkPipeline simple_tex_pipe;
 	VkPipeline tex_pipe;
+        // Writes UV and surface ID for the part of a texture that's actually
+        // the window
+	VkPipeline id_pipe;
 	VkPipeline quad_pipe;
         // Need one pipeline for every render pass
 	VkPipeline blur_pipes[BLUR_PASSES];
 	VkPipeline postprocess_pipe;
 };
 
-// Renderer-internal represenation of an wlr_buffer imported for rendering.
-struct wlr_vk_render_buffer {
-	struct wlr_buffer *wlr_buffer;
-	struct wlr_vk_renderer *renderer;
-	struct wlr_vk_render_format_setup *render_setup;
-	struct wl_list link; // wlr_vk_renderer.buffers
+// What render_end reads back for the pixel under the cursor, so check_uv_gpu
+// can tell what it's over without mapping or copying anything else
+struct wlr_vk_uv_readback {
+        // Copied from the UV and ID images by the GPU
+        uint16_t u, v;
+        uint32_t id;
+        // Filled in by the CPU when the frame is recorded, so only trust
+        // the rest once frame <= renderer->completed_frame. 0 if nothing has
+        // been recorded into this slot yet.
+        uint32_t frame;
+        int32_t cursor_x, cursor_y;
+};
 
+// Images a frame gets composed in before the postprocess pass writes it to
+// the render buffer's screen. Only one frame is recorded at a time, so instead
+// of every swapchain image having its own, the render buffers of an output
+// share one of these per frame slot.
+struct wlr_vk_transient_set {
+        // For the main pass, with intermediate, UV and ID
 	VkFramebuffer framebuffer;
-        // The simple renderer in vulkan/renderer.c doesn't use UV
-	VkFramebuffer simple_framebuffer;
-        // The postprocess pass uses different images, so it needs to be
-        // separate.
-	VkFramebuffer postprocess_framebuffer;
-        // So does blur
 	VkFramebuffer blur_framebuffers[BLUR_PASSES];
 
-	uint32_t mem_count;
-	VkDeviceMemory memories[WLR_DMABUF_MAX_PLANES];
-	bool transitioned;
-
 	// Intermediate target
 	VkImage intermediate;
 	VkImageView intermediate_view;
-	VkDeviceMemory intermediate_mem;
+	struct vulkan_mem_alloc intermediate_mem;
         // Needed so we can sample it in the postprocess pass
         VkDescriptorSet intermediate_set;
 
         // Images for doing blur passes, each one is half the size of the previous
 	VkImage blurs[BLUR_PASSES];
 	VkImageView blur_views[BLUR_PASSES];
-	VkDeviceMemory blur_mems[BLUR_PASSES];
+	struct vulkan_mem_alloc blur_mems[BLUR_PASSES];
         VkDescriptorSet blur_sets[BLUR_PASSES];
+        // RGBA UNORM views of the blur images so blur.comp can write them,
+        // only if renderer->compute_blur_supported
+	VkImageView blur_storage_views[BLUR_PASSES];
+        VkDescriptorSet blur_storage_sets[BLUR_PASSES];
 
 	// UV buffer
 	VkImage uv;
 	VkImageView uv_view;
-	VkDeviceMemory uv_mem;
+	struct vulkan_mem_alloc uv_mem;
         VkDescriptorSet uv_set;
 
-        // UV buffer on host. Needed for checking what pixel of a window the
-        // mouse is over.
-	VkBuffer host_uv;
-	VkDeviceMemory host_uv_mem;
+        // Surface ID buffer
+	VkImage id;
+	VkImageView id_view;
+	struct vulkan_mem_alloc id_mem;
+
+        // Renderer frame that last drew into this set, 0 if none has
+	uint32_t frame;
+        // wlr_vk_transients.frame_count as of that frame. Damage tracking
+        // needs to know how many of the output's frames ago that was.
+        uint32_t drawn;
+};
+
+// Transient sets for all render buffers of the same size and format, which in
+// practice means one output's swapchain. Destroyed along with the last render
+// buffer using it.
+struct wlr_vk_transients {
+        uint32_t width, height;
+	struct wlr_vk_render_format_setup *render_setup;
+        // Indexed by wlr_vk_renderer.frame_slot_idx, so the slot's fence
+        // also says when the GPU is done with a set
+        struct wlr_vk_transient_set sets[FRAMES_IN_FLIGHT];
+        // Ring with one wlr_vk_uv_readback per set, host visible and
+        // always mapped
+        VkBuffer readback;
+        struct vulkan_mem_alloc readback_mem;
+        struct wlr_vk_uv_readback *readbacks; // readback_mem.map
+        // Frames drawn with any of the sets
+        uint32_t frame_count;
+        int ref_count;
+	struct wl_list link; // wlr_vk_renderer.transients
+};
+
+// Renderer-internal represenation of an wlr_buffer imported for rendering.
+struct wlr_vk_render_buffer {
+	struct wlr_buffer *wlr_buffer;
+	struct wlr_vk_renderer *renderer;
+	struct wlr_vk_render_format_setup *render_setup;
+	struct wl_list link; // wlr_vk_renderer.buffers
+
+        // Shared with the output's other render buffers. NULL until
+        // vulkan_prepare_render_buffer, which cursor buffers never need.
+        struct wlr_vk_transients *transients;
+
+        // The simple renderer in vulkan/renderer.c doesn't use UV
+	VkFramebuffer simple_framebuffer;
+        // The postprocess pass writes the screen, so it needs one per
+        // transient set
+	VkFramebuffer postprocess_framebuffers[FRAMES_IN_FLIGHT];
+
+	uint32_t mem_count;
+	VkDeviceMemory memories[WLR_DMABUF_MAX_PLANES];
+	bool transitioned;
 
         // Presentation target, which is what actually gets shown to the user.
         // We don't render directly to it because we want to be able to choose
@@ -234,20 +336,66 @@ struct wlr_vk_render_buffer {
 	struct wl_listener buffer_destroy;
 };
 
+// Command buffers that are handed out one at a time and recycled together by
+// resetting the pool.
+struct wlr_vk_cb_arena {
+        VkCommandPool pool;
+        VkCommandBuffer *cbs;
+        // The first `used` cbs are taken until the pool is reset
+        size_t used, capacity;
+};
+
+// Everything that has to stay alive while the GPU works on one frame. The
+// renderer keeps a ring of these so frame N+1 can be recorded while frame N is
+// still executing.
+struct wlr_vk_frame_slot {
+        // One-shot command buffers, see begin_transient_cb. Reset in one go
+        // once the fence has signalled.
+        struct wlr_vk_cb_arena transient;
+        // Same for the transfer queue, only with dev->has_transfer_queue
+        struct wlr_vk_cb_arena transfer;
+        // From the transient arena's pool, but not part of the arena
+	VkCommandBuffer cb;
+        // Uploads for this frame. Recorded whenever a texture changes and
+        // submitted right before cb, either in the same vkQueueSubmit or on
+        // the transfer queue. From one of the arenas.
+        VkCommandBuffer stage_cb;
+        bool stage_recording;
+        // Newest frame that might still sample from a texture stage_cb writes
+        // to. The transfer queue waits for it.
+        uint32_t stage_wait_frame;
+        // Signalled once the GPU is done with everything submitted for this
+        // frame
+	VkFence fence;
+        // Signalled together with the fence. Only used with
+        // implicit_sync_interop, where it gets exported as a sync_file and
+        // attached to the render buffer's dmabuf.
+        VkSemaphore semaphore;
+
+        // Value of wlr_vk_renderer.frame this slot is recording or last
+        // submitted
+        uint32_t frame;
+        bool recording;
+        // Submitted, but the fence hasn't been waited on yet
+        bool pending;
+};
+
 // Vulkan wlr_renderer implementation on top of a wlr_vk_device.
 struct wlr_vk_renderer {
 	struct wlr_renderer wlr_renderer;
 	struct wlr_backend *backend;
 	struct wlr_vk_device *dev;
-
-	VkCommandPool command_pool;
+        // Render targets, textures and staging buffers all come out of this
+        struct vulkan_allocator allocator;
 
 	VkShaderModule vert_module;
 	VkShaderModule simple_tex_frag_module;
 	VkShaderModule tex_vert_module;
 	VkShaderModule tex_frag_module;
+	VkShaderModule id_frag_module;
 	VkShaderModule quad_frag_module;
 	VkShaderModule blur_frag_module;
+	VkShaderModule blur_comp_module;
 	VkShaderModule postprocess_vert_module;
 	VkShaderModule postprocess_frag_module;
 
@@ -255,15 +403,55 @@ struct wlr_vk_renderer {
 	VkPipelineLayout pipe_layout;
 	VkSampler sampler;
 
+        // The blur can either run as a render pass per level with
+        // blur.frag, or as a dispatch per level with blur.comp. Toggled with
+        // Alt+b so they can be compared.
+        bool compute_blur_supported;
+        bool compute_blur;
+	VkDescriptorSetLayout storage_desc_layout;
+	VkPipelineLayout compute_pipe_layout;
+	VkPipeline blur_compute_pipe;
+
+        // Loaded from and saved to disk, see vulkan/pipeline_cache.c.
+        // pipeline_cache_warm is set if there was a usable file.
+        VkPipelineCache pipeline_cache;
+        bool pipeline_cache_warm;
+
+        // Blur the intermediate once per group of non-overlapping surfaces
+        // instead of once per surface. Toggled with Alt+l.
+        bool layered_blur;
+
+        // For waiting on one-shot submissions, see submit_transient_cb
 	VkFence fence;
 
+        // Only with dev->has_transfer_queue. Every frame signals
+        // graphics_timeline with its frame number, every upload submission
+        // signals transfer_timeline with the next transfer_point.
+        VkSemaphore graphics_timeline, transfer_timeline;
+        uint64_t transfer_point;
+        // Hand the render buffer to the transfer queue and back in
+        // vulkan_read_pixels
+        VkSemaphore readback_semaphores[2];
+
 	struct wlr_vk_render_buffer *current_render_buffer;
 
 	// current frame id. Used in wlr_vk_texture.last_used
-	// Increased every time a frame is ended for the renderer
+	// Increased every time a frame is begun by the renderer
 	uint32_t frame;
+        // Newest frame the GPU is known to have finished. Everything with
+        // last_used <= completed_frame can safely be destroyed.
+        uint32_t completed_frame;
 	VkRect2D scissor; // needed for clearing
+        // Bounding box of the damage being repainted this frame. Nothing
+        // outside of it gets drawn.
+        VkRect2D damage_rect;
+
+        struct wlr_vk_frame_slot frame_slots[FRAMES_IN_FLIGHT];
+        // Slot the current frame is being recorded into, or the next frame
+        // will be
+        int frame_slot_idx;
 
+        // Command buffer of the frame slot currently being recorded
 	VkCommandBuffer cb;
 	VkPipeline bound_pipe;
 
@@ -283,6 +471,7 @@ struct wlr_vk_renderer {
 	struct wl_list foreign_textures; // wlr_vk_texture to return to foreign queue
 
 	struct wl_list render_buffers; // wlr_vk_render_buffer
+	struct wl_list transients; // wlr_vk_transients
 
         // Instead of copying the entire UV texture each frame, we only copy
         // the pixel under the cursor.
@@ -292,16 +481,7 @@ struct wlr_vk_renderer {
 	bool should_copy_uv;
         int postprocess_mode;
 
-        // Lets us measure how long individual calls take
-        VkQueryPool query_pool;
-        // For averaging over time
-        float timer_sums[TIMER_COUNT];
-        // Some timers don't get triggered every frame, so we need invidual
-        // counters for averaging.
-        int timer_counts[TIMER_COUNT];
-
 	struct {
-		VkCommandBuffer cb;
 		struct wl_list buffers; // type wlr_vk_shared_buffer
 	} stage;
 };
@@ -309,18 +489,64 @@ struct wlr_vk_renderer {
 // Creates a vulkan renderer for the given device.
 struct wlr_renderer *vulkan_renderer_create_for_device(struct wlr_vk_device *dev);
 
+// Makes sure setup has the pipelines needed to draw with usage. Compiles
+// them the first time, which can take a while without a warm pipeline cache.
+void vulkan_prepare_render_setup(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_render_format_setup *setup, enum wlr_vk_render_usage usage);
+
+// Frame slot ring. vulkan_begin_frame waits until the next slot is free, starts
+// recording its command buffer and points renderer->cb at it. GPU scopes go to
+// the slot until vulkan_submit_frame, which submits it for the current render
+// buffer without waiting for the GPU to finish.
+struct wlr_vk_frame_slot *vulkan_begin_frame(struct wlr_vk_renderer *renderer);
+bool vulkan_submit_frame(struct wlr_vk_renderer *renderer);
+
+// Retires every frame the GPU has already finished, without blocking.
+void vulkan_poll_frames(struct wlr_vk_renderer *renderer);
+
+// Blocks until the GPU has finished the given frame and everything before it.
+void vulkan_wait_frame(struct wlr_vk_renderer *renderer, uint32_t frame);
+
+// Gives a render buffer transient sets and postprocess framebuffers, which
+// only render.c needs. Does nothing the second time.
+void vulkan_prepare_render_buffer(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_render_buffer *buffer);
+
+// Transient set of the current render buffer that the frame being recorded
+// draws into, or the next one will if none is.
+struct wlr_vk_transient_set *vulkan_transient_set(struct wlr_vk_renderer *renderer);
+// How many of the output's frames old that set's contents are, like
+// buffer_age. 0 if it's never been drawn into.
+int vulkan_transient_age(struct wlr_vk_renderer *renderer);
+
+// One-shot command buffers, taken from the pool of the frame slot the next
+// frame will be recorded into and recycled together with it, so they never
+// have to be freed. begin_transient_cb returns one in recording state.
+// submit_transient_cb submits it, and with wait blocks until it has finished
+// executing. Without wait it is only guaranteed to execute before the next
+// frame.
+VkCommandBuffer begin_transient_cb(struct wlr_vk_renderer *renderer);
+bool submit_transient_cb(struct wlr_vk_renderer *renderer, VkCommandBuffer cb, bool wait);
+
 // stage utility - for uploading/retrieving data
 // Gets an command buffer in recording state which is guaranteed to be
-// executed before the next frame.
+// executed before the next frame. Belongs to the frame slot the next frame
+// will be recorded into, so this may have to wait for that slot.
 VkCommandBuffer vulkan_record_stage_cb(struct wlr_vk_renderer *renderer);
 
 // Submits the current stage command buffer and waits until it has
 // finished execution.
 bool vulkan_submit_stage_wait(struct wlr_vk_renderer *renderer);
 
+// Makes the stage command buffer wait until the given frame is done, when it
+// runs on the transfer queue. Has to be called before overwriting a texture a
+// frame in flight might still sample from, since barriers don't work across
+// queues. Only valid while the stage cb is recording.
+void vulkan_stage_wait_frame(struct wlr_vk_renderer *renderer, uint32_t frame);
+
 // Suballocates a buffer span with the given size that can be mapped
 // and used as staging buffer. The allocation is implicitly released when the
-// stage cb has finished execution.
+// frame the stage cb belongs to has finished execution.
 struct wlr_vk_buffer_span vulkan_get_stage_span(
 	struct wlr_vk_renderer *renderer, VkDeviceSize size);
 
@@ -339,8 +565,11 @@ struct wlr_vk_renderer *vulkan_get_renderer(struct wlr_renderer *r);
 struct wlr_vk_texture {
 	struct wlr_texture wlr_texture;
 	struct wlr_vk_renderer *renderer;
+	// Imported dmabufs have one memory per plane, their own
 	uint32_t mem_count;
 	VkDeviceMemory memories[WLR_DMABUF_MAX_PLANES];
+        // Everything else is from the renderer's allocator
+        struct vulkan_mem_alloc alloc;
 	VkImage image;
 	VkImageView image_view;
 	const struct wlr_vk_format *format;
@@ -384,12 +613,16 @@ struct wlr_vk_allocation {
 struct wlr_vk_shared_buffer {
 	struct wl_list link;
 	VkBuffer buffer;
-	VkDeviceMemory memory;
+        // Stays mapped
+	struct vulkan_mem_alloc memory;
 	VkDeviceSize buf_size;
 
 	size_t allocs_size;
 	size_t allocs_capacity;
 	struct wlr_vk_allocation *allocs;
+        // Newest frame with a span in this buffer. All allocations are
+        // released together once it has finished.
+        uint32_t frame;
 };
 
 // Suballocated range on a buffer.
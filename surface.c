@@ -1,12 +1,150 @@
+#include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <wayland-server-core.h>
 
 #include "surface.h"
+#include "util.h"
 
-// Find a Surface given a corresponding wlr_surface and a wl_list of Surfaces. Great naming, I know.
-// Dies on failure.
-struct Surface *find_surface(struct wlr_surface *needle, struct wl_list *haystack) {
+struct SurfaceIndexEntry {
+        struct wlr_surface *key;        // NULL means empty
+        struct Surface *surface;
+};
+
+// Open addressing with linear probing. Removal shifts the entries after the
+// hole back instead of leaving tombstones, so lookups never get slower over
+// time.
+struct SurfaceIndex {
+        struct SurfaceIndexEntry *entries;
+        size_t capacity;                // Always a power of 2
+        size_t count;
+};
+
+#define SURFACE_INDEX_MIN_CAPACITY 64
+
+// Fibonacci hashing. The low bits of pointers are mostly zeroes from
+// alignment, this spreads the rest over the whole table.
+static size_t surface_index_slot(struct SurfaceIndex *index, struct wlr_surface *key) {
+        uint64_t hash = (uint64_t) (uintptr_t) key * 11400714819323198485llu;
+        return (hash >> 32) & (index->capacity - 1);
+}
+
+struct SurfaceIndex *surface_index_create() {
+        struct SurfaceIndex *index = calloc(1, sizeof(*index));
+        assert(index != NULL);
+        index->capacity = SURFACE_INDEX_MIN_CAPACITY;
+        index->entries = calloc(index->capacity, sizeof(index->entries[0]));
+        assert(index->entries != NULL);
+
+        return index;
+}
+
+void surface_index_destroy(struct SurfaceIndex *index) {
+        if (index == NULL) {
+                return;
+        }
+
+        free(index->entries);
+        free(index);
+}
+
+static void surface_index_put(struct SurfaceIndex *index, struct wlr_surface *key,
+                struct Surface *surface) {
+        size_t mask = index->capacity - 1;
+        size_t slot = surface_index_slot(index, key);
+        while (index->entries[slot].key != NULL && index->entries[slot].key != key) {
+                slot = (slot + 1) & mask;
+        }
+
+        if (index->entries[slot].key == NULL) {
+                index->count++;
+        }
+        index->entries[slot].key = key;
+        index->entries[slot].surface = surface;
+}
+
+static void surface_index_grow(struct SurfaceIndex *index) {
+        struct SurfaceIndexEntry *old_entries = index->entries;
+        size_t old_capacity = index->capacity;
+
+        index->capacity *= 2;
+        index->count = 0;
+        index->entries = calloc(index->capacity, sizeof(index->entries[0]));
+        assert(index->entries != NULL);
+
+        for (size_t i = 0; i < old_capacity; i++) {
+                if (old_entries[i].key != NULL) {
+                        surface_index_put(index, old_entries[i].key, old_entries[i].surface);
+                }
+        }
+
+        free(old_entries);
+}
+
+// Keyed by surface->wlr_surface, so that has to be set first.
+void surface_index_insert(struct SurfaceIndex *index, struct Surface *surface) {
+        assert(surface->wlr_surface != NULL);
+
+        // Keep it at most half full, probes get long after that
+        if (2 * (index->count + 1) > index->capacity) {
+                surface_index_grow(index);
+        }
+
+        surface_index_put(index, surface->wlr_surface, surface);
+}
+
+void surface_index_remove(struct SurfaceIndex *index, struct Surface *surface) {
+        size_t mask = index->capacity - 1;
+        size_t slot = surface_index_slot(index, surface->wlr_surface);
+        while (index->entries[slot].key != surface->wlr_surface) {
+                if (index->entries[slot].key == NULL) {
+                        // Not in there
+                        return;
+                }
+                slot = (slot + 1) & mask;
+        }
+        if (index->entries[slot].surface != surface) {
+                // Some other Surface has taken over this wlr_surface
+                return;
+        }
+
+        // Move back anything further along the probe sequence that would
+        // otherwise become unreachable
+        size_t hole = slot;
+        size_t next = (hole + 1) & mask;
+        while (index->entries[next].key != NULL) {
+                size_t home = surface_index_slot(index, index->entries[next].key);
+                // Can the entry at next live in hole? Only if hole is between
+                // its home slot and next, cyclically.
+                if (((next - home) & mask) >= ((next - hole) & mask)) {
+                        index->entries[hole] = index->entries[next];
+                        hole = next;
+                }
+                next = (next + 1) & mask;
+        }
+        index->entries[hole].key = NULL;
+        index->entries[hole].surface = NULL;
+        index->count--;
+}
+
+// Find a Surface given a corresponding wlr_surface. Great naming, I know.
+// Returns NULL if there isn't one.
+struct Surface *find_surface(struct SurfaceIndex *index, struct wlr_surface *needle) {
+        size_t mask = index->capacity - 1;
+        size_t slot = surface_index_slot(index, needle);
+        while (index->entries[slot].key != NULL) {
+                if (index->entries[slot].key == needle) {
+                        return index->entries[slot].surface;
+                }
+                slot = (slot + 1) & mask;
+        }
+
+        return NULL;
+}
+
+// What find_surface used to be, for the benchmark
+static struct Surface *find_surface_linear(struct wlr_surface *needle, struct wl_list *haystack) {
 	struct Surface *cur;
 	wl_list_for_each(cur, haystack, link) {
 		if (cur->wlr_surface == needle) {
@@ -17,3 +155,127 @@ struct Surface *find_surface(struct wlr_surface *needle, struct wl_list *haystac
 	return NULL;
 }
 
+// Creates surface_count fake surfaces the way add_subsurface does (look up,
+// then insert), looks each one up again and destroys them in a different
+// order, once with the old linear search and once with the index.
+void surface_index_benchmark(int surface_count) {
+        struct Surface **surfaces = calloc(surface_count, sizeof(surfaces[0]));
+        assert(surfaces != NULL);
+        for (int i = 0; i < surface_count; i++) {
+                surfaces[i] = calloc(1, sizeof(*surfaces[i]));
+                assert(surfaces[i] != NULL);
+                // Never dereferenced, but a real allocation makes the
+                // pointers look like the real thing
+                surfaces[i]->wlr_surface = malloc(64);
+        }
+
+        // Lookups are counted rather than asserted on directly, so they still
+        // happen (and get timed) with NDEBUG
+        int wrong = 0;
+
+        // Linear
+        double start_time = get_time();
+        struct wl_list list;
+        wl_list_init(&list);
+        for (int i = 0; i < surface_count; i++) {
+                wrong += find_surface_linear(surfaces[i]->wlr_surface, &list) != NULL;
+                wl_list_insert(list.prev, &surfaces[i]->link);
+        }
+        double linear_create = get_time() - start_time;
+
+        start_time = get_time();
+        for (int i = 0; i < surface_count; i++) {
+                wrong += find_surface_linear(surfaces[i]->wlr_surface, &list) != surfaces[i];
+        }
+        double linear_find = get_time() - start_time;
+        assert(wrong == 0);
+
+        for (int i = 0; i < surface_count; i++) {
+                wl_list_remove(&surfaces[i]->link);
+        }
+
+        // Index
+        start_time = get_time();
+        struct SurfaceIndex *index = surface_index_create();
+        for (int i = 0; i < surface_count; i++) {
+                wrong += find_surface(index, surfaces[i]->wlr_surface) != NULL;
+                surface_index_insert(index, surfaces[i]);
+        }
+        double index_create = get_time() - start_time;
+
+        start_time = get_time();
+        for (int i = 0; i < surface_count; i++) {
+                wrong += find_surface(index, surfaces[i]->wlr_surface) != surfaces[i];
+        }
+        double index_find = get_time() - start_time;
+        assert(wrong == 0);
+
+        // Every other one, then the rest, so removal has to deal with holes
+        for (int i = 0; i < surface_count; i += 2) {
+                surface_index_remove(index, surfaces[i]);
+        }
+        for (int i = 0; i < surface_count; i++) {
+                wrong += find_surface(index, surfaces[i]->wlr_surface)
+                        != (i % 2 == 0 ? NULL : surfaces[i]);
+        }
+        assert(wrong == 0);
+        for (int i = 1; i < surface_count; i += 2) {
+                surface_index_remove(index, surfaces[i]);
+        }
+        assert(index->count == 0);
+        surface_index_destroy(index);
+
+        printf("%d surfaces\n", surface_count);
+        printf("  linear: create %10.3f ms, find all %10.3f ms\n",
+                linear_create * 1000, linear_find * 1000);
+        printf("  index:  create %10.3f ms, find all %10.3f ms\n",
+                index_create * 1000, index_find * 1000);
+        if (wrong != 0) printf("  %d lookups found the wrong surface!\n", wrong);
+
+        for (int i = 0; i < surface_count; i++) {
+                free(surfaces[i]->wlr_surface);
+                free(surfaces[i]);
+        }
+        free(surfaces);
+}
+
+// IDs only ever go up, so an ID read back from an old frame can't point at a
+// surface that was created since. That makes the table grow by a pointer for
+// every surface ever created, which is fine.
+uint32_t surface_alloc_id(struct Server *server, struct Surface *surface) {
+        if (server->next_surface_id == 0) {
+                // 0 means no surface
+                server->next_surface_id = 1;
+        }
+        uint32_t id = server->next_surface_id++;
+        assert(id != 0);
+
+        if (id >= server->surfaces_by_id_capacity) {
+                uint32_t capacity = server->surfaces_by_id_capacity * 2;
+                if (capacity < 64) capacity = 64;
+                server->surfaces_by_id = realloc(server->surfaces_by_id,
+                        capacity * sizeof(server->surfaces_by_id[0]));
+                assert(server->surfaces_by_id != NULL);
+                for (uint32_t i = server->surfaces_by_id_capacity; i < capacity; i++) {
+                        server->surfaces_by_id[i] = NULL;
+                }
+                server->surfaces_by_id_capacity = capacity;
+        }
+
+        server->surfaces_by_id[id] = surface;
+        return id;
+}
+
+void surface_free_id(struct Server *server, uint32_t id) {
+        assert(id < server->surfaces_by_id_capacity);
+        server->surfaces_by_id[id] = NULL;
+}
+
+// Returns NULL for 0, for IDs of destroyed surfaces and for garbage
+struct Surface *surface_from_id(struct Server *server, uint32_t id) {
+        if (id >= server->surfaces_by_id_capacity) {
+                return NULL;
+        }
+
+        return server->surfaces_by_id[id];
+}
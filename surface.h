@@ -2,13 +2,27 @@
 #define surface_h_INCLUDED
 
 #include <cglm/cglm.h>
+#include <pixman-1/pixman.h>
 
+#include "transform.h"
 #include "vkwc.h"
 
+// What draw_frame made of a surface last frame
+enum SurfaceVisibility {
+        SURFACE_VISIBLE,
+        // Partly covered by a nearer surface or partly off screen
+        SURFACE_PARTIALLY_OCCLUDED,
+        // Behind the camera or outside the viewport
+        SURFACE_OFF_SCREEN,
+        // Projects to less than a pixel
+        SURFACE_SUB_PIXEL,
+};
+
 struct Surface {
 	struct wl_list link;
 	struct wl_listener map;
 	struct wl_listener destroy;
+	struct wl_listener commit;
 	struct wlr_surface *wlr_surface;
 	struct wlr_xdg_surface *xdg_surface;
 
@@ -16,7 +30,7 @@ struct Surface {
 	// handle_xdg_map has to be able to focus the surface once it's mapped.
 	struct Server *server;
 	
-	float id;			// Is a float since it gets written to the depth buffer
+	uint32_t id;			// Written to the ID buffer, never 0
 	
 	struct Surface *toplevel;	// This points to the Surface data associated with the "main window" a
 					// surface belongs to. So all the titlebars and such can easily access the
@@ -24,25 +38,52 @@ struct Surface {
 					// If this _is_ the toplevel surface, set it to point to itself.
 					// TODO: make it null when toplevel instead
 
+        // Where to find position, rotation, size and so on in
+        // server->transforms, see TRANSFORM
+        uint32_t slot;
+
+        // calc_matrices fills these in.
         // This defines corners with padding
 	mat4 matrix;
         // No padding, really just the window
 	mat4 inner_matrix;
+        // Where the unit square ends up on screen through matrix and
+        // inner_matrix
+        pixman_box32_t box;
+        pixman_box32_t inner_box;
+        // Set when the above change, cleared once draw_frame has taken it
+        // into account
+        bool moved;
+        // Surfaces that are off screen or sub-pixel aren't drawn, and only
+        // get frame done events at server->hidden_frame_rate so their
+        // clients slow down too
+        enum SurfaceVisibility visibility;
+        double last_frame_done;
 
-        int width, height;
-	int tex_width, tex_height;
+        // Damage from commits since the last frame, in surface-local
+        // coordinates
+        pixman_region32_t damage;
+        // What the surface looked like when it was last drawn, so draw_frame
+        // knows what to repaint when it moves or goes away
+        bool drawn;
+        bool drawn_focused;
+        pixman_box32_t drawn_box;	// Screen coordinates
+};
 
-        // Set these and calc_matrices will do the rest. Rotations in radians,
-        // speeds in radians per frame.
-	float x, y, z;
-	double x_rot, y_rot, z_rot;
-	double x_rot_speed, y_rot_speed, z_rot_speed;
+// Looks up Surfaces by their wlr_surface. create_surface and
+// surface_handle_destroy keep server->surface_index up to date.
+struct SurfaceIndex *surface_index_create();
+void surface_index_destroy(struct SurfaceIndex *index);
+void surface_index_insert(struct SurfaceIndex *index, struct Surface *surface);
+void surface_index_remove(struct SurfaceIndex *index, struct Surface *surface);
+struct Surface *find_surface(struct SurfaceIndex *index, struct wlr_surface *needle);
 
-        // Timestamp when the surface was created
-        double spawn_time;
-};
+// Compares the index with walking the surface list, run with vkwc -b
+void surface_index_benchmark(int surface_count);
 
-struct Surface *find_surface(struct wlr_surface *needle, struct wl_list *haystack);
+uint32_t surface_alloc_id(struct Server *server, struct Surface *surface);
+void surface_free_id(struct Server *server, uint32_t id);
+struct Surface *surface_from_id(struct Server *server, uint32_t id);
 
 #endif // surface_h_INCLUDED
 
@@ -0,0 +1,811 @@
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cglm/cglm.h>
+#include <limits.h>
+#include <wlr/util/log.h>
+
+#include "surface.h"
+#include "transform.h"
+#include "util.h"
+
+// How many surfaces the SIMD path does at once
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BATCH 8
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BATCH 4
+#else
+#define BATCH 1
+#endif
+
+// So the benchmark can compare against the scalar path
+static bool simd_disabled = false;
+
+#define TRANSFORM_MIN_CAPACITY 64
+
+void transforms_init(struct Transforms *transforms) {
+        memset(transforms, 0, sizeof(*transforms));
+}
+
+void transforms_finish(struct Transforms *transforms) {
+        struct TransformParams *p = &transforms->params;
+
+        free(transforms->surfaces);
+        free(transforms->x); free(transforms->y); free(transforms->z);
+        free(transforms->x_rot); free(transforms->y_rot); free(transforms->z_rot);
+        free(transforms->x_rot_speed); free(transforms->y_rot_speed); free(transforms->z_rot_speed);
+        free(transforms->spawn_time);
+        free(transforms->width); free(transforms->height);
+        free(transforms->tex_width); free(transforms->tex_height);
+        free(transforms->dirty);
+
+        free(p->sin_x); free(p->cos_x); free(p->sin_y); free(p->cos_y); free(p->sin_z); free(p->cos_z);
+        free(p->tx); free(p->ty); free(p->tz);
+        free(p->cx); free(p->cy); free(p->sx); free(p->sy); free(p->sz);
+        free(p->inner_cx); free(p->inner_cy); free(p->inner_sx); free(p->inner_sy); free(p->inner_sz);
+
+        memset(transforms, 0, sizeof(*transforms));
+}
+
+#define GROW_ARRAY(array, capacity) do { \
+                (array) = realloc((array), (capacity) * sizeof((array)[0])); \
+                assert((array) != NULL); \
+        } while (0)
+
+static void transforms_grow(struct Transforms *transforms) {
+        struct TransformParams *p = &transforms->params;
+        uint32_t capacity = transforms->capacity == 0
+                ? TRANSFORM_MIN_CAPACITY : transforms->capacity * 2;
+
+        GROW_ARRAY(transforms->surfaces, capacity);
+        GROW_ARRAY(transforms->x, capacity);
+        GROW_ARRAY(transforms->y, capacity);
+        GROW_ARRAY(transforms->z, capacity);
+        GROW_ARRAY(transforms->x_rot, capacity);
+        GROW_ARRAY(transforms->y_rot, capacity);
+        GROW_ARRAY(transforms->z_rot, capacity);
+        GROW_ARRAY(transforms->x_rot_speed, capacity);
+        GROW_ARRAY(transforms->y_rot_speed, capacity);
+        GROW_ARRAY(transforms->z_rot_speed, capacity);
+        GROW_ARRAY(transforms->spawn_time, capacity);
+        GROW_ARRAY(transforms->width, capacity);
+        GROW_ARRAY(transforms->height, capacity);
+        GROW_ARRAY(transforms->tex_width, capacity);
+        GROW_ARRAY(transforms->tex_height, capacity);
+        GROW_ARRAY(transforms->dirty, capacity);
+
+        GROW_ARRAY(p->sin_x, capacity);
+        GROW_ARRAY(p->cos_x, capacity);
+        GROW_ARRAY(p->sin_y, capacity);
+        GROW_ARRAY(p->cos_y, capacity);
+        GROW_ARRAY(p->sin_z, capacity);
+        GROW_ARRAY(p->cos_z, capacity);
+        GROW_ARRAY(p->tx, capacity);
+        GROW_ARRAY(p->ty, capacity);
+        GROW_ARRAY(p->tz, capacity);
+        GROW_ARRAY(p->cx, capacity);
+        GROW_ARRAY(p->cy, capacity);
+        GROW_ARRAY(p->sx, capacity);
+        GROW_ARRAY(p->sy, capacity);
+        GROW_ARRAY(p->sz, capacity);
+        GROW_ARRAY(p->inner_cx, capacity);
+        GROW_ARRAY(p->inner_cy, capacity);
+        GROW_ARRAY(p->inner_sx, capacity);
+        GROW_ARRAY(p->inner_sy, capacity);
+        GROW_ARRAY(p->inner_sz, capacity);
+
+        transforms->capacity = capacity;
+}
+
+void transform_alloc(struct Transforms *transforms, struct Surface *surface) {
+        if (transforms->count == transforms->capacity) {
+                transforms_grow(transforms);
+        }
+
+        uint32_t slot = transforms->count++;
+        surface->slot = slot;
+        transforms->surfaces[slot] = surface;
+
+        transforms->x[slot] = 0;
+        transforms->y[slot] = 0;
+        transforms->z[slot] = 0;
+        transforms->x_rot[slot] = 0;
+        transforms->y_rot[slot] = 0;
+        transforms->z_rot[slot] = 0;
+        transforms->x_rot_speed[slot] = 0;
+        transforms->y_rot_speed[slot] = 0;
+        transforms->z_rot_speed[slot] = 0;
+        transforms->spawn_time[slot] = 0;
+        transforms->width[slot] = 0;
+        transforms->height[slot] = 0;
+        transforms->tex_width[slot] = 0;
+        transforms->tex_height[slot] = 0;
+        transforms->dirty[slot] = true;
+}
+
+#define MOVE_ENTRY(array, dst, src) (array)[dst] = (array)[src]
+
+void transform_free(struct Transforms *transforms, struct Surface *surface) {
+        uint32_t slot = surface->slot;
+        uint32_t last = transforms->count - 1;
+        assert(slot <= last);
+        assert(transforms->surfaces[slot] == surface);
+
+        // Keep the arrays dense by moving the last surface into the hole
+        if (slot != last) {
+                MOVE_ENTRY(transforms->surfaces, slot, last);
+                MOVE_ENTRY(transforms->x, slot, last);
+                MOVE_ENTRY(transforms->y, slot, last);
+                MOVE_ENTRY(transforms->z, slot, last);
+                MOVE_ENTRY(transforms->x_rot, slot, last);
+                MOVE_ENTRY(transforms->y_rot, slot, last);
+                MOVE_ENTRY(transforms->z_rot, slot, last);
+                MOVE_ENTRY(transforms->x_rot_speed, slot, last);
+                MOVE_ENTRY(transforms->y_rot_speed, slot, last);
+                MOVE_ENTRY(transforms->z_rot_speed, slot, last);
+                MOVE_ENTRY(transforms->spawn_time, slot, last);
+                MOVE_ENTRY(transforms->width, slot, last);
+                MOVE_ENTRY(transforms->height, slot, last);
+                MOVE_ENTRY(transforms->tex_width, slot, last);
+                MOVE_ENTRY(transforms->tex_height, slot, last);
+                MOVE_ENTRY(transforms->dirty, slot, last);
+                transforms->surfaces[slot]->slot = slot;
+        }
+
+        transforms->count--;
+        surface->slot = UINT32_MAX;
+}
+
+// Every matrix calc_matrices makes is
+//     parent * translate(t) * rotate_x * rotate_y * rotate_z * translate(c) * scale(s)
+// with c.z always 0. Multiplied out, the part after parent has the rotation
+// axes scaled by s as its first three columns and R * c + t as the last one,
+// which is a lot less work than doing each step as a 4x4 multiplication.
+//
+// r is the rotation, r[column][row].
+static void compose_scalar(mat4 parent, float r[3][3], float tx, float ty, float tz,
+                float cx, float cy, float sx, float sy, float sz, mat4 dest) {
+        float local[4][4] = {
+                {r[0][0] * sx, r[0][1] * sx, r[0][2] * sx, 0},
+                {r[1][0] * sy, r[1][1] * sy, r[1][2] * sy, 0},
+                {r[2][0] * sz, r[2][1] * sz, r[2][2] * sz, 0},
+                {
+                        cx * r[0][0] + cy * r[1][0] + tx,
+                        cx * r[0][1] + cy * r[1][1] + ty,
+                        cx * r[0][2] + cy * r[1][2] + tz,
+                        1,
+                },
+        };
+
+        mat4 result;
+        for (int col = 0; col < 4; col++) {
+                for (int row = 0; row < 4; row++) {
+                        result[col][row] = parent[0][row] * local[col][0]
+                                + parent[1][row] * local[col][1]
+                                + parent[2][row] * local[col][2]
+                                + parent[3][row] * local[col][3];
+                }
+        }
+        memcpy(dest, result, sizeof(result));
+}
+
+static void build_matrices_scalar(struct Transforms *transforms, uint32_t first, uint32_t count,
+                mat4 parent) {
+        struct TransformParams *p = &transforms->params;
+        for (uint32_t i = first; i < first + count; i++) {
+                float sa = p->sin_x[i], ca = p->cos_x[i];
+                float sb = p->sin_y[i], cb = p->cos_y[i];
+                float sc = p->sin_z[i], cc = p->cos_z[i];
+                float r[3][3] = {
+                        {cb * cc, sa * sb * cc + ca * sc, sa * sc - ca * sb * cc},
+                        {-cb * sc, ca * cc - sa * sb * sc, ca * sb * sc + sa * cc},
+                        {sb, -sa * cb, ca * cb},
+                };
+
+                struct Surface *surface = transforms->surfaces[i];
+                compose_scalar(parent, r, p->tx[i], p->ty[i], p->tz[i],
+                        p->cx[i], p->cy[i], p->sx[i], p->sy[i], p->sz[i], surface->matrix);
+                compose_scalar(parent, r, p->tx[i], p->ty[i], p->tz[i],
+                        p->inner_cx[i], p->inner_cy[i],
+                        p->inner_sx[i], p->inner_sy[i], p->inner_sz[i], surface->inner_matrix);
+        }
+}
+
+#if BATCH > 1
+// The SIMD paths write BATCH matrices as out[element][lane], this puts them
+// where they belong
+static void store_batch(struct Transforms *transforms, uint32_t first,
+                float matrix[16][BATCH], float inner_matrix[16][BATCH]) {
+        for (int lane = 0; lane < BATCH; lane++) {
+                struct Surface *surface = transforms->surfaces[first + lane];
+                for (int e = 0; e < 16; e++) {
+                        surface->matrix[e / 4][e % 4] = matrix[e][lane];
+                        surface->inner_matrix[e / 4][e % 4] = inner_matrix[e][lane];
+                }
+        }
+}
+#endif
+
+#if defined(__x86_64__)
+// Same as compose_scalar, for 8 surfaces
+__attribute__((target("avx2,fma")))
+static inline void compose_avx2(mat4 parent, __m256 r[3][3], __m256 t[3],
+                __m256 cx, __m256 cy, __m256 s[3], float out[16][BATCH]) {
+        // w is 0 in the first three columns and 1 in the last
+        __m256 local[4][3];
+        for (int col = 0; col < 3; col++) {
+                for (int k = 0; k < 3; k++) {
+                        local[col][k] = _mm256_mul_ps(r[col][k], s[col]);
+                }
+        }
+        for (int k = 0; k < 3; k++) {
+                local[3][k] = _mm256_fmadd_ps(cx, r[0][k], _mm256_fmadd_ps(cy, r[1][k], t[k]));
+        }
+
+        for (int col = 0; col < 4; col++) {
+                for (int row = 0; row < 4; row++) {
+                        __m256 sum = col == 3 ? _mm256_set1_ps(parent[3][row]) : _mm256_setzero_ps();
+                        for (int k = 0; k < 3; k++) {
+                                sum = _mm256_fmadd_ps(_mm256_set1_ps(parent[k][row]),
+                                        local[col][k], sum);
+                        }
+                        _mm256_storeu_ps(out[col * 4 + row], sum);
+                }
+        }
+}
+
+__attribute__((target("avx2,fma")))
+static void build_matrices_avx2(struct Transforms *transforms, uint32_t first, uint32_t count,
+                mat4 parent) {
+        struct TransformParams *p = &transforms->params;
+        uint32_t i = first;
+        for (; i + BATCH <= first + count; i += BATCH) {
+                __m256 sa = _mm256_loadu_ps(p->sin_x + i), ca = _mm256_loadu_ps(p->cos_x + i);
+                __m256 sb = _mm256_loadu_ps(p->sin_y + i), cb = _mm256_loadu_ps(p->cos_y + i);
+                __m256 sc = _mm256_loadu_ps(p->sin_z + i), cc = _mm256_loadu_ps(p->cos_z + i);
+                __m256 sa_sb = _mm256_mul_ps(sa, sb);
+                __m256 ca_sb = _mm256_mul_ps(ca, sb);
+                __m256 zero = _mm256_setzero_ps();
+
+                __m256 r[3][3] = {
+                        {
+                                _mm256_mul_ps(cb, cc),
+                                _mm256_fmadd_ps(sa_sb, cc, _mm256_mul_ps(ca, sc)),
+                                _mm256_fnmadd_ps(ca_sb, cc, _mm256_mul_ps(sa, sc)),
+                        },
+                        {
+                                _mm256_sub_ps(zero, _mm256_mul_ps(cb, sc)),
+                                _mm256_fnmadd_ps(sa_sb, sc, _mm256_mul_ps(ca, cc)),
+                                _mm256_fmadd_ps(ca_sb, sc, _mm256_mul_ps(sa, cc)),
+                        },
+                        {
+                                sb,
+                                _mm256_sub_ps(zero, _mm256_mul_ps(sa, cb)),
+                                _mm256_mul_ps(ca, cb),
+                        },
+                };
+                __m256 t[3] = {
+                        _mm256_loadu_ps(p->tx + i), _mm256_loadu_ps(p->ty + i), _mm256_loadu_ps(p->tz + i),
+                };
+                __m256 s[3] = {
+                        _mm256_loadu_ps(p->sx + i), _mm256_loadu_ps(p->sy + i), _mm256_loadu_ps(p->sz + i),
+                };
+                __m256 inner_s[3] = {
+                        _mm256_loadu_ps(p->inner_sx + i), _mm256_loadu_ps(p->inner_sy + i),
+                        _mm256_loadu_ps(p->inner_sz + i),
+                };
+
+                float matrix[16][BATCH], inner_matrix[16][BATCH];
+                compose_avx2(parent, r, t, _mm256_loadu_ps(p->cx + i), _mm256_loadu_ps(p->cy + i),
+                        s, matrix);
+                compose_avx2(parent, r, t, _mm256_loadu_ps(p->inner_cx + i),
+                        _mm256_loadu_ps(p->inner_cy + i), inner_s, inner_matrix);
+                store_batch(transforms, i, matrix, inner_matrix);
+        }
+
+        // GCC doesn't do this for us in target("avx2") functions. Without it
+        // every SSE instruction after this, like the ones in libm's sinf,
+        // pays for the dirty upper halves and calc_matrices gets ~10x slower.
+        _mm256_zeroupper();
+
+        // Leftovers
+        build_matrices_scalar(transforms, i, first + count - i, parent);
+}
+#endif
+
+#if defined(__aarch64__)
+// Same as compose_scalar, for 4 surfaces
+static inline void compose_neon(mat4 parent, float32x4_t r[3][3], float32x4_t t[3],
+                float32x4_t cx, float32x4_t cy, float32x4_t s[3], float out[16][BATCH]) {
+        // w is 0 in the first three columns and 1 in the last
+        float32x4_t local[4][3];
+        for (int col = 0; col < 3; col++) {
+                for (int k = 0; k < 3; k++) {
+                        local[col][k] = vmulq_f32(r[col][k], s[col]);
+                }
+        }
+        for (int k = 0; k < 3; k++) {
+                local[3][k] = vfmaq_f32(vfmaq_f32(t[k], cy, r[1][k]), cx, r[0][k]);
+        }
+
+        for (int col = 0; col < 4; col++) {
+                for (int row = 0; row < 4; row++) {
+                        float32x4_t sum = vdupq_n_f32(col == 3 ? parent[3][row] : 0);
+                        for (int k = 0; k < 3; k++) {
+                                sum = vfmaq_f32(sum, vdupq_n_f32(parent[k][row]), local[col][k]);
+                        }
+                        vst1q_f32(out[col * 4 + row], sum);
+                }
+        }
+}
+
+static void build_matrices_neon(struct Transforms *transforms, uint32_t first, uint32_t count,
+                mat4 parent) {
+        struct TransformParams *p = &transforms->params;
+        uint32_t i = first;
+        for (; i + BATCH <= first + count; i += BATCH) {
+                float32x4_t sa = vld1q_f32(p->sin_x + i), ca = vld1q_f32(p->cos_x + i);
+                float32x4_t sb = vld1q_f32(p->sin_y + i), cb = vld1q_f32(p->cos_y + i);
+                float32x4_t sc = vld1q_f32(p->sin_z + i), cc = vld1q_f32(p->cos_z + i);
+                float32x4_t sa_sb = vmulq_f32(sa, sb);
+                float32x4_t ca_sb = vmulq_f32(ca, sb);
+
+                float32x4_t r[3][3] = {
+                        {
+                                vmulq_f32(cb, cc),
+                                vfmaq_f32(vmulq_f32(ca, sc), sa_sb, cc),
+                                vfmsq_f32(vmulq_f32(sa, sc), ca_sb, cc),
+                        },
+                        {
+                                vnegq_f32(vmulq_f32(cb, sc)),
+                                vfmsq_f32(vmulq_f32(ca, cc), sa_sb, sc),
+                                vfmaq_f32(vmulq_f32(sa, cc), ca_sb, sc),
+                        },
+                        {
+                                sb,
+                                vnegq_f32(vmulq_f32(sa, cb)),
+                                vmulq_f32(ca, cb),
+                        },
+                };
+                float32x4_t t[3] = {vld1q_f32(p->tx + i), vld1q_f32(p->ty + i), vld1q_f32(p->tz + i)};
+                float32x4_t s[3] = {vld1q_f32(p->sx + i), vld1q_f32(p->sy + i), vld1q_f32(p->sz + i)};
+                float32x4_t inner_s[3] = {
+                        vld1q_f32(p->inner_sx + i), vld1q_f32(p->inner_sy + i), vld1q_f32(p->inner_sz + i),
+                };
+
+                float matrix[16][BATCH], inner_matrix[16][BATCH];
+                compose_neon(parent, r, t, vld1q_f32(p->cx + i), vld1q_f32(p->cy + i), s, matrix);
+                compose_neon(parent, r, t, vld1q_f32(p->inner_cx + i), vld1q_f32(p->inner_cy + i),
+                        inner_s, inner_matrix);
+                store_batch(transforms, i, matrix, inner_matrix);
+        }
+
+        // Leftovers
+        build_matrices_scalar(transforms, i, first + count - i, parent);
+}
+#endif
+
+// Picks the widest path the CPU can do
+static void build_matrices(struct Transforms *transforms, uint32_t first, uint32_t count,
+                mat4 parent) {
+        if (simd_disabled) {
+                build_matrices_scalar(transforms, first, count, parent);
+                return;
+        }
+
+#if defined(__x86_64__)
+        static int has_avx2 = -1;
+        if (has_avx2 == -1) {
+                has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+                wlr_log(WLR_INFO, "calc_matrices: %s", has_avx2 ? "AVX2" : "scalar");
+        }
+        if (has_avx2) {
+                build_matrices_avx2(transforms, first, count, parent);
+                return;
+        }
+#elif defined(__aarch64__)
+        build_matrices_neon(transforms, first, count, parent);
+        return;
+#endif
+
+        build_matrices_scalar(transforms, first, count, parent);
+}
+
+void calc_matrices(struct Transforms *transforms, int output_width, int output_height) {
+        struct TransformParams *p = &transforms->params;
+        uint32_t count = transforms->count;
+
+        double start_time = get_time();
+
+        // Projection and view are the same for every toplevel
+        mat4 view;
+        mat4 projection;
+        mat4 proj_view;
+        glm_perspective_rh_zo(1, (float) output_width / (float) output_height,
+                1, 10000, projection);
+
+        // height * 0.915... makes the pixels 1:1 - don't ask me why...
+        vec3 eye = {0, 0, (float) output_height * 0.915243971};
+        vec3 center = {0, 0, 0};
+        vec3 up = {0, 1, 0};
+        glm_lookat_rh_zo(eye, center, up, view);
+        glm_mat4_mul(projection, view, proj_view);
+
+        // Everything depends on the output size
+        bool output_changed = output_width != transforms->output_width
+                || output_height != transforms->output_height;
+        transforms->output_width = output_width;
+        transforms->output_height = output_height;
+
+        for (uint32_t i = 0; i < count; i++) {
+                // Zooming in makes width differ from tex_width until it's
+                // done, and so does a resize
+                transforms->dirty[i] = transforms->dirty[i] || output_changed
+                        || transforms->x_rot_speed[i] != 0
+                        || transforms->y_rot_speed[i] != 0
+                        || transforms->z_rot_speed[i] != 0
+                        || transforms->width[i] != transforms->tex_width[i]
+                        || transforms->height[i] != transforms->tex_height[i];
+        }
+
+        // Children move with their toplevel
+        uint32_t dirty_count = 0;
+        for (uint32_t i = 0; i < count; i++) {
+                struct Surface *surface = transforms->surfaces[i];
+                assert(surface->toplevel != NULL);
+                if (transforms->dirty[surface->toplevel->slot]) transforms->dirty[i] = true;
+                if (transforms->dirty[i]) dirty_count++;
+        }
+
+        // Spin and zoom. Children need their toplevel's size, so this all
+        // has to happen before the next loop.
+        double time = get_time();
+        for (uint32_t i = 0; i < count; i++) {
+                if (!transforms->dirty[i]) continue;
+
+                transforms->x_rot[i] += transforms->x_rot_speed[i];
+                transforms->y_rot[i] += transforms->y_rot_speed[i];
+                transforms->z_rot[i] += transforms->z_rot_speed[i];
+
+                p->sin_x[i] = sinf(transforms->x_rot[i]);
+                p->cos_x[i] = cosf(transforms->x_rot[i]);
+                p->sin_y[i] = sinf(transforms->y_rot[i]);
+                p->cos_y[i] = cosf(transforms->y_rot[i]);
+                p->sin_z[i] = sinf(transforms->z_rot[i]);
+                p->cos_z[i] = cosf(transforms->z_rot[i]);
+
+                // This makes the windows zoom in when they spawn
+                float scale_factor = (time - transforms->spawn_time[i]) / SPAWN_ANIMATION_LENGTH;
+                // Make it first scale up quickly, then slowly reach the final size
+                scale_factor = sqrt(scale_factor);
+                scale_factor = sqrt(scale_factor);
+                if (scale_factor > 1) scale_factor = 1;
+                transforms->width[i] = scale_factor * transforms->tex_width[i];
+                transforms->height[i] = scale_factor * transforms->tex_height[i];
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+                if (!transforms->dirty[i]) continue;
+
+                struct Surface *surface = transforms->surfaces[i];
+                float width = transforms->width[i];
+                float height = transforms->height[i];
+
+                if (surface->toplevel == surface) {
+                        // Hacky padding stuff...
+                        int padding = 128;
+                        float real_width = width + 2 * padding;
+                        float real_height = height + 2 * padding;
+
+                        p->tx[i] = transforms->x[i];
+                        p->ty[i] = transforms->y[i];
+                        p->tz[i] = transforms->z[i];
+                        // Move it so its 0, 0 is at the center, and scale
+                        // from 0..1, 0..1 to its size in pixels
+                        p->cx[i] = -0.5 * real_width;
+                        p->cy[i] = -0.5 * real_height;
+                        p->sx[i] = real_width;
+                        p->sy[i] = real_height;
+                        p->sz[i] = real_width;
+                        p->inner_cx[i] = -0.5 * width;
+                        p->inner_cy[i] = -0.5 * height;
+                        p->inner_sx[i] = width;
+                        p->inner_sy[i] = height;
+                        p->inner_sz[i] = width;
+                } else {
+                        // Everything is a factor of toplevel's dimensions, so
+                        // a width of 1 would be the same width as toplevel,
+                        // 0.5 would be half, etc. The toplevel's transform is
+                        // applied afterwards.
+                        uint32_t top = surface->toplevel->slot;
+                        float top_width = transforms->width[top];
+                        float top_height = transforms->height[top];
+
+                        // Translate ourselves and move it back so we rotate
+                        // around our center
+                        p->tx[i] = (transforms->x[i] + 0.5 * width) / top_width;
+                        p->ty[i] = (transforms->y[i] + 0.5 * height) / top_height;
+                        // It's too fast if we don't divide, not sure why.
+                        p->tz[i] = transforms->z[i] / 1000.0;
+                        p->cx[i] = -0.5 * width / top_width;
+                        p->cy[i] = -0.5 * height / top_height;
+                        p->sx[i] = width / top_width;
+                        p->sy[i] = height / top_height;
+                        p->sz[i] = 1;
+                        // No padding on children
+                        p->inner_cx[i] = p->cx[i];
+                        p->inner_cy[i] = p->cy[i];
+                        p->inner_sx[i] = p->sx[i];
+                        p->inner_sy[i] = p->sy[i];
+                        p->inner_sz[i] = p->sz[i];
+                }
+        }
+
+        // Each run of dirty surfaces in one go as if they were all toplevels.
+        // That's wrong for children, but there usually aren't many and it
+        // keeps the batches contiguous.
+        for (uint32_t i = 0; i < count;) {
+                if (!transforms->dirty[i]) {
+                        i++;
+                        continue;
+                }
+                uint32_t run_start = i;
+                while (i < count && transforms->dirty[i]) i++;
+                build_matrices(transforms, run_start, i - run_start, proj_view);
+        }
+
+        // Now that the toplevels are done, redo the children on top of them
+        for (uint32_t i = 0; i < count; i++) {
+                struct Surface *surface = transforms->surfaces[i];
+                if (!transforms->dirty[i] || surface->toplevel == surface) continue;
+                build_matrices_scalar(transforms, i, 1, surface->toplevel->matrix);
+        }
+
+        // And where they end up on screen, so draw_frame doesn't have to
+        for (uint32_t i = 0; i < count; i++) {
+                if (!transforms->dirty[i]) continue;
+                struct Surface *surface = transforms->surfaces[i];
+                project_box(output_width, output_height, surface->matrix,
+                        0, 0, 1, 1, &surface->box);
+                project_box(output_width, output_height, surface->inner_matrix,
+                        0, 0, 1, 1, &surface->inner_box);
+                surface->moved = true;
+                transforms->dirty[i] = false;
+        }
+
+        wlr_log(WLR_DEBUG, "calc_matrices rebuilt %u of %u surfaces in %5.3f ms",
+                dirty_count, count, (get_time() - start_time) * 1000);
+}
+
+void project_box(int screen_width, int screen_height, mat4 matrix,
+                float x1, float y1, float x2, float y2, pixman_box32_t *box) {
+        // Figure out where the corners end up
+        float corners[4][4] = {
+                {x1, y1, 0, 1},
+                {x2, y1, 0, 1},
+                {x1, y2, 0, 1},
+                {x2, y2, 0, 1}
+        };
+        int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+        for (int i = 0; i < 4; i++) {
+                float dest[4];
+                glm_mat4_mulv(matrix, corners[i], dest);
+                dest[0] /= dest[3];
+                dest[1] /= dest[3];
+                int x = (dest[0] * 0.5 + 0.5) * screen_width;
+                int y = (dest[1] * 0.5 + 0.5) * screen_height;
+
+                if (x < min_x) min_x = x;
+                if (y < min_y) min_y = y;
+                if (x > max_x) max_x = x;
+                if (y > max_y) max_y = y;
+        }
+
+        box->x1 = min_x;
+        box->y1 = min_y;
+        box->x2 = max_x;
+        box->y2 = max_y;
+}
+
+// What calc_matrices used to do, one cglm call per step per surface
+static void calc_matrices_cglm(struct Transforms *transforms, int output_width, int output_height) {
+        for (uint32_t i = 0; i < transforms->count; i++) {
+                struct Surface *surface = transforms->surfaces[i];
+                TRANSFORM(surface, x_rot) += TRANSFORM(surface, x_rot_speed);
+                TRANSFORM(surface, y_rot) += TRANSFORM(surface, y_rot_speed);
+                TRANSFORM(surface, z_rot) += TRANSFORM(surface, z_rot_speed);
+
+                float scale_factor = (get_time() - TRANSFORM(surface, spawn_time))
+                        / SPAWN_ANIMATION_LENGTH;
+                scale_factor = sqrt(scale_factor);
+                scale_factor = sqrt(scale_factor);
+                if (scale_factor > 1) scale_factor = 1;
+                TRANSFORM(surface, width) = scale_factor * TRANSFORM(surface, tex_width);
+                TRANSFORM(surface, height) = scale_factor * TRANSFORM(surface, tex_height);
+                int width = TRANSFORM(surface, width), height = TRANSFORM(surface, height);
+
+                if (surface->toplevel == surface) {
+                        glm_mat4_identity(surface->matrix);
+
+                        mat4 view;
+                        mat4 projection;
+                        glm_perspective_rh_zo(1, (float) output_width / (float) output_height,
+                                1, 10000, projection);
+                        vec3 eye = {0, 0, (float) output_height * 0.915243971};
+                        vec3 center = {0, 0, 0};
+                        vec3 up = {0, 1, 0};
+                        glm_lookat_rh_zo(eye, center, up, view);
+
+                        glm_mat4_mul(surface->matrix, projection, surface->matrix);
+                        glm_mat4_mul(surface->matrix, view, surface->matrix);
+
+                        int padding = 128;
+                        int real_width = width + 2 * padding;
+                        int real_height = height + 2 * padding;
+
+                        memcpy(surface->inner_matrix, surface->matrix, sizeof(surface->inner_matrix));
+
+                        vec3 position = {TRANSFORM(surface, x), TRANSFORM(surface, y),
+                                TRANSFORM(surface, z)};
+                        glm_translate(surface->matrix, position);
+                        glm_translate(surface->inner_matrix, position);
+                        glm_rotate_x(surface->matrix, TRANSFORM(surface, x_rot), surface->matrix);
+                        glm_rotate_y(surface->matrix, TRANSFORM(surface, y_rot), surface->matrix);
+                        glm_rotate_z(surface->matrix, TRANSFORM(surface, z_rot), surface->matrix);
+                        glm_rotate_x(surface->inner_matrix, TRANSFORM(surface, x_rot),
+                                surface->inner_matrix);
+                        glm_rotate_y(surface->inner_matrix, TRANSFORM(surface, y_rot),
+                                surface->inner_matrix);
+                        glm_rotate_z(surface->inner_matrix, TRANSFORM(surface, z_rot),
+                                surface->inner_matrix);
+                        glm_translate(surface->matrix,
+                                (vec3) {-0.5 * real_width, -0.5 * real_height, 0.0});
+                        glm_translate(surface->inner_matrix,
+                                (vec3) {-0.5 * width, -0.5 * height, 0.0});
+                        glm_scale(surface->matrix, (vec3) {real_width, real_height, real_width});
+                        glm_scale(surface->inner_matrix, (vec3) {width, height, width});
+                } else {
+                        struct Surface *toplevel = surface->toplevel;
+                        int top_width = TRANSFORM(toplevel, width);
+                        int top_height = TRANSFORM(toplevel, height);
+
+                        glm_mat4_identity(surface->matrix);
+                        glm_translate(surface->matrix, (vec3) {
+                                (float) TRANSFORM(surface, x) / top_width,
+                                (float) TRANSFORM(surface, y) / top_height,
+                                TRANSFORM(surface, z) / 1000.0,
+                        });
+                        glm_translate(surface->matrix, (vec3) {
+                                0.5 * width / top_width, 0.5 * height / top_height, 0,
+                        });
+                        glm_rotate_x(surface->matrix, TRANSFORM(surface, x_rot), surface->matrix);
+                        glm_rotate_y(surface->matrix, TRANSFORM(surface, y_rot), surface->matrix);
+                        glm_rotate_z(surface->matrix, TRANSFORM(surface, z_rot), surface->matrix);
+                        glm_translate(surface->matrix, (vec3) {
+                                -0.5 * width / top_width, -0.5 * height / top_height, 0,
+                        });
+                        glm_scale(surface->matrix, (vec3) {
+                                (float) width / top_width, (float) height / top_height, 1,
+                        });
+                        glm_mat4_mul(toplevel->matrix, surface->matrix, surface->matrix);
+                        memcpy(surface->inner_matrix, surface->matrix, sizeof(surface->inner_matrix));
+                }
+        }
+}
+
+// Milliseconds per call
+static double time_calc(void (*calc)(struct Transforms *, int, int),
+                struct Transforms *transforms, int iterations) {
+        double start_time = get_time();
+        for (int i = 0; i < iterations; i++) {
+                calc(transforms, 1920, 1080);
+        }
+        return (get_time() - start_time) * 1000 / iterations;
+}
+
+// Biggest difference between what calc_matrices and calc_matrices_cglm come
+// up with, relative to the size of the entry
+static float compare_with_cglm(struct Transforms *transforms) {
+        uint32_t count = transforms->count;
+        mat4 *expected = malloc(count * sizeof(*expected));
+        assert(expected != NULL);
+
+        calc_matrices_cglm(transforms, 1920, 1080);
+        for (uint32_t i = 0; i < count; i++) {
+                memcpy(expected[i], transforms->surfaces[i]->matrix, sizeof(expected[i]));
+        }
+        calc_matrices(transforms, 1920, 1080);
+
+        float max_error = 0;
+        for (uint32_t i = 0; i < count; i++) {
+                float *a = (float *) expected[i], *b = (float *) transforms->surfaces[i]->matrix;
+                for (int e = 0; e < 16; e++) {
+                        float error = fabsf(a[e] - b[e]) / fmaxf(fabsf(a[e]), 1);
+                        if (error > max_error) max_error = error;
+                }
+        }
+
+        free(expected);
+        return max_error;
+}
+
+void transform_benchmark() {
+        // calc_matrices logs every call
+        wlr_log_init(WLR_ERROR, NULL);
+
+        int counts[] = {10, 100, 1000};
+        for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+                int count = counts[c];
+                struct Server *server = calloc(1, sizeof(*server));
+                assert(server != NULL);
+                transforms_init(&server->transforms);
+
+                struct Surface **surfaces = calloc(count, sizeof(surfaces[0]));
+                assert(surfaces != NULL);
+                struct Surface *toplevel = NULL;
+                srand(count);
+                for (int i = 0; i < count; i++) {
+                        struct Surface *surface = calloc(1, sizeof(*surface));
+                        assert(surface != NULL);
+                        surface->server = server;
+                        transform_alloc(&server->transforms, surface);
+
+                        // Every fourth one is a popup of the last toplevel
+                        if (i % 4 == 3) {
+                                surface->toplevel = toplevel;
+                        } else {
+                                surface->toplevel = surface;
+                                toplevel = surface;
+                        }
+
+                        TRANSFORM(surface, x) = rand() % 1000 - 500;
+                        TRANSFORM(surface, y) = rand() % 1000 - 500;
+                        TRANSFORM(surface, z) = rand() % 100;
+                        TRANSFORM(surface, x_rot) = (rand() % 628) / 100.0;
+                        TRANSFORM(surface, y_rot) = (rand() % 628) / 100.0;
+                        TRANSFORM(surface, z_rot) = (rand() % 628) / 100.0;
+                        TRANSFORM(surface, tex_width) = 100 + rand() % 1000;
+                        TRANSFORM(surface, tex_height) = 100 + rand() % 1000;
+                        surfaces[i] = surface;
+                }
+
+                // No spinning while comparing, both versions step the rotations
+                float error = compare_with_cglm(&server->transforms);
+                for (int i = 0; i < count; i++) {
+                        TRANSFORM(surfaces[i], x_rot_speed) = 0.01;
+                        TRANSFORM(surfaces[i], y_rot_speed) = 0.02;
+                }
+
+                int iterations = 200000 / count;
+                double cglm_time = time_calc(calc_matrices_cglm, &server->transforms, iterations);
+                simd_disabled = true;
+                double scalar_time = time_calc(calc_matrices, &server->transforms, iterations);
+                simd_disabled = false;
+                double simd_time = time_calc(calc_matrices, &server->transforms, iterations);
+
+                // And once nothing moves any more
+                for (int i = 0; i < count; i++) {
+                        TRANSFORM(surfaces[i], x_rot_speed) = 0;
+                        TRANSFORM(surfaces[i], y_rot_speed) = 0;
+                }
+                calc_matrices(&server->transforms, 1920, 1080);
+                double still_time = time_calc(calc_matrices, &server->transforms, iterations);
+
+                printf("%4d surfaces: cglm %8.4f ms, scalar %8.4f ms, SIMD (%d wide) %8.4f ms, "
+                        "nothing moving %8.4f ms, max relative error %g\n",
+                        count, cglm_time, scalar_time, BATCH, simd_time, still_time, error);
+
+                for (int i = 0; i < count; i++) {
+                        free(surfaces[i]);
+                }
+                free(surfaces);
+                transforms_finish(&server->transforms);
+                free(server);
+        }
+}
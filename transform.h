@@ -0,0 +1,81 @@
+#ifndef transform_h_INCLUDED
+#define transform_h_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <cglm/cglm.h>
+#include <pixman-1/pixman.h>
+
+struct Surface;
+
+// How long the zoom-in animation of new surfaces lasts, in seconds
+#define SPAWN_ANIMATION_LENGTH 0.2
+
+// Where calc_matrices puts everything it works out per surface before
+// building the matrices. One array per value so the SIMD path can load 8 (or
+// 4) surfaces at once.
+struct TransformParams {
+        float *sin_x, *cos_x, *sin_y, *cos_y, *sin_z, *cos_z;
+        // Translation, then center offset and scale for matrix and inner_matrix
+        float *tx, *ty, *tz;
+        float *cx, *cy, *sx, *sy, *sz;
+        float *inner_cx, *inner_cy, *inner_sx, *inner_sy, *inner_sz;
+};
+
+// Everything about where surfaces are and how they move, as a structure of
+// arrays. Surfaces find their entries with surface->slot. Slots are always
+// 0..count-1, removing a surface moves the last one into its slot.
+struct Transforms {
+        uint32_t count, capacity;
+        // So removal can fix up the slot of whatever gets moved
+        struct Surface **surfaces;
+
+        // Set these and calc_matrices will do the rest. Rotations in radians,
+        // speeds in radians per frame.
+        float *x, *y, *z;
+        double *x_rot, *y_rot, *z_rot;
+        double *x_rot_speed, *y_rot_speed, *z_rot_speed;
+        // Timestamp when the surface was created
+        double *spawn_time;
+        // tex_width and tex_height come from the client, width and height
+        // are what calc_matrices makes of them with the spawn animation
+        int *width, *height;
+        int *tex_width, *tex_height;
+        // Set whenever any of the above changes, calc_matrices only rebuilds
+        // the matrices of dirty surfaces (and their children). Spinning,
+        // zooming in and resizing keep surfaces dirty without anyone having
+        // to set this.
+        bool *dirty;
+
+        // What the matrices were last built for
+        int output_width, output_height;
+
+        struct TransformParams params;
+};
+
+// A surface's entry in one of the arrays, e.g. TRANSFORM(surface, x) += 10.
+// Don't forget TRANSFORM(surface, dirty) = true after changing something.
+#define TRANSFORM(surface, field) \
+        ((surface)->server->transforms.field[(surface)->slot])
+
+void transforms_init(struct Transforms *transforms);
+void transforms_finish(struct Transforms *transforms);
+// Sets surface->slot and zeroes everything in it
+void transform_alloc(struct Transforms *transforms, struct Surface *surface);
+void transform_free(struct Transforms *transforms, struct Surface *surface);
+
+// Steps the rotations and the spawn animation forwards, then updates matrix,
+// inner_matrix, box and inner_box of every dirty surface and sets its moved.
+void calc_matrices(struct Transforms *transforms, int output_width, int output_height);
+
+// Figures out the screen coordinates of the part of the unit square between
+// (x1, y1) and (x2, y2) once it's been through matrix. Not clamped to the
+// screen.
+void project_box(int screen_width, int screen_height, mat4 matrix,
+                float x1, float y1, float x2, float y2, pixman_box32_t *box);
+
+// Times calc_matrices against the old one-cglm-call-at-a-time version, run
+// with vkwc -m
+void transform_benchmark();
+
+#endif // transform_h_INCLUDED
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -76,3 +77,38 @@ double get_time() {
         clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
         return ts.tv_sec + (double) ts.tv_nsec / 1000000000;
 }
+
+#ifdef ALLOC_STATS
+// Wrap glibc's allocator so we can see whether the frame loop allocates.
+// Everything in the process ends up in here, not just vkwc, which is why it
+// takes -Dalloc_stats=true.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+// The pipeline worker allocates too
+static _Atomic uint64_t alloc_count = 0;
+
+void *malloc(size_t size) {
+        alloc_count++;
+        return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+        alloc_count++;
+        return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+        alloc_count++;
+        return __libc_realloc(ptr, size);
+}
+
+uint64_t get_alloc_count() {
+        return alloc_count;
+}
+#else
+uint64_t get_alloc_count() {
+        return 0;
+}
+#endif // ALLOC_STATS
@@ -1,6 +1,7 @@
 #ifndef util_h_INCLUDED
 #define util_h_INCLUDED
 
+#include <stdint.h>
 #include <cglm/cglm.h>
 #include <wlr/types/wlr_scene.h>
 
@@ -10,4 +11,8 @@ void print_scene_graph(struct wlr_scene_node *node, int	level);
 
 double get_time();
 
+// How many times malloc, calloc and realloc have been called, by anyone. Only
+// counted when built with -Dalloc_stats=true, always 0 otherwise.
+uint64_t get_alloc_count();
+
 #endif // util_h_INCLUDED
@@ -75,240 +75,252 @@ struct Keyboard	{
 	struct wl_listener key;
 };
 
-static void surface_handle_destroy(struct wl_listener *listener, void *data) {
-	struct Surface *surface = wl_container_of(listener, surface, destroy);
+// Marks the scene as changed and asks for a frame event. handle_output_frame
+// doesn't draw anything unless this was called since the last frame.
+static void schedule_frame(struct Server *server) {
+        server->frame_dirty = true;
+        if (server->output != NULL) {
+                wlr_output_schedule_frame(server->output);
+        }
+}
 
-	wl_list_remove(&surface->link);
-	wl_list_remove(&surface->destroy.link);
+// Returns true if the next frame would look different even if no more events
+// come in, because something is spinning, zooming in or changing colors.
+static bool scene_is_animating(struct Server *server) {
+        if (server->colorscheme_ratio == 1
+                        || server->target_colorscheme_ratio > server->colorscheme_ratio) {
+                return true;
+        }
 
-	printf("Surface destroyed!\n");
+	struct Surface *surface;
+	wl_list_for_each(surface, &server->surfaces, link) {
+                if (TRANSFORM(surface, x_rot_speed) != 0 || TRANSFORM(surface, y_rot_speed) != 0
+                                || TRANSFORM(surface, z_rot_speed) != 0) {
+                        return true;
+                }
+                // Still zooming in. Same test calc_matrices uses rather than
+                // the clock, so the frame that reaches full size is never
+                // the last one drawn.
+                if (TRANSFORM(surface, width) != TRANSFORM(surface, tex_width)
+                                || TRANSFORM(surface, height) != TRANSFORM(surface, tex_height)) {
+                        return true;
+                }
+        }
 
-	free(surface);
+        return false;
 }
 
-// When windows are resized, their projection matrices in their Surfaces must be updated.
-// This will recalculate the matrices of the specified node and all children
-// x and y is the position of the parent node, since a surface only knows its position relative to its parent
-void calc_matrices(struct wl_list *surfaces, int output_width, int output_height) {
-	struct Surface *surface;
+static void surface_handle_commit(struct wl_listener *listener, void *data) {
+	struct Surface *surface = wl_container_of(listener, surface, commit);
+
+        // Collect what changed, draw_frame projects it onto the screen
+        pixman_region32_t damage;
+        pixman_region32_init(&damage);
+        wlr_surface_get_effective_damage(surface->wlr_surface, &damage);
+        pixman_region32_union(&surface->damage, &surface->damage, &damage);
+        pixman_region32_fini(&damage);
+
+        // Resized. Only once it's mapped though, handle_xdg_map sets the
+        // size the first time.
+        int width = surface->wlr_surface->current.width;
+        int height = surface->wlr_surface->current.height;
+        if (TRANSFORM(surface, tex_width) != 0
+                        && (width != TRANSFORM(surface, tex_width)
+                                || height != TRANSFORM(surface, tex_height))) {
+                TRANSFORM(surface, tex_width) = width;
+                TRANSFORM(surface, tex_height) = height;
+                TRANSFORM(surface, dirty) = true;
+        }
 
-        double start_time = get_time();
+        schedule_frame(surface->server);
+}
 
-	wl_list_for_each(surface, surfaces, link) {
-		surface->x_rot += surface->x_rot_speed;
-		surface->y_rot += surface->y_rot_speed;
-		surface->z_rot += surface->z_rot_speed;
+static void surface_handle_destroy(struct wl_listener *listener, void *data) {
+	struct Surface *surface = wl_container_of(listener, surface, destroy);
+        struct Server *server = surface->server;
 
-		assert(surface->toplevel != NULL);
+        // Motion events can come in before the next frame notices it's gone.
+        // The seat drops its pointer focus on its own.
+        if (server->last_mouse_surface == surface) server->last_mouse_surface = NULL;
+        if (server->grabbed_surface == surface) server->grabbed_surface = NULL;
 
-		bool is_toplevel = surface->toplevel == surface;
-                double time = get_time();
-
-                // This makes the windows zoom in when they spawn
-                float scale_factor = (time - surface->spawn_time) / 0.2;
-                // Make it first scale up quickly, then slowly reach the final size
-                scale_factor = sqrt(scale_factor);
-                scale_factor = sqrt(scale_factor);
-                if (scale_factor > 1) scale_factor = 1;
-                surface->width = scale_factor * surface->tex_width;
-                surface->height = scale_factor * surface->tex_height;
-
-		if (is_toplevel) {
-			glm_mat4_identity(surface->matrix);
-
-			mat4 view;
-			mat4 projection;
-			glm_perspective_rh_zo(1, (float) output_width / (float) output_height,
-                                1, 10000, projection);
-
-                        // height * 0.915... makes the pixels 1:1 - don't ask me why...
-			vec3 eye = {0, 0, (float) output_height * 0.915243971};
-			vec3 center = {0, 0, 0};
-			vec3 up = {0, 1, 0};
-			glm_lookat_rh_zo(eye, center, up, view);
-
-			glm_mat4_mul(surface->matrix, projection, surface->matrix);
-			glm_mat4_mul(surface->matrix, view, surface->matrix);
-
-                        // Hacky padding stuff...
-                        int padding = 128;
-                        int real_width = surface->width + 2 * padding;
-                        int real_height = surface->height + 2 * padding;
-
-                        memcpy(surface->inner_matrix, surface->matrix, sizeof(surface->inner_matrix));
-
-			// These are in backwards order
-			// Move it
-			glm_translate(surface->matrix,
-                                (vec3) {surface->x, surface->y, surface->z});
-			glm_translate(surface->inner_matrix,
-                                (vec3) {surface->x, surface->y, surface->z});
-			// Rotate it
-			glm_rotate_x(surface->matrix, surface->x_rot, surface->matrix);
-			glm_rotate_y(surface->matrix, surface->y_rot, surface->matrix);
-			glm_rotate_z(surface->matrix, surface->z_rot, surface->matrix);
-
-			glm_rotate_x(surface->inner_matrix, surface->x_rot, surface->inner_matrix);
-			glm_rotate_y(surface->inner_matrix, surface->y_rot, surface->inner_matrix);
-			glm_rotate_z(surface->inner_matrix, surface->z_rot, surface->inner_matrix);
-			// Move it so its 0, 0 is at the center
-			glm_translate(surface->matrix,
-				(vec3) {-0.5 * real_width, -0.5 * real_height, 0.0});
-			glm_translate(surface->inner_matrix,
-				(vec3) {-0.5 * surface->width, -0.5 * surface->height, 0.0});
-			// Scale from 0..1, 0..1 to surface->width, surface->height
-			glm_scale(surface->matrix,
-				(vec3) {real_width, real_height, real_width});
-			glm_scale(surface->inner_matrix,
-				(vec3) {surface->width, surface->height, surface->width});
-
-                        /*
-			vec4 top_left = {0, 0, 0, 1};
-			vec4 bottom_right = {1, 1, 0, 1};
-			vec4 dst1, dst2;
-			glm_mat4_mulv(surface->matrix, top_left, dst1);
-			glm_mat4_mulv(surface->matrix, bottom_right, dst2);
-                        printf("Top left corner ends up at %f %f\n",
-                                (dst1[0] / dst1[3] * 0.5 + 0.5) * output_width,
-                                (dst1[1] / dst1[3] * 0.5 + 0.5) * output_height);
-                        printf("Bottom right corner ends up at %f %f\n",
-                                (dst2[0] / dst2[3] * 0.5 + 0.5) * output_width,
-                                (dst2[1] / dst2[3] * 0.5 + 0.5) * output_height);
-                        printf("Width on screen: %f\n",
-                                ((dst2[0] / dst2[3]) - (dst1[0] / dst1[3])) * 0.5 * output_width);
-                        */
-		} else {
-			// First we translate ourselves relative to toplevel, then apply
-                        // toplevel transform
-                        //
-			// This allows for child transforms to be relative to parent transform
-			struct Surface *toplevel = surface->toplevel;
-
-			glm_mat4_identity(surface->matrix);
-
-			// Again, these are in backwards order
-
-			// Translate ourselves, again as a factor of toplevel's dimensions
-			glm_translate(surface->matrix, (vec3) {
-				(float) surface->x / toplevel->width,
-				(float) surface->y / toplevel->height,
-                                // It's too fast if we don't divide, not sure why.
-				surface->z / 1000.0,
-			});
-
-			// Move it back
-			glm_translate(surface->matrix, (vec3) {
-				0.5 * surface->width / toplevel->width,
-				0.5 * surface->height / toplevel->height,
-				0,
-			});
-
-			// Rotate
-			glm_rotate_x(surface->matrix, surface->x_rot, surface->matrix);
-			glm_rotate_y(surface->matrix, surface->y_rot, surface->matrix);
-			glm_rotate_z(surface->matrix, surface->z_rot, surface->matrix);
-
-			// Move it so 0, 0 is at the center
-			glm_translate(surface->matrix, (vec3) {
-				-0.5 * surface->width / toplevel->width,
-				-0.5 * surface->height / toplevel->height,
-				0,
-			});
-
-                        // Scale ourselves down so that our width and height
-                        // becomes relative to toplevel (1 would be the same
-                        // width as toplevel, 0.5 would be half, etc.)
-			glm_scale(surface->matrix,
-                                (vec3) {(float) surface->width / toplevel->width,
-				        (float) surface->height / toplevel->height,
-                                        1});
-
-			// Apply toplevel's transformation
-			glm_mat4_mul(surface->toplevel->matrix, surface->matrix, surface->matrix);
-		}
-	}
+	wl_list_remove(&surface->link);
+        surface_index_remove(server->surface_index, surface);
+        draw_list_remove(surface);
+	wl_list_remove(&surface->destroy.link);
+	wl_list_remove(&surface->commit.link);
+        surface_free_id(server, surface->id);
+        transform_free(&server->transforms, surface);
+        if (surface->drawn) {
+                pixman_box32_t *box = &surface->drawn_box;
+                pixman_region32_union_rect(&server->damage, &server->damage,
+                        box->x1, box->y1, box->x2 - box->x1, box->y2 - box->y1);
+        }
+        pixman_region32_fini(&surface->damage);
+        schedule_frame(server);
 
-        wlr_log(WLR_DEBUG, "calc_matrices took %5.3f ms", (get_time() - start_time) * 1000);
-}
+	printf("Surface destroyed!\n");
 
-void check_uv(struct Server *server, int cursor_x, int cursor_y,
-        	struct Surface **surface_out, int *surface_x, int *surface_y) {
-        double start_time = get_time();
+	free(surface);
+}
 
-        // Checks the UV texture to see what's under the cursor. Returns the
-        // surface under the cursor and the x and y relative to this surface.
-	// Returns NULL to surface if there is no surface under the cursor.
-	
-        // There are multiple render buffers, so we have to find the right one.
-        // I do this just by checking whether the render buffer's dimensions
-        // match those of the first output, which isn't a great way but works
-        // for now.
+// Reads what's under the cursor back from the last frame's UV texture.
+// Always at least a frame behind, but it's exactly what the GPU drew.
+static void check_uv_gpu(struct Server *server, int cursor_x, int cursor_y,
+        	struct Surface **surface_out, double *surface_x, double *surface_y) {
+	// Every output has its own readback ring, so we have to find the right
+	// one. I do this just by checking whether its dimensions match those of
+	// the first output, which isn't a great way but works for now. Each
+	// slot says which frame and cursor position it's from, if anyone cares
+	// how stale it is.
 	struct wlr_vk_renderer *renderer = (struct wlr_vk_renderer *) server->renderer;
-	struct wlr_vk_render_buffer *render_buffer = NULL;
+	struct wlr_vk_uv_readback *pixel = NULL;
 	struct wlr_output *output = server->output;
 
-	struct wlr_vk_render_buffer *cur;
-	wl_list_for_each(cur, &renderer->render_buffers, link) {
-		if (cur->wlr_buffer->width == output->width
-				&& cur->wlr_buffer->height == output->height) {
-			if (render_buffer == NULL || render_buffer->frame < cur->frame) {
+	// The most recent frame might still be in flight, in which case we use
+	// the most recent one the GPU is done with. Reading the slot of an
+	// unfinished frame gives garbage.
+	vulkan_poll_frames(renderer);
+	struct wlr_vk_uv_readback *newest = NULL;
+	struct wlr_vk_transients *transients;
+	wl_list_for_each(transients, &renderer->transients, link) {
+		if (transients->width != (uint32_t) output->width
+				|| transients->height != (uint32_t) output->height) {
+			continue;
+		}
+		for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+			struct wlr_vk_uv_readback *cur = &transients->readbacks[i];
+			if (cur->frame == 0) {
+				continue;
+			}
+			if (newest == NULL || newest->frame < cur->frame) {
+				newest = cur;
+			}
+			if (cur->frame <= renderer->completed_frame
+					&& (pixel == NULL || pixel->frame < cur->frame)) {
 				// Always choose the most recent one
-				render_buffer = cur;
+				pixel = cur;
 			}
 		}
 	};
-	assert(render_buffer != NULL);
-
-	// Map the UV buffer
-        // We only need a single pixel, so 4 bytes
-	VkDeviceSize uv_byte_count = 4;
-	void *uv_mem;
-	vkMapMemory(renderer->dev->dev, render_buffer->host_uv_mem, 0, uv_byte_count, 0, &uv_mem);
-	struct { uint8_t r; uint8_t g; uint8_t b; uint8_t a; } *pixel = uv_mem;
 
-	float pixel_surface_id = (double) pixel[0].b / UINT8_MAX;
-	double pixel_x_norm = (double) pixel[0].r / UINT8_MAX;
-	double pixel_y_norm = (double) pixel[0].g / UINT8_MAX;
-	double error_margin = 1.0 / 256;
-
-	vkUnmapMemory(renderer->dev->dev, render_buffer->host_uv_mem);
-
-	//printf("id, x, y: %f %f %f\n", pixel_surface_id, pixel_x_norm, pixel_y_norm);
-        wlr_log(WLR_DEBUG, "check_uv took %5.3f ms", (get_time() - start_time) * 1000);
-
-	// Close to 0 means the cursor is above the background, so no surface
-	if (pixel_surface_id < error_margin) {
-		//printf("ID is close to zero. Exit.\n");
+	// Nothing's been drawn yet, so there's nothing under the cursor either
+	if (newest == NULL) {
 		*surface_out = NULL;
 		return;
 	}
 
-	// Otherwise, go through all surfaces until we find the one with a matching id
-	bool found_surface = false;
-	struct Surface *surface = NULL;
-	wl_list_for_each(surface, &server->surfaces, link) {
-		if (surface->id - error_margin < pixel_surface_id
-                                && surface->id + error_margin > pixel_surface_id) {
-			//printf("Surface with id %f matches (dims %d %d)\n",
-                                //surface->id, surface->width, surface->height);
-			found_surface = true;
-			break;
-		}
+	// Nothing has finished yet, so we have to wait
+	if (pixel == NULL) {
+		vulkan_wait_frame(renderer, newest->frame);
+		pixel = newest;
 	}
 
-	if (!found_surface) {
-		fprintf(stderr, "Could not find surface with id matching: %f\n", pixel_surface_id);
-		exit(1);
-	}
+	// The ring is always mapped
+	uint32_t pixel_surface_id = pixel->id;
+	double pixel_x_norm = (double) pixel->u / UINT16_MAX;
+	double pixel_y_norm = (double) pixel->v / UINT16_MAX;
 
-	// Set return values
+	// 0 means the cursor is above the background. It can also be a surface
+	// that's been destroyed since that frame.
+	struct Surface *surface = surface_from_id(server, pixel_surface_id);
 	*surface_out = surface;
-	if (surface_x != NULL && surface_y != NULL) {
-		*surface_x = pixel_x_norm * surface->width;
-		*surface_y = pixel_y_norm * surface->height;
+	if (surface != NULL && surface_x != NULL && surface_y != NULL) {
+		*surface_x = pixel_x_norm * TRANSFORM(surface, width);
+		*surface_y = pixel_y_norm * TRANSFORM(surface, height);
+	}
+}
+
+// Where the cursor at ndc_x, ndc_y (-1..1) hits surface, in the same UV space
+// texture.frag uses (0..1 is the window, without padding). The quad lies on
+// the z = 0 plane of surface->matrix, so dropping z turns the matrix into a 3x3
+// homography between the quad and the screen, and inverting that gives the
+// point on the quad the ray through the cursor hits.
+static bool hit_test_surface(struct Surface *surface, float ndc_x, float ndc_y,
+                float *u, float *v) {
+        mat4 m;
+        memcpy(m, surface->matrix, sizeof(m));
+        mat3 quad_to_screen = {
+                {m[0][0], m[0][1], m[0][3]},
+                {m[1][0], m[1][1], m[1][3]},
+                {m[3][0], m[3][1], m[3][3]},
+        };
+        // Seen exactly edge-on
+        if (fabsf(glm_mat3_det(quad_to_screen)) < 1e-12) return false;
+
+        mat3 screen_to_quad;
+        glm_mat3_inv(quad_to_screen, screen_to_quad);
+        vec3 hit;
+        glm_mat3_mulv(screen_to_quad, (vec3) {ndc_x, ndc_y, 1}, hit);
+        // The ray hits the plane behind the camera
+        if (hit[2] <= 0) return false;
+        float pos_x = hit[0] / hit[2];
+        float pos_y = hit[1] / hit[2];
+
+        // Clipped by the near or far plane
+        float clip_z = m[0][2] * pos_x + m[1][2] * pos_y + m[3][2];
+        float clip_w = m[0][3] * pos_x + m[1][3] * pos_y + m[3][3];
+        if (clip_z < 0 || clip_z > clip_w) return false;
+
+        // Same as texture.vert
+        float padding_x = 128.0 / TRANSFORM(surface, width);
+        float padding_y = 128.0 / TRANSFORM(surface, height);
+        *u = pos_x * (1 + 2 * padding_x) - padding_x;
+        *v = pos_y * (1 + 2 * padding_y) - padding_y;
+
+        return *u > 0 && *u < 1 && *v > 0 && *v < 1;
+}
+
+// Finds what's under the cursor from the matrices the last frame was drawn
+// with, front to back like texture.frag would have written the UV texture.
+// No GPU round trip, so it isn't a frame behind.
+static void check_uv_cpu(struct Server *server, int cursor_x, int cursor_y,
+        	struct Surface **surface_out, double *surface_x, double *surface_y) {
+        double start_time = get_time();
+
+	struct wlr_output *output = server->output;
+        float ndc_x = (cursor_x + 0.5) / output->width * 2 - 1;
+        float ndc_y = (cursor_y + 0.5) / output->height * 2 - 1;
+
+        // Surfaces are drawn sorted by z, so the closest hit is the one with
+        // the biggest z
+        struct Surface *hit = NULL;
+        float hit_u = 0, hit_v = 0;
+	struct Surface *surface;
+	wl_list_for_each(surface, &server->surfaces, link) {
+                // Same checks as draw_frame
+                if (TRANSFORM(surface, width) == 0 || TRANSFORM(surface, height) == 0) continue;
+                if (wlr_surface_get_texture(surface->wlr_surface) == NULL) continue;
+                if (hit != NULL && TRANSFORM(surface, z) <= TRANSFORM(hit, z)) continue;
+
+                float u, v;
+                if (hit_test_surface(surface, ndc_x, ndc_y, &u, &v)) {
+                        hit = surface;
+                        hit_u = u;
+                        hit_v = v;
+                }
+        }
+
+        wlr_log(WLR_DEBUG, "check_uv_cpu took %5.3f ms", (get_time() - start_time) * 1000);
+
+	*surface_out = hit;
+	if (hit != NULL && surface_x != NULL && surface_y != NULL) {
+		*surface_x = hit_u * TRANSFORM(hit, width);
+		*surface_y = hit_v * TRANSFORM(hit, height);
 	}
 }
 
+// Returns the surface under the cursor and the x and y relative to this
+// surface, or NULL if there's no surface under the cursor.
+void check_uv(struct Server *server, int cursor_x, int cursor_y,
+        	struct Surface **surface_out, double *surface_x, double *surface_y) {
+        if (server->gpu_hit_test) {
+                check_uv_gpu(server, cursor_x, cursor_y, surface_out, surface_x, surface_y);
+        } else {
+                check_uv_cpu(server, cursor_x, cursor_y, surface_out, surface_x, surface_y);
+        }
+}
+
 static void handle_xdg_new_toplevel_decoration(struct wl_listener *listener, void *data) {
         // Tell windows not to make their own decoration
         struct wlr_xdg_toplevel_decoration_v1 *decoration = data;
@@ -329,6 +341,69 @@ static void focus_surface(struct wlr_seat *seat, struct Surface *surface) {
 		keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
 }
 
+// The full version: hit tests every surface and moves pointer focus if the
+// cursor is over something else now. Runs once per frame, motion events only
+// go through forward_cursor_motion.
+static void process_cursor_motion(struct Server *server, uint32_t time) {
+	// Find the Surface under the pointer and send the event along.
+	struct wlr_seat	*seat =	server->seat;
+        server->motion_pending = false;
+
+	struct Surface *surface;
+	double surface_x, surface_y;	// Cursor position relative to surface
+        check_uv(server, server->cursor->x, server->cursor->y, &surface, &surface_x, &surface_y);
+
+	if (surface == NULL) {
+                if (server->last_mouse_surface != NULL) {
+                        // There's nothing under the cursor, so set the mouse
+                        // image to the generic one.
+                        wlr_xcursor_manager_set_cursor_image(server->cursor_mgr, "left_ptr",
+                                server->cursor);
+                        server->last_mouse_surface = NULL;
+                }
+	} else {
+		//
+		// Send	pointer	enter and motion events.
+		//
+		// The enter event gives the surface "pointer focus", which is distinct
+		// from	keyboard focus.	You get	pointer	focus by moving	the pointer over
+		// a window.
+		//
+		// Note	that wlroots will avoid	sending	duplicate enter/motion events if
+		// the surface has already has pointer focus or	if the client is already
+		// aware of the	coordinates passed.
+
+		wlr_seat_pointer_notify_enter(seat, surface->wlr_surface, surface_x, surface_y);
+                //printf("Send %d %d to id %u\n", surface_x, surface_y, surface->id);
+		wlr_seat_pointer_notify_motion(seat, time, surface_x, surface_y);
+		wlr_seat_pointer_notify_frame(server->seat);
+
+                server->last_mouse_surface = surface;
+	}
+}
+
+// Cheap version for motion events: if the cursor is still over the surface
+// that has pointer focus, sends it the new position straight away, worked out
+// from that one surface's matrix. Anything else (leaving it, entering
+// something else) waits for process_cursor_motion at the end of the frame.
+static void forward_cursor_motion(struct Server *server, uint32_t time) {
+        server->motion_pending = true;
+        server->motion_time = time;
+
+        struct Surface *surface = server->last_mouse_surface;
+        if (surface == NULL) return;
+
+	struct wlr_output *output = server->output;
+        float ndc_x = (server->cursor->x + 0.5) / output->width * 2 - 1;
+        float ndc_y = (server->cursor->y + 0.5) / output->height * 2 - 1;
+        float u, v;
+        if (!hit_test_surface(surface, ndc_x, ndc_y, &u, &v)) return;
+
+        wlr_seat_pointer_notify_motion(server->seat, time,
+                u * TRANSFORM(surface, width), v * TRANSFORM(surface, height));
+        wlr_seat_pointer_notify_frame(server->seat);
+}
+
 static void handle_cursor_button(struct wl_listener *listener, void *data) {
 	/* This	event is forwarded by the cursor when a	pointer	emits a	button
 	 * event. */
@@ -336,6 +411,9 @@ static void handle_cursor_button(struct wl_listener *listener, void *data) {
 		wl_container_of(listener, server, cursor_button);
 	struct wlr_pointer_button_event *event = data;
 
+        // Focus has to be exact for clicks, so don't wait for the frame
+        if (server->motion_pending) process_cursor_motion(server, event->time_msec);
+
 	/* Notify the client with pointer focus	that a button press has	occurred */
 	wlr_seat_pointer_notify_button(server->seat,
 			event->time_msec, event->button, event->state);
@@ -355,6 +433,7 @@ static void handle_cursor_button(struct wl_listener *listener, void *data) {
         }
 
 	focus_surface(server->seat, surface->toplevel);
+        schedule_frame(server);
 }
 
 static void handle_keyboard_modifiers(struct wl_listener *listener, void *data) {
@@ -418,25 +497,29 @@ static bool handle_keybinding(struct Server *server, xkb_keysym_t sym) {
 		struct Surface *surface;
 		check_uv(server, server->cursor->x, server->cursor->y, &surface, NULL, NULL);
 		if (surface != NULL) {
-			surface->x_rot_speed = 0;
-			surface->y_rot_speed = 0;
-			surface->z_rot_speed = 0;
+			TRANSFORM(surface, x_rot_speed) = 0;
+			TRANSFORM(surface, y_rot_speed) = 0;
+			TRANSFORM(surface, z_rot_speed) = 0;
+			TRANSFORM(surface, dirty) = true;
 		}
 		return true;
 	} else if (sym == XKB_KEY_F10) {
 		struct Surface *surface;
 		check_uv(server, server->cursor->x, server->cursor->y, &surface, NULL, NULL);
 		if (surface != NULL) {
-			surface->x_rot = 0;
-			surface->y_rot = 0;
-			surface->z_rot = 0;
+			TRANSFORM(surface, x_rot) = 0;
+			TRANSFORM(surface, y_rot) = 0;
+			TRANSFORM(surface, z_rot) = 0;
+			TRANSFORM(surface, dirty) = true;
 		}
 		return true;
 	} else if (sym == XKB_KEY_F11) {
 		struct Surface *surface;
 		check_uv(server, server->cursor->x, server->cursor->y, &surface, NULL, NULL);
 		if (surface != NULL) {
-			surface->z = 0;
+			TRANSFORM(surface, z) = 0;
+			TRANSFORM(surface, dirty) = true;
+			draw_list_z_changed();
 		}
 		return true;
 	} else if (sym == XKB_KEY_r) {
@@ -444,9 +527,30 @@ static bool handle_keybinding(struct Server *server, xkb_keysym_t sym) {
                         (struct wlr_vk_renderer *) server->renderer;
                 vk_renderer->postprocess_mode++;
                 vk_renderer->postprocess_mode %= POSTPROCESS_MODE_COUNT;
+                schedule_frame(server);
         } else if (sym == XKB_KEY_m) {
                 // Change to next colorscheme
                 server->target_colorscheme_ratio = 1;
+                schedule_frame(server);
+        } else if (sym == XKB_KEY_b) {
+                // Switch between the compute and render pass blur
+                struct wlr_vk_renderer *vk_renderer =
+                        (struct wlr_vk_renderer *) server->renderer;
+                vk_renderer->compute_blur =
+                        !vk_renderer->compute_blur && vk_renderer->compute_blur_supported;
+                wlr_log(WLR_INFO, "Compute blur %s", vk_renderer->compute_blur ? "on" : "off");
+                schedule_frame(server);
+        } else if (sym == XKB_KEY_l) {
+                // Switch between blurring per layer and per surface
+                struct wlr_vk_renderer *vk_renderer =
+                        (struct wlr_vk_renderer *) server->renderer;
+                vk_renderer->layered_blur = !vk_renderer->layered_blur;
+                wlr_log(WLR_INFO, "Layered blur %s", vk_renderer->layered_blur ? "on" : "off");
+                schedule_frame(server);
+        } else if (sym == XKB_KEY_u) {
+                // Switch between CPU hit testing and reading back the UV texture
+                server->gpu_hit_test = !server->gpu_hit_test;
+                wlr_log(WLR_INFO, "Hit testing on the %s", server->gpu_hit_test ? "GPU" : "CPU");
         }
 
 	for (int i = 0; i < sizeof(TRANSFORM_MODES) / sizeof(TRANSFORM_MODES[0]); i++) {
@@ -464,7 +568,7 @@ static bool handle_keybinding(struct Server *server, xkb_keysym_t sym) {
 					&server->grabbed_surface, NULL, NULL);
 
 				if (server->grabbed_surface != NULL) {
-                                        printf("Surface under cursor has id %f\n",
+                                        printf("Surface under cursor has id %u\n",
                                                 server->grabbed_surface->id);
 					server->cursor_mode = mode;
 				} else {
@@ -505,6 +609,9 @@ static void handle_keyboard_key(struct wl_listener *listener, void *data) {
 		}
 	}
 
+        // Keybindings can change pretty much anything, so just redraw
+        if (handled) schedule_frame(server);
+
 	if (!handled) {
 		/* Otherwise, we pass it along to the client. */
 		wlr_seat_set_keyboard(seat, keyboard->keyboard);
@@ -615,43 +722,6 @@ static void handle_selection_request(struct wl_listener	*listener, void	*data) {
 	wlr_seat_set_selection(server->seat, event->source, event->serial);
 }
 
-static void process_cursor_motion(struct Server *server, uint32_t time) {
-	// Find the Surface under the pointer and send the event along.
-	struct wlr_seat	*seat =	server->seat;
-
-	struct Surface *surface;
-	int surface_x, surface_y;	// Cursor position relative to surface
-        check_uv(server, server->cursor->x, server->cursor->y, &surface, &surface_x, &surface_y);
-
-	if (surface == NULL) {
-                if (server->last_mouse_surface != NULL) {
-                        // There's nothing under the cursor, so set the mouse
-                        // image to the generic one.
-                        wlr_xcursor_manager_set_cursor_image(server->cursor_mgr, "left_ptr",
-                                server->cursor);
-                        server->last_mouse_surface = NULL;
-                }
-	} else {
-		//
-		// Send	pointer	enter and motion events.
-		//
-		// The enter event gives the surface "pointer focus", which is distinct
-		// from	keyboard focus.	You get	pointer	focus by moving	the pointer over
-		// a window.
-		//
-		// Note	that wlroots will avoid	sending	duplicate enter/motion events if
-		// the surface has already has pointer focus or	if the client is already
-		// aware of the	coordinates passed.
-
-		wlr_seat_pointer_notify_enter(seat, surface->wlr_surface, surface_x, surface_y);
-                //printf("Send %d %d to id %f\n", surface_x, surface_y, surface->id);
-		wlr_seat_pointer_notify_motion(seat, time, surface_x, surface_y);
-		wlr_seat_pointer_notify_frame(server->seat);
-
-                server->last_mouse_surface = surface;
-	}
-}
-
 static void handle_cursor_motion_relative(struct wl_listener *listener,	void *data) {
 	/* This	event is forwarded by the cursor when a	pointer	emits a	_relative_
 	 * pointer motion event	(i.e. a	delta) */
@@ -664,31 +734,35 @@ static void handle_cursor_motion_relative(struct wl_listener *listener,	void *da
 	 * generated the event.	You can	pass NULL for the device if you	want to	move
 	 * the cursor around without any input.	*/
 	wlr_cursor_move(server->cursor,	&event->pointer->base, event->delta_x, event->delta_y);
+        // The cursor is drawn by us, and grabbed surfaces move with it
+        schedule_frame(server);
 
 	// If we're in a transform mode, don't bother processing the motion
 	if (server->grabbed_surface != NULL) {
+                TRANSFORM(server->grabbed_surface, dirty) = true;
 		if (server->cursor_mode == VKWC_CURSOR_XY_ROTATE) {			// Rotation
-			server->grabbed_surface->x_rot += event->delta_y * -0.02;
-			server->grabbed_surface->y_rot += event->delta_x * 0.02;
+			TRANSFORM(server->grabbed_surface, x_rot) += event->delta_y * -0.02;
+			TRANSFORM(server->grabbed_surface, y_rot) += event->delta_x * 0.02;
 		} else if (server->cursor_mode == VKWC_CURSOR_Z_ROTATE) {
-			server->grabbed_surface->z_rot += event->delta_x * 0.02;
+			TRANSFORM(server->grabbed_surface, z_rot) += event->delta_x * 0.02;
 		} else if (server->cursor_mode == VKWC_CURSOR_X_ROTATE_SPEED) {		// Rotation speed
-			server->grabbed_surface->x_rot_speed += event->delta_x * 0.02 * 0.05;
+			TRANSFORM(server->grabbed_surface, x_rot_speed) += event->delta_x * 0.02 * 0.05;
 		} else if (server->cursor_mode == VKWC_CURSOR_Y_ROTATE_SPEED) {
-			server->grabbed_surface->y_rot_speed += event->delta_x * 0.02 * 0.05;
+			TRANSFORM(server->grabbed_surface, y_rot_speed) += event->delta_x * 0.02 * 0.05;
 		} else if (server->cursor_mode == VKWC_CURSOR_Z_ROTATE_SPEED) {
-			server->grabbed_surface->z_rot_speed += event->delta_x * 0.02 * 0.05;
+			TRANSFORM(server->grabbed_surface, z_rot_speed) += event->delta_x * 0.02 * 0.05;
 		} else if (server->cursor_mode == VKWC_CURSOR_X_MOVE) {			// Translation
-			server->grabbed_surface->x += event->delta_x;
+			TRANSFORM(server->grabbed_surface, x) += event->delta_x;
 		} else if (server->cursor_mode == VKWC_CURSOR_Y_MOVE) {			// Translation
-			server->grabbed_surface->y += event->delta_y;
+			TRANSFORM(server->grabbed_surface, y) += event->delta_y;
 		} else if (server->cursor_mode == VKWC_CURSOR_Z_MOVE) {			// Translation
-			server->grabbed_surface->z += event->delta_y;
+			TRANSFORM(server->grabbed_surface, z) += event->delta_y;
+			draw_list_z_changed();
 		} else {
-			process_cursor_motion(server, event->time_msec);
+			forward_cursor_motion(server, event->time_msec);
 		}
 	} else {
-		process_cursor_motion(server, event->time_msec);
+		forward_cursor_motion(server, event->time_msec);
 	}
 }
 
@@ -703,7 +777,8 @@ static void handle_cursor_motion_absolute(struct wl_listener *listener, void *da
 		wl_container_of(listener, server, cursor_motion_absolute);
 	struct wlr_pointer_motion_absolute_event *event = data;
 	wlr_cursor_warp_absolute(server->cursor, &event->pointer->base, event->x, event->y);
-	process_cursor_motion(server, event->time_msec);
+        schedule_frame(server);
+	forward_cursor_motion(server, event->time_msec);
 }
 
 static void handle_cursor_axis(struct wl_listener *listener, void *data) {
@@ -712,6 +787,7 @@ static void handle_cursor_axis(struct wl_listener *listener, void *data) {
 	struct Server *server =
 		wl_container_of(listener, server, cursor_axis);
 	struct wlr_pointer_axis_event *event = data;
+        if (server->motion_pending) process_cursor_motion(server, event->time_msec);
 	/* Notify the client with pointer focus	of the axis event. */
 	wlr_seat_pointer_notify_axis(server->seat,
 			event->time_msec, event->orientation, event->delta,
@@ -729,6 +805,54 @@ static void handle_cursor_frame(struct wl_listener *listener, void *data) {
 	wlr_seat_pointer_notify_frame(server->seat);
 }
 
+// Sends frame done to every surface, except hidden ones which only get one
+// every 1 / hidden_frame_rate seconds. If a hidden surface is still waiting
+// for one, the timer goes off when it's due. With hidden_only, visible
+// surfaces are left alone since they get theirs from handle_output_frame.
+static void send_frame_done(struct Server *server, bool hidden_only) {
+	struct timespec	now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+        double time = get_time();
+
+        double next_due = -1;
+	struct Surface *surface;
+	wl_list_for_each(surface, &server->surfaces, link) {
+                bool hidden = surface->visibility == SURFACE_OFF_SCREEN
+                        || surface->visibility == SURFACE_SUB_PIXEL;
+                if (hidden) {
+                        // Nothing to do if it isn't waiting for one
+                        if (wl_list_empty(&surface->wlr_surface->current.frame_callback_list)) {
+                                continue;
+                        }
+                        if (server->hidden_frame_rate <= 0) continue;
+
+                        double due = surface->last_frame_done + 1 / server->hidden_frame_rate;
+                        if (time < due) {
+                                if (next_due < 0 || due < next_due) next_due = due;
+                                continue;
+                        }
+                } else if (hidden_only) {
+                        continue;
+                }
+
+		wlr_surface_send_frame_done(surface->wlr_surface, &now);
+                surface->last_frame_done = time;
+	}
+
+        if (next_due >= 0) {
+                // 0 would disarm it
+                int ms = (next_due - time) * 1000 + 1;
+                wl_event_source_timer_update(server->frame_done_timer, ms);
+        }
+}
+
+static int handle_frame_done_timer(void *data) {
+        struct Server *server = data;
+        send_frame_done(server, true);
+
+        return 0;
+}
+
 static void handle_output_frame(struct wl_listener *listener, void *data) {
 	/* This	function is called every time an output	is ready to display a frame,
 	 * generally at	the output's refresh rate (e.g.	60Hz). */
@@ -737,9 +861,21 @@ static void handle_output_frame(struct wl_listener *listener, void *data) {
 	struct Server *server = wl_container_of(listener, server, output_frame);
 	struct wlr_output *output = server->output;
 
+        // Screencopy clients schedule frames themselves and need a commit to
+        // get their pixels, so don't skip the frame while one is waiting
+        if (!wl_list_empty(&server->screencopy->frames)) server->frame_dirty = true;
+
+        if (!server->frame_dirty) {
+                // Nothing changed, so what's on screen is still correct
+                return;
+        }
+        // Cleared before drawing so anything that happens during the frame
+        // gets another one
+        server->frame_dirty = false;
+
 	// Pre-frame processing
 	struct wl_list *surfaces = &server->surfaces;
-	calc_matrices(surfaces, output->width, output->height);
+	calc_matrices(&server->transforms, output->width, output->height);
 
         // Animations
         if (server->colorscheme_ratio == 1) {
@@ -759,7 +895,7 @@ static void handle_output_frame(struct wl_listener *listener, void *data) {
 	/* Render the scene if needed and commit the output */
 	draw_frame(output, &server->surfaces, server->last_mouse_surface,
                 server->cursor->x, server->cursor->y, server->colorscheme_ratio,
-                server->src_colorscheme_idx, server->dst_colorscheme_idx);
+                server->src_colorscheme_idx, server->dst_colorscheme_idx, &server->damage);
 
 	struct timespec	now;
 	clock_gettime(CLOCK_MONOTONIC, &now);
@@ -767,14 +903,15 @@ static void handle_output_frame(struct wl_listener *listener, void *data) {
 	uint32_t time = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 
 	// Tell all the surfaces we finished a frame
-	struct Surface *surface;
-	wl_list_for_each(surface, &server->surfaces, link) {
-		wlr_surface_send_frame_done(surface->wlr_surface, &now);
-	}
+        send_frame_done(server, false);
+
+        // Catch up on the motion events since the last frame in one go. Even
+        // without any, with so much spinning stuff what's under the cursor
+        // might have changed.
+	process_cursor_motion(server, server->motion_pending ? server->motion_time : time);
 
-        // Send cursor position to focused Surface, with so much spinning stuff
-        // it might have changed
-	process_cursor_motion(server, time);
+        // Keep going as long as something is moving on its own
+        if (scene_is_animating(server)) schedule_frame(server);
 
         wlr_log(WLR_DEBUG, "handle_output_frame took %5.3f ms", (get_time() - start_time) * 1000);
 }
@@ -816,9 +953,10 @@ static void handle_new_output(struct wl_listener *listener, void *data)	{
 
 	/* Sets	up a listener for the frame notify event. */
 	wl_signal_add(&server->output->events.frame, &server->output_frame);
+        schedule_frame(server);
 }
 
-// Allocates a new Surface, zeroing the struct and setting server, wlr_surface, id, and destroy.
+// Allocates a new Surface, zeroing the struct and setting server, wlr_surface, id, slot and destroy.
 // The user must still set the geometry and toplevel.
 // Also adds surface to surfaces.
 static struct Surface *create_surface(struct Server *server, struct wl_list *surfaces,
@@ -827,19 +965,28 @@ static struct Surface *create_surface(struct Server *server, struct wl_list *sur
 	surface->server = server;
 	surface->wlr_surface = wlr_surface;
 	surface->toplevel = NULL;
-	surface->id = (double) rand() / RAND_MAX;
-        surface->spawn_time = get_time();
+	surface->id = surface_alloc_id(server, surface);
+        transform_alloc(&server->transforms, surface);
+        TRANSFORM(surface, spawn_time) = get_time();
+
+	pixman_region32_init(&surface->damage);
+	surface->commit.notify = surface_handle_commit;
+	wl_signal_add(&wlr_surface->events.commit, &surface->commit);
+
         //surface->x = server->cursor->x - server->output->width / 2;
         //surface->y = server->cursor->y - server->output->height / 2;
-        surface->x = 0;
-        surface->y = 0;
+        TRANSFORM(surface, x) = 0;
+        TRANSFORM(surface, y) = 0;
         wlr_log(WLR_INFO, "Cursor XY is %f %f, server dims are %d %d",
                 server->cursor->x, server->cursor->y,
                 server->output->width, server->output->height);
         wlr_log(WLR_INFO, "Set surface XY with dims %d %d to %f %f",
-                surface->tex_width, surface->tex_height, surface->x, surface->y);
+                TRANSFORM(surface, tex_width), TRANSFORM(surface, tex_height),
+                TRANSFORM(surface, x), TRANSFORM(surface, y));
 
 	wl_list_insert(surfaces->prev, &surface->link);
+        surface_index_insert(server->surface_index, surface);
+        draw_list_add(surface);
 
 	return surface;
 }
@@ -852,13 +999,16 @@ static void handle_xdg_map(struct wl_listener *listener, void *data) {
 	struct wlr_xdg_surface *xdg_surface = surface->xdg_surface;
 	struct wlr_surface *wlr_surface = xdg_surface->surface;
 
-	surface->tex_width = wlr_surface->current.width;
-	surface->tex_height = wlr_surface->current.height;
+	TRANSFORM(surface, tex_width) = wlr_surface->current.width;
+	TRANSFORM(surface, tex_height) = wlr_surface->current.height;
+	TRANSFORM(surface, dirty) = true;
 
 	focus_surface(server->seat, surface);
+        // Starts the spawn animation, which keeps scheduling frames itself
+        schedule_frame(server);
 
-	wlr_log(WLR_INFO, "Surface mapped (id %f), set dims to %d %d",
-                surface->id, surface->tex_width, surface->tex_height);
+	wlr_log(WLR_INFO, "Surface mapped (id %u), set dims to %d %d",
+                surface->id, TRANSFORM(surface, tex_width), TRANSFORM(surface, tex_height));
 }
 
 // Adds a subsurface to the server's list of surfaces.
@@ -869,22 +1019,23 @@ static void add_subsurface(struct Server *server, struct wlr_subsurface *subsurf
 	struct wlr_surface *wlr_surface = subsurface->surface;
 
 	// Make sure the surface doesn't already exist - this seems to never happen but it's worth checking
-	struct Surface *found_surface = find_surface(wlr_surface, &server->surfaces);
+	struct Surface *found_surface = find_surface(server->surface_index, wlr_surface);
 	assert(found_surface == NULL);
 
 	// Create a new Surface
 	struct Surface *surface = create_surface(server, &server->surfaces, wlr_surface);
-	printf("Adding sneaky subsurface with geo %d %d %d %d (new id %f)\n",
+	printf("Adding sneaky subsurface with geo %d %d %d %d (new id %u)\n",
                 subsurface->current.x, subsurface->current.y,
 		wlr_surface->current.width, wlr_surface->current.height, surface->id);
-	surface->width = wlr_surface->current.width;
-	surface->height = wlr_surface->current.height;
-	surface->x = subsurface->current.x;
-	surface->y = subsurface->current.y;
-	surface->z = 1;
+	TRANSFORM(surface, width) = wlr_surface->current.width;
+	TRANSFORM(surface, height) = wlr_surface->current.height;
+	TRANSFORM(surface, x) = subsurface->current.x;
+	TRANSFORM(surface, y) = subsurface->current.y;
+	TRANSFORM(surface, z) = 1;
+        draw_list_z_changed();
 
-	surface->toplevel = find_surface(subsurface->parent, &server->surfaces);
-        printf("subsurface's toplevel has id %f\n", surface->toplevel->id);
+	surface->toplevel = find_surface(server->surface_index, subsurface->parent);
+        printf("subsurface's toplevel has id %u\n", surface->toplevel->id);
 
 	// The x and y we just filled in are relative to our parent. However,
 	// it's possible that surface->toplevel is itself a subsurface, in
@@ -894,8 +1045,8 @@ static void add_subsurface(struct Server *server, struct wlr_subsurface *subsurf
 	// toplevel, because calc_matrices already takes this into account.
 	assert(surface->toplevel != NULL);
 	while (surface->toplevel != surface->toplevel->toplevel) {
-		surface->x += surface->toplevel->x;
-		surface->y += surface->toplevel->y;
+		TRANSFORM(surface, x) += TRANSFORM(surface->toplevel, x);
+		TRANSFORM(surface, y) += TRANSFORM(surface->toplevel, y);
 		surface->toplevel = surface->toplevel->toplevel;
 		assert(surface->toplevel != NULL);
 	}
@@ -940,17 +1091,18 @@ static void handle_subsurface_map(struct wl_listener *listener, void *data) {
         struct wlr_surface *wlr_surface = subsurface->surface;
 
         struct Server *server = wl_container_of(listener, server, handle_subsurface_map);
-        struct Surface *surface = find_surface(wlr_surface, &server->surfaces);
+        struct Surface *surface = find_surface(server->surface_index, wlr_surface);
         assert(surface != NULL);
-        assert(surface->width == 0);
-        assert(surface->height == 0);
+        assert(TRANSFORM(surface, width) == 0);
+        assert(TRANSFORM(surface, height) == 0);
 
-        surface->width = wlr_surface->current.width;
-        surface->height = wlr_surface->current.height;
+        TRANSFORM(surface, width) = wlr_surface->current.width;
+        TRANSFORM(surface, height) = wlr_surface->current.height;
+        TRANSFORM(surface, dirty) = true;
 
-        printf("[handle_subsurface_map] dims: %d %d, ID: %f, cur: %d %d, xdg_surface %p\n",
+        printf("[handle_subsurface_map] dims: %d %d, ID: %u, cur: %d %d, xdg_surface %p\n",
                 wlr_surface->current.width, wlr_surface->current.height,
-                surface->id, surface->width, surface->height, surface->xdg_surface);
+                surface->id, TRANSFORM(surface, width), TRANSFORM(surface, height), surface->xdg_surface);
 }
 
 static void handle_new_xdg_surface(struct wl_listener *listener, void *data) {
@@ -963,12 +1115,12 @@ static void handle_new_xdg_surface(struct wl_listener *listener, void *data) {
 	// The width and height will be filled in by handle_xdg_map once it is known
 	struct Surface *surface = create_surface(server, &server->surfaces, wlr_surface);
 
-	printf("New XDG surface with role %d! No dims but id is %f\n",
+	printf("New XDG surface with role %d! No dims but id is %u\n",
                 xdg_surface->role, surface->id);
 
 	surface->xdg_surface = xdg_surface;
-	surface->width = 0;
-	surface->height = 0;
+	TRANSFORM(surface, width) = 0;
+	TRANSFORM(surface, height) = 0;
 
 	surface->map.notify = handle_xdg_map;
 	wl_signal_add(&xdg_surface->events.map, &surface->map);
@@ -982,7 +1134,7 @@ static void handle_new_xdg_surface(struct wl_listener *listener, void *data) {
                 printf("\tIt's a popup!\n");
 		struct wlr_xdg_popup *popup = xdg_surface->popup;
 
-		surface->toplevel = find_surface(popup->parent, &server->surfaces);
+		surface->toplevel = find_surface(server->surface_index, popup->parent);
 		assert(surface->toplevel != NULL);
 
                 // If it's a popup, we want the top-left corner to appear
@@ -991,7 +1143,7 @@ static void handle_new_xdg_surface(struct wl_listener *listener, void *data) {
 
                 // Figure out where the cursor is relative to the parent so we
                 // can put the popup in the right spot
-                int toplevel_x, toplevel_y;
+                double toplevel_x, toplevel_y;
                 struct Surface *toplevel;
                 check_uv(server, server->cursor->x, server->cursor->y,
                         &toplevel, &toplevel_x, &toplevel_y);
@@ -1000,8 +1152,9 @@ static void handle_new_xdg_surface(struct wl_listener *listener, void *data) {
                         // mouse is over, the user probably didn't right-click
                         // to open the popup. So only continue if the toplevels
                         // match.
-                        surface->x = toplevel_x;
-                        surface->y = toplevel_y;
+                        TRANSFORM(surface, x) = toplevel_x;
+                        TRANSFORM(surface, y) = toplevel_y;
+                        TRANSFORM(surface, dirty) = true;
                 }
 	}
 
@@ -1025,18 +1178,32 @@ int main(int argc, char	*argv[]) {
 	char *startup_cmd = NULL;
 
 	int c;
-	while ((c = getopt(argc, argv, "s:h")) != -1) {
+        double hidden_frame_rate = 1;
+	while ((c = getopt(argc, argv, "s:t:b:mh")) != -1) {
 		switch (c) {
 		case 's':
 			startup_cmd = optarg;
 			break;
+                case 't':
+                        hidden_frame_rate = atof(optarg);
+                        break;
+                case 'b':
+                        // Benchmark the surface index and quit
+                        surface_index_benchmark(atoi(optarg));
+                        return 0;
+                case 'm':
+                        // Benchmark calc_matrices and quit
+                        transform_benchmark();
+                        return 0;
 		default:
-			printf("Usage: %s [-s startup command]\n", argv[0]);
+			printf("Usage: %s [-s startup command] [-t hidden frame rate] "
+                                "[-b surface count] [-m]\n", argv[0]);
 			return 0;
 		}
 	}
 	if (optind < argc) {
-		printf("Usage: %s [-s startup command]\n", argv[0]);
+		printf("Usage: %s [-s startup command] [-t hidden frame rate] "
+                        "[-b surface count] [-m]\n", argv[0]);
 		return 0;
 	}
 
@@ -1055,6 +1222,11 @@ int main(int argc, char	*argv[]) {
         server.target_colorscheme_ratio = 0;
         server.src_colorscheme_idx = 0;
         server.dst_colorscheme_idx = 1;
+        server.frame_dirty = true;
+        server.hidden_frame_rate = hidden_frame_rate;
+        server.frame_done_timer = wl_event_loop_add_timer(
+                wl_display_get_event_loop(server.wl_display), handle_frame_done_timer, &server);
+        pixman_region32_init(&server.damage);
 
 	// Create a renderer, we want Vulkan
 	int drm_fd = -1;
@@ -1090,6 +1262,8 @@ int main(int argc, char	*argv[]) {
         // listeners to xdg_surface->map and xdg_surface->subsurface->map to
         // get positioning information.
 	wl_list_init(&server.surfaces);
+        server.surface_index = surface_index_create();
+        transforms_init(&server.transforms);
 
 	// We only support one output, which will be whichever one is added first.
 	server.output = NULL;
@@ -1173,7 +1347,7 @@ int main(int argc, char	*argv[]) {
 			&server.request_set_selection);
 
 	// Screencopy support
-	wlr_screencopy_manager_v1_create(server.wl_display);
+	server.screencopy = wlr_screencopy_manager_v1_create(server.wl_display);
 
 	// Set up xwayland
 	struct wlr_xwayland *xwayland =	wlr_xwayland_create(server.wl_display, compositor, true);
@@ -1254,7 +1428,14 @@ int main(int argc, char	*argv[]) {
 	wl_display_run(server.wl_display);
 
 	/* Once	wl_display_run returns,	we shut	down the server. */
+        wl_event_source_remove(server.frame_done_timer);
 	wl_display_destroy_clients(server.wl_display);
 	wl_display_destroy(server.wl_display);
+        // Writes the pipeline cache out too
+        wlr_allocator_destroy(server.allocator);
+        wlr_renderer_destroy(server.renderer);
+        surface_index_destroy(server.surface_index);
+        transforms_finish(&server.transforms);
+        draw_list_finish();
 	return 0;
 }
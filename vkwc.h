@@ -27,6 +27,8 @@
 #include <wlr/types/wlr_xdg_output_v1.h>
 #include <wlr/types/wlr_subcompositor.h>
 
+#include "transform.h"
+
 #define COLORSCHEME_COUNT 4
 
 enum CursorMode	{
@@ -73,12 +75,37 @@ struct Server {
 	uint32_t resize_edges;
 	struct Surface *grabbed_surface;
         struct Surface *last_mouse_surface;
+        // Motion events since the last full hit test, which happens once per
+        // frame or right away if a button needs to know the exact focus
+        bool motion_pending;
+        uint32_t motion_time;
 
 	struct wlr_output *output;
 	struct wlr_output_layout *output_layout;	// Even though we only support one output,
                                                         // the screencopy API requires this
 	struct wl_listener output_frame;
 	struct wl_listener new_output;
+        // Set by schedule_frame whenever something on screen changed. Output
+        // frames are skipped while this is false.
+        bool frame_dirty;
+        // Screen damage draw_frame can't work out from the surface list, like
+        // where destroyed surfaces used to be
+        pixman_region32_t damage;
+        struct wlr_screencopy_manager_v1 *screencopy;
+        // check_uv reads the UV texture back instead of hit testing on the
+        // CPU. Toggled with Alt+u.
+        bool gpu_hit_test;
+        // How many frame done events per second surfaces that are off screen
+        // or too small to see get. 0 means none at all until they're visible
+        // again. Set with -t.
+        double hidden_frame_rate;
+        // Sends the frame done events hidden surfaces are waiting for
+        struct wl_event_source *frame_done_timer;
+        // Surface ID -> Surface, see surface_alloc_id. Slot 0 is unused since
+        // 0 means no surface.
+        struct Surface **surfaces_by_id;
+        uint32_t next_surface_id;
+        uint32_t surfaces_by_id_capacity;
 
 	struct wl_listener new_xwayland_surface;
 
@@ -86,6 +113,10 @@ struct Server {
 
 	struct wl_listener new_surface;
 	struct wl_list surfaces;
+        // wlr_surface -> Surface, see find_surface
+        struct SurfaceIndex *surface_index;
+        // Position, rotation and size of every surface
+        struct Transforms transforms;
 
         // We want to animate to the target colorscheme ratio, so that's why
         // there's two variables here - one for the current state and one for
@@ -0,0 +1,378 @@
+#include "memory.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wlr/util/log.h>
+
+// Sizes and offsets are multiples of this. Also the smallest alignment
+// anything gets.
+#define MEM_GRANULE 256
+// Regular blocks are this big, except on heaps under 1 GiB (BAR memory,
+// small integrated GPUs) where they're an eighth of the heap. Anything over
+// half a block gets a block to itself.
+#define MEM_BLOCK_SIZE ((VkDeviceSize) 64 << 20)
+
+static VkDeviceSize align_up(VkDeviceSize x, VkDeviceSize align) {
+        return (x + align - 1) & ~(align - 1);
+}
+
+// Bin a free range of this size goes in
+static void mapping_insert(VkDeviceSize size, int *fl, int *sl) {
+        *fl = 63 - __builtin_clzll(size);
+        // The top bit is implicit, the next SL_BITS pick the second level
+        *sl = (size >> (*fl - VULKAN_MEM_SL_BITS)) ^ VULKAN_MEM_SL_COUNT;
+}
+
+// First bin where everything is big enough for size
+static void mapping_search(VkDeviceSize size, int *fl, int *sl) {
+        int fl_exact = 63 - __builtin_clzll(size);
+        size += ((VkDeviceSize) 1 << (fl_exact - VULKAN_MEM_SL_BITS)) - 1;
+        mapping_insert(size, fl, sl);
+}
+
+static void insert_free(struct vulkan_mem_heap *heap, struct vulkan_mem_node *node) {
+        int fl, sl;
+        mapping_insert(node->size, &fl, &sl);
+
+        node->free = true;
+        node->prev_free = NULL;
+        node->next_free = heap->bins[fl][sl];
+        if (node->next_free != NULL) node->next_free->prev_free = node;
+        heap->bins[fl][sl] = node;
+
+        heap->fl_bitmap |= (uint64_t) 1 << fl;
+        heap->sl_bitmaps[fl] |= 1u << sl;
+}
+
+static void remove_free(struct vulkan_mem_heap *heap, struct vulkan_mem_node *node) {
+        assert(node->free);
+        int fl, sl;
+        mapping_insert(node->size, &fl, &sl);
+
+        if (node->prev_free != NULL) {
+                node->prev_free->next_free = node->next_free;
+        } else {
+                heap->bins[fl][sl] = node->next_free;
+        }
+        if (node->next_free != NULL) node->next_free->prev_free = node->prev_free;
+        node->free = false;
+
+        if (heap->bins[fl][sl] == NULL) {
+                heap->sl_bitmaps[fl] &= ~(1u << sl);
+                if (heap->sl_bitmaps[fl] == 0) heap->fl_bitmap &= ~((uint64_t) 1 << fl);
+        }
+}
+
+static struct vulkan_mem_node *find_free(struct vulkan_mem_heap *heap, VkDeviceSize size) {
+        int fl, sl;
+        mapping_search(size, &fl, &sl);
+        if (fl >= VULKAN_MEM_FL_COUNT) return NULL;
+
+        // Rest of this first level
+        uint32_t sl_map = heap->sl_bitmaps[fl] & (~0u << sl);
+        if (sl_map == 0) {
+                // Then the smallest bigger one
+                if (fl + 1 >= VULKAN_MEM_FL_COUNT) return NULL;
+                uint64_t fl_map = heap->fl_bitmap & (~(uint64_t) 0 << (fl + 1));
+                if (fl_map == 0) return NULL;
+                fl = __builtin_ctzll(fl_map);
+                sl_map = heap->sl_bitmaps[fl];
+        }
+        sl = __builtin_ctz(sl_map);
+
+        return heap->bins[fl][sl];
+}
+
+// Splits everything in node from offset on into a new node right after it
+static struct vulkan_mem_node *split(struct vulkan_mem_node *node, VkDeviceSize offset) {
+        assert(offset > 0 && offset < node->size);
+        struct vulkan_mem_node *rest = calloc(1, sizeof(*rest));
+        assert(rest != NULL);
+
+        rest->offset = node->offset + offset;
+        rest->size = node->size - offset;
+        rest->block = node->block;
+        rest->prev_phys = node;
+        rest->next_phys = node->next_phys;
+        if (rest->next_phys != NULL) rest->next_phys->prev_phys = rest;
+        node->next_phys = rest;
+        node->size = offset;
+
+        return rest;
+}
+
+// Merges next into node, next goes away
+static void merge(struct vulkan_mem_node *node, struct vulkan_mem_node *next) {
+        assert(node->next_phys == next);
+        node->size += next->size;
+        node->next_phys = next->next_phys;
+        if (node->next_phys != NULL) node->next_phys->prev_phys = node;
+        free(next);
+}
+
+static struct vulkan_mem_node *heap_alloc(struct vulkan_mem_heap *heap,
+                VkDeviceSize size, VkDeviceSize align) {
+        // Worst case, the start has to move up by almost an alignment
+        VkDeviceSize search = size + (align > MEM_GRANULE ? align - MEM_GRANULE : 0);
+        struct vulkan_mem_node *node = find_free(heap, search);
+        if (node == NULL) return NULL;
+        remove_free(heap, node);
+
+        VkDeviceSize padding = align_up(node->offset, align) - node->offset;
+        if (padding > 0) {
+                // Stays free. Whatever is before it is allocated, otherwise
+                // they'd have been merged.
+                struct vulkan_mem_node *front = node;
+                node = split(front, padding);
+                insert_free(heap, front);
+        }
+        if (node->size > size) {
+                insert_free(heap, split(node, size));
+        }
+
+        node->block->used++;
+        return node;
+}
+
+static VkDeviceSize heap_block_size(struct vulkan_allocator *allocator, uint32_t type) {
+        uint32_t heap_idx = allocator->props.memoryTypes[type].heapIndex;
+        VkDeviceSize heap_size = allocator->props.memoryHeaps[heap_idx].size;
+        if (heap_size < ((VkDeviceSize) 1 << 30)) {
+                return align_up(heap_size / 8, MEM_GRANULE);
+        }
+        return MEM_BLOCK_SIZE;
+}
+
+static struct vulkan_mem_block *block_create(struct vulkan_allocator *allocator,
+                struct vulkan_mem_heap *heap, VkDeviceSize size, bool dedicated) {
+        VkMemoryAllocateInfo alloc_info = {
+                .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                .allocationSize = size,
+                .memoryTypeIndex = heap->type,
+        };
+        VkDeviceMemory memory;
+        VkResult res = vkAllocateMemory(allocator->dev, &alloc_info, NULL, &memory);
+        if (res != VK_SUCCESS) {
+                wlr_log(WLR_ERROR, "vkAllocateMemory of %lu bytes failed: %d",
+                        (unsigned long) size, res);
+                return NULL;
+        }
+
+        void *map = NULL;
+        VkMemoryPropertyFlags flags = allocator->props.memoryTypes[heap->type].propertyFlags;
+        if (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+                res = vkMapMemory(allocator->dev, memory, 0, VK_WHOLE_SIZE, 0, &map);
+                if (res != VK_SUCCESS) {
+                        wlr_log(WLR_ERROR, "vkMapMemory failed: %d", res);
+                        vkFreeMemory(allocator->dev, memory, NULL);
+                        return NULL;
+                }
+        }
+
+        struct vulkan_mem_block *block = calloc(1, sizeof(*block));
+        struct vulkan_mem_node *node = calloc(1, sizeof(*node));
+        assert(block != NULL && node != NULL);
+        block->memory = memory;
+        block->size = size;
+        block->map = map;
+        block->dedicated = dedicated;
+        block->heap = heap;
+        wl_list_insert(&heap->blocks, &block->link);
+        if (!dedicated) heap->block_count++;
+
+        node->size = size;
+        node->block = block;
+        block->first = node;
+        if (!dedicated) insert_free(heap, node);
+
+        allocator->block_count++;
+        allocator->allocated += size;
+        wlr_log(WLR_DEBUG, "New %s%.1f MiB block for memory type %u, %u blocks, %.1f MiB total",
+                dedicated ? "dedicated " : "", (double) size / (1 << 20), heap->type,
+                allocator->block_count, (double) allocator->allocated / (1 << 20));
+
+        return block;
+}
+
+// Block has to be empty, so first is all there is left of it
+static void block_destroy(struct vulkan_allocator *allocator, struct vulkan_mem_block *block) {
+        struct vulkan_mem_node *node = block->first;
+        assert(block->used == 0);
+        assert(node->next_phys == NULL && node->size == block->size);
+        if (node->free) remove_free(block->heap, node);
+        free(node);
+
+        // Freeing unmaps it too
+        vkFreeMemory(allocator->dev, block->memory, NULL);
+        wl_list_remove(&block->link);
+        if (!block->dedicated) block->heap->block_count--;
+        allocator->block_count--;
+        allocator->allocated -= block->size;
+        free(block);
+}
+
+static struct vulkan_mem_heap *get_heap(struct vulkan_allocator *allocator, uint32_t type,
+                enum vulkan_mem_kind kind) {
+        // Nothing to keep apart
+        if (allocator->granularity <= MEM_GRANULE) kind = VULKAN_MEM_LINEAR;
+
+        struct vulkan_mem_heap **heap = &allocator->heaps[type][kind];
+        if (*heap == NULL) {
+                *heap = calloc(1, sizeof(**heap));
+                assert(*heap != NULL);
+                (*heap)->type = type;
+                (*heap)->block_size = heap_block_size(allocator, type);
+                wl_list_init(&(*heap)->blocks);
+        }
+        return *heap;
+}
+
+void vulkan_allocator_init(struct vulkan_allocator *allocator, VkDevice dev,
+                const VkPhysicalDeviceMemoryProperties *props, VkDeviceSize granularity) {
+        memset(allocator, 0, sizeof(*allocator));
+        allocator->dev = dev;
+        allocator->props = *props;
+        allocator->granularity = granularity;
+}
+
+void vulkan_allocator_finish(struct vulkan_allocator *allocator) {
+        for (int i = 0; i < VK_MAX_MEMORY_TYPES; i++) {
+                for (int j = 0; j < VULKAN_MEM_KIND_COUNT; j++) {
+                        struct vulkan_mem_heap *heap = allocator->heaps[i][j];
+                        if (heap == NULL) continue;
+
+                        struct vulkan_mem_block *block, *tmp;
+                        wl_list_for_each_safe(block, tmp, &heap->blocks, link) {
+                                if (block->used > 0) {
+                                        wlr_log(WLR_ERROR, "Memory block still has %u allocations",
+                                                block->used);
+                                }
+                                struct vulkan_mem_node *node = block->first;
+                                while (node != NULL) {
+                                        struct vulkan_mem_node *next = node->next_phys;
+                                        free(node);
+                                        node = next;
+                                }
+                                vkFreeMemory(allocator->dev, block->memory, NULL);
+                                wl_list_remove(&block->link);
+                                free(block);
+                        }
+                        free(heap);
+                }
+        }
+        memset(allocator, 0, sizeof(*allocator));
+}
+
+bool vulkan_mem_alloc(struct vulkan_allocator *allocator, VkMemoryRequirements reqs,
+                VkMemoryPropertyFlags flags, enum vulkan_mem_kind kind,
+                struct vulkan_mem_alloc *alloc) {
+        int type = -1;
+        for (uint32_t i = 0; i < allocator->props.memoryTypeCount; i++) {
+                if ((reqs.memoryTypeBits & (1u << i))
+                                && (allocator->props.memoryTypes[i].propertyFlags & flags) == flags) {
+                        type = i;
+                        break;
+                }
+        }
+        if (type < 0) {
+                wlr_log(WLR_ERROR, "Couldn't find suitable memory type");
+                return false;
+        }
+
+        struct vulkan_mem_heap *heap = get_heap(allocator, type, kind);
+        VkDeviceSize align = reqs.alignment > MEM_GRANULE ? reqs.alignment : MEM_GRANULE;
+        VkDeviceSize size = align_up(reqs.size, MEM_GRANULE);
+
+        struct vulkan_mem_node *node;
+        if (size > heap->block_size / 2) {
+                struct vulkan_mem_block *block = block_create(allocator, heap, size, true);
+                if (block == NULL) return false;
+                node = block->first;
+                block->used++;
+        } else {
+                node = heap_alloc(heap, size, align);
+                if (node == NULL) {
+                        if (block_create(allocator, heap, heap->block_size, false) == NULL) {
+                                return false;
+                        }
+                        node = heap_alloc(heap, size, align);
+                        assert(node != NULL);
+                }
+        }
+
+        struct vulkan_mem_block *block = node->block;
+        alloc->memory = block->memory;
+        alloc->offset = node->offset;
+        alloc->size = reqs.size;
+        alloc->map = block->map != NULL ? (char *) block->map + node->offset : NULL;
+        alloc->node = node;
+        return true;
+}
+
+void vulkan_mem_free(struct vulkan_allocator *allocator, struct vulkan_mem_alloc *alloc) {
+        struct vulkan_mem_node *node = alloc->node;
+        if (node == NULL) return;
+        memset(alloc, 0, sizeof(*alloc));
+
+        struct vulkan_mem_block *block = node->block;
+        struct vulkan_mem_heap *heap = block->heap;
+        assert(!node->free && block->used > 0);
+        block->used--;
+
+        if (!block->dedicated) {
+                if (node->next_phys != NULL && node->next_phys->free) {
+                        remove_free(heap, node->next_phys);
+                        merge(node, node->next_phys);
+                }
+                if (node->prev_phys != NULL && node->prev_phys->free) {
+                        struct vulkan_mem_node *prev = node->prev_phys;
+                        remove_free(heap, prev);
+                        merge(prev, node);
+                        node = prev;
+                }
+                // Keep one empty block around, so a window that keeps
+                // getting resized doesn't hit the driver every time
+                if (block->used > 0 || heap->block_count == 1) {
+                        insert_free(heap, node);
+                        return;
+                }
+        }
+
+        block_destroy(allocator, block);
+}
+
+bool vulkan_mem_alloc_image(struct vulkan_allocator *allocator, VkImage image,
+                enum vulkan_mem_kind kind, VkMemoryPropertyFlags flags,
+                struct vulkan_mem_alloc *alloc) {
+        VkMemoryRequirements reqs;
+        vkGetImageMemoryRequirements(allocator->dev, image, &reqs);
+        if (!vulkan_mem_alloc(allocator, reqs, flags, kind, alloc)) {
+                return false;
+        }
+
+        VkResult res = vkBindImageMemory(allocator->dev, image, alloc->memory, alloc->offset);
+        if (res != VK_SUCCESS) {
+                wlr_log(WLR_ERROR, "vkBindImageMemory failed: %d", res);
+                vulkan_mem_free(allocator, alloc);
+                return false;
+        }
+        return true;
+}
+
+bool vulkan_mem_alloc_buffer(struct vulkan_allocator *allocator, VkBuffer buffer,
+                VkMemoryPropertyFlags flags, struct vulkan_mem_alloc *alloc) {
+        VkMemoryRequirements reqs;
+        vkGetBufferMemoryRequirements(allocator->dev, buffer, &reqs);
+        if (!vulkan_mem_alloc(allocator, reqs, flags, VULKAN_MEM_LINEAR, alloc)) {
+                return false;
+        }
+
+        VkResult res = vkBindBufferMemory(allocator->dev, buffer, alloc->memory, alloc->offset);
+        if (res != VK_SUCCESS) {
+                wlr_log(WLR_ERROR, "vkBindBufferMemory failed: %d", res);
+                vulkan_mem_free(allocator, alloc);
+                return false;
+        }
+        return true;
+}
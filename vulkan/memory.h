@@ -0,0 +1,110 @@
+#ifndef vulkan_memory_h_INCLUDED
+#define vulkan_memory_h_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+#include <wayland-util.h>
+
+// Sub-allocates images and buffers out of big VkDeviceMemory blocks instead of
+// giving each one its own vkAllocateMemory. Free ranges are kept in TLSF
+// (two-level segregated fit) bins, so allocating and freeing are O(1) and
+// neighbouring free ranges get merged right away.
+
+// Second level bins per power of two
+#define VULKAN_MEM_SL_BITS 4
+#define VULKAN_MEM_SL_COUNT (1 << VULKAN_MEM_SL_BITS)
+// One first level bin per bit of VkDeviceSize
+#define VULKAN_MEM_FL_COUNT 64
+
+// Buffers and linear images can't share a bufferImageGranularity page with
+// optimal images. Instead of padding between them, they get separate heaps
+// when the device cares.
+enum vulkan_mem_kind {
+        VULKAN_MEM_LINEAR,
+        VULKAN_MEM_OPTIMAL,
+        VULKAN_MEM_KIND_COUNT,
+};
+
+// A range inside a block, either allocated or free
+struct vulkan_mem_node {
+        VkDeviceSize offset, size;
+        bool free;
+        struct vulkan_mem_block *block;
+        // Neighbours by address, to merge with when freed
+        struct vulkan_mem_node *prev_phys, *next_phys;
+        // Rest of the bin, only while free
+        struct vulkan_mem_node *prev_free, *next_free;
+};
+
+struct vulkan_mem_block {
+        VkDeviceMemory memory;
+        VkDeviceSize size;
+        // Mapped for as long as the block exists if it's host visible
+        void *map;
+        // Number of allocations in it
+        uint32_t used;
+        // Holds exactly one allocation that was too big to share a block
+        bool dedicated;
+        struct vulkan_mem_heap *heap;
+        // The node at offset 0. Merging always keeps the lower node, so this
+        // one lives as long as the block.
+        struct vulkan_mem_node *first;
+        struct wl_list link; // vulkan_mem_heap.blocks
+};
+
+// Blocks of one memory type and kind
+struct vulkan_mem_heap {
+        uint32_t type;
+        VkDeviceSize block_size;
+        // Bit fl of fl_bitmap is set if any bin in sl_bitmaps[fl] has
+        // something in it
+        uint64_t fl_bitmap;
+        uint32_t sl_bitmaps[VULKAN_MEM_FL_COUNT];
+        struct vulkan_mem_node *bins[VULKAN_MEM_FL_COUNT][VULKAN_MEM_SL_COUNT];
+        struct wl_list blocks;
+        // Not counting dedicated ones
+        uint32_t block_count;
+};
+
+struct vulkan_allocator {
+        VkDevice dev;
+        VkPhysicalDeviceMemoryProperties props;
+        VkDeviceSize granularity;
+        // Created the first time something needs them
+        struct vulkan_mem_heap *heaps[VK_MAX_MEMORY_TYPES][VULKAN_MEM_KIND_COUNT];
+        // Everything currently allocated from the driver, for the log
+        uint32_t block_count;
+        VkDeviceSize allocated;
+};
+
+// What vulkan_mem_alloc hands out. memory + offset is what gets bound.
+struct vulkan_mem_alloc {
+        VkDeviceMemory memory;
+        VkDeviceSize offset, size;
+        // Already offset, NULL unless the memory is host visible
+        void *map;
+        struct vulkan_mem_node *node;
+};
+
+void vulkan_allocator_init(struct vulkan_allocator *allocator, VkDevice dev,
+                const VkPhysicalDeviceMemoryProperties *props, VkDeviceSize granularity);
+// Everything should have been freed by now
+void vulkan_allocator_finish(struct vulkan_allocator *allocator);
+
+// Memory type is the first one in reqs.memoryTypeBits with all of flags.
+// Returns false if there is none or the driver is out of memory.
+bool vulkan_mem_alloc(struct vulkan_allocator *allocator, VkMemoryRequirements reqs,
+                VkMemoryPropertyFlags flags, enum vulkan_mem_kind kind,
+                struct vulkan_mem_alloc *alloc);
+// Does nothing for an alloc that's all zeroes
+void vulkan_mem_free(struct vulkan_allocator *allocator, struct vulkan_mem_alloc *alloc);
+
+// Allocate and bind in one go
+bool vulkan_mem_alloc_image(struct vulkan_allocator *allocator, VkImage image,
+                enum vulkan_mem_kind kind, VkMemoryPropertyFlags flags,
+                struct vulkan_mem_alloc *alloc);
+bool vulkan_mem_alloc_buffer(struct vulkan_allocator *allocator, VkBuffer buffer,
+                VkMemoryPropertyFlags flags, struct vulkan_mem_alloc *alloc);
+
+#endif // vulkan_memory_h_INCLUDED
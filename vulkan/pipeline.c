@@ -4,11 +4,14 @@
 #include <stdlib.h>
 
 // Generic pipeline, it turns out all of ours are pretty similar. The window
-// rendering pass renders to color and UV targets, but the postprocess only
+// rendering pass renders to color, UV and ID targets, but the postprocess only
 // renders to final color. So that's why we have output_attach_count.
-void create_pipeline(VkDevice device,
+// write_mask has a bit set for each attachment that gets written to, the rest
+// are left alone. Only the first attachment (color) is blended, the ID
+// attachment is an integer format so it can't be.
+void create_pipeline(VkDevice device, VkPipelineCache cache,
                 VkShaderModule vert_module, VkShaderModule frag_module,
-		VkRenderPass rpass, int output_attach_count,
+		VkRenderPass rpass, int output_attach_count, uint32_t write_mask,
                 VkPipelineLayout pipe_layout, VkPipeline *pipe) {
 	// Shaders
 	VkPipelineShaderStageCreateInfo vert_stage = {
@@ -60,6 +63,13 @@ void create_pipeline(VkDevice device,
                 malloc(output_attach_count * sizeof(blend_attachments[0]));
         for (int i = 0; i < output_attach_count; i++) {
                 memcpy(&blend_attachments[i], &blend_attachment, sizeof(blend_attachments[0]));
+                if (i > 0) {
+                        blend_attachments[i].blendEnable = VK_FALSE;
+                }
+                if (!(write_mask & (1 << i))) {
+                        blend_attachments[i].blendEnable = VK_FALSE;
+                        blend_attachments[i].colorWriteMask = 0;
+                }
         }
 
 	VkPipelineColorBlendStateCreateInfo blend = {0};
@@ -109,7 +119,7 @@ void create_pipeline(VkDevice device,
 	pinfo.pDynamicState = &dynamic;
 	pinfo.pVertexInputState = &vertex;
 
-	VkResult res = vkCreateGraphicsPipelines(device, NULL, 1, &pinfo, NULL, pipe);
+	VkResult res = vkCreateGraphicsPipelines(device, cache, 1, &pinfo, NULL, pipe);
 	assert(res == VK_SUCCESS);
 
         free(blend_attachments);
@@ -134,3 +144,40 @@ void create_pipeline_layout(VkDevice device, VkSampler tex_sampler,
 	VkResult res = vkCreatePipelineLayout(device, &pl_info, NULL, pipe_layout);
         assert(res == VK_SUCCESS);
 }
+
+// Compute pipelines have their own push constants, so pc_size is the size of
+// whatever struct the shader uses.
+void create_compute_pipeline_layout(VkDevice device,
+                int layout_count, VkDescriptorSetLayout *layouts, uint32_t pc_size,
+		VkPipelineLayout *pipe_layout) {
+	VkPushConstantRange pc_ranges[1] = {0};
+	pc_ranges[0].size = pc_size;
+	pc_ranges[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+	VkPipelineLayoutCreateInfo pl_info = {0};
+	pl_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pl_info.setLayoutCount = layout_count;
+	pl_info.pSetLayouts = layouts;
+	pl_info.pushConstantRangeCount = sizeof(pc_ranges) / sizeof(pc_ranges[0]);
+	pl_info.pPushConstantRanges = pc_ranges;
+
+	VkResult res = vkCreatePipelineLayout(device, &pl_info, NULL, pipe_layout);
+        assert(res == VK_SUCCESS);
+}
+
+void create_compute_pipeline(VkDevice device, VkPipelineCache cache, VkShaderModule comp_module,
+                VkPipelineLayout pipe_layout, VkPipeline *pipe) {
+	VkComputePipelineCreateInfo pinfo = {
+		.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+		.stage = {
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_COMPUTE_BIT,
+			.module = comp_module,
+			.pName = "main",
+		},
+		.layout = pipe_layout,
+	};
+
+	VkResult res = vkCreateComputePipelines(device, cache, 1, &pinfo, NULL, pipe);
+	assert(res == VK_SUCCESS);
+}
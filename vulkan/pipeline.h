@@ -6,13 +6,27 @@
 // Needed for PushConstants definition >:(
 #include "../render/vulkan.h"
 
-void create_pipeline(VkDevice device,
+// Bits for create_pipeline's write_mask, in the order of create_render_pass's
+// attachments
+#define WRITE_COLOR (1 << 0)
+#define WRITE_UV (1 << 1)
+#define WRITE_ID (1 << 2)
+
+// cache can be VK_NULL_HANDLE
+void create_pipeline(VkDevice device, VkPipelineCache cache,
                 VkShaderModule vert_module, VkShaderModule frag_module,
-		VkRenderPass rpass, int output_attach_count,
+		VkRenderPass rpass, int output_attach_count, uint32_t write_mask,
                 VkPipelineLayout pipe_layout, VkPipeline *pipe);
 
 void create_pipeline_layout(VkDevice device, VkSampler tex_sampler,
                 int layout_count, VkDescriptorSetLayout *layouts,
 		VkPipelineLayout *pipe_layout);
 
+void create_compute_pipeline_layout(VkDevice device,
+                int layout_count, VkDescriptorSetLayout *layouts, uint32_t pc_size,
+		VkPipelineLayout *pipe_layout);
+
+void create_compute_pipeline(VkDevice device, VkPipelineCache cache, VkShaderModule comp_module,
+                VkPipelineLayout pipe_layout, VkPipeline *pipe);
+
 #endif // pipeline_h_INCLUDED
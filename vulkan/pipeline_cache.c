@@ -0,0 +1,243 @@
+#include "pipeline_cache.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+
+#include "../render/vulkan.h"
+#include "../util.h"
+
+#define CACHE_MAGIC 0x6370776b // "kwpc"
+#define CACHE_VERSION 1
+
+// Goes in front of the data we get from vkGetPipelineCacheData. The driver
+// checks its own header too, but it only looks at the cache UUID, and a blob
+// from an older driver can still be accepted and then be useless.
+struct PipelineCacheHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t vendor_id;
+        uint32_t device_id;
+        uint32_t driver_version;
+        uint8_t device_uuid[VK_UUID_SIZE];
+        uint8_t cache_uuid[VK_UUID_SIZE];
+        uint64_t data_size;
+};
+
+static void fill_header(VkPhysicalDevice phdev, struct PipelineCacheHeader *header) {
+        VkPhysicalDeviceIDProperties id_props = {
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
+        };
+        VkPhysicalDeviceProperties2 props = {
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+                .pNext = &id_props,
+        };
+        vkGetPhysicalDeviceProperties2(phdev, &props);
+
+        memset(header, 0, sizeof(*header));
+        header->magic = CACHE_MAGIC;
+        header->version = CACHE_VERSION;
+        header->vendor_id = props.properties.vendorID;
+        header->device_id = props.properties.deviceID;
+        header->driver_version = props.properties.driverVersion;
+        memcpy(header->device_uuid, id_props.deviceUUID, VK_UUID_SIZE);
+        memcpy(header->cache_uuid, props.properties.pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+// Writes the directory into dir and the file into path. Returns false if
+// there's nowhere to put it.
+static bool get_cache_path(char dir[PATH_MAX], char path[PATH_MAX]) {
+        const char *cache_home = getenv("XDG_CACHE_HOME");
+        int len;
+        if (cache_home != NULL && cache_home[0] != '\0') {
+                len = snprintf(dir, PATH_MAX, "%s/vkwc", cache_home);
+        } else {
+                const char *home = getenv("HOME");
+                if (home == NULL || home[0] == '\0') {
+                        return false;
+                }
+                len = snprintf(dir, PATH_MAX, "%s/.cache/vkwc", home);
+        }
+        if (len < 0 || len >= PATH_MAX) {
+                return false;
+        }
+
+        len = snprintf(path, PATH_MAX, "%s/pipelines.bin", dir);
+        return len >= 0 && len < PATH_MAX;
+}
+
+// Reads the cache file and checks it belongs to this device and driver.
+// Returns the data after the header, or NULL.
+static void *read_cache_file(VkPhysicalDevice phdev, size_t *size) {
+        char dir[PATH_MAX], path[PATH_MAX];
+        if (!get_cache_path(dir, path)) {
+                return NULL;
+        }
+
+        FILE *file = fopen(path, "rb");
+        if (file == NULL) {
+                if (errno != ENOENT) {
+                        wlr_log_errno(WLR_ERROR, "Couldn't open pipeline cache %s", path);
+                }
+                return NULL;
+        }
+
+        struct PipelineCacheHeader header, expected;
+        fill_header(phdev, &expected);
+        if (fread(&header, sizeof(header), 1, file) != 1) {
+                wlr_log(WLR_INFO, "Pipeline cache %s is truncated, ignoring it", path);
+                fclose(file);
+                return NULL;
+        }
+
+        uint64_t data_size = header.data_size;
+        header.data_size = 0;
+        if (memcmp(&header, &expected, sizeof(header)) != 0) {
+                wlr_log(WLR_INFO, "Pipeline cache %s is from another device or driver, "
+                        "ignoring it", path);
+                fclose(file);
+                return NULL;
+        }
+
+        // Don't trust the header with how much to allocate, the data can't
+        // be bigger than the rest of the file
+        struct stat st;
+        if (fstat(fileno(file), &st) != 0
+                        || st.st_size < (off_t) sizeof(header)
+                        || data_size > (uint64_t) st.st_size - sizeof(header)) {
+                wlr_log(WLR_INFO, "Pipeline cache %s has a bogus size, ignoring it", path);
+                fclose(file);
+                return NULL;
+        }
+
+        void *data = malloc(data_size);
+        if (data == NULL || fread(data, 1, data_size, file) != data_size) {
+                wlr_log(WLR_INFO, "Pipeline cache %s is truncated, ignoring it", path);
+                free(data);
+                fclose(file);
+                return NULL;
+        }
+        fclose(file);
+
+        *size = data_size;
+        return data;
+}
+
+VkPipelineCache vulkan_load_pipeline_cache(VkDevice device, VkPhysicalDevice phdev, bool *warm) {
+        double start_time = get_time();
+
+        size_t size = 0;
+        void *data = read_cache_file(phdev, &size);
+
+        VkPipelineCacheCreateInfo info = {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+                .initialDataSize = size,
+                .pInitialData = data,
+        };
+        VkPipelineCache cache = VK_NULL_HANDLE;
+        VkResult res = vkCreatePipelineCache(device, &info, NULL, &cache);
+        if (res != VK_SUCCESS && data != NULL) {
+                // Try again with an empty one
+                wlr_vk_error("vkCreatePipelineCache", res);
+                free(data);
+                data = NULL;
+                size = 0;
+                info.initialDataSize = 0;
+                info.pInitialData = NULL;
+                res = vkCreatePipelineCache(device, &info, NULL, &cache);
+        }
+        free(data);
+
+        if (res != VK_SUCCESS) {
+                // Pipelines still work without one, just slower to make
+                wlr_vk_error("vkCreatePipelineCache", res);
+                cache = VK_NULL_HANDLE;
+        }
+
+        *warm = size > 0;
+        wlr_log(WLR_INFO, "Loaded pipeline cache (%s, %zu bytes) in %5.3f ms",
+                *warm ? "warm" : "cold", size, (get_time() - start_time) * 1000);
+
+        return cache;
+}
+
+void vulkan_save_pipeline_cache(VkDevice device, VkPhysicalDevice phdev, VkPipelineCache cache) {
+        if (cache == VK_NULL_HANDLE) {
+                return;
+        }
+
+        double start_time = get_time();
+
+        char dir[PATH_MAX], path[PATH_MAX], tmp_path[PATH_MAX];
+        if (!get_cache_path(dir, path)) {
+                wlr_log(WLR_INFO, "No XDG_CACHE_HOME or HOME, not saving the pipeline cache");
+                return;
+        }
+        int len = snprintf(tmp_path, PATH_MAX, "%s.%d.tmp", path, getpid());
+        if (len < 0 || len >= PATH_MAX) {
+                return;
+        }
+
+        size_t size;
+        VkResult res = vkGetPipelineCacheData(device, cache, &size, NULL);
+        if (res != VK_SUCCESS) {
+                wlr_vk_error("vkGetPipelineCacheData", res);
+                return;
+        }
+        void *data = malloc(size);
+        if (data == NULL) {
+                return;
+        }
+        res = vkGetPipelineCacheData(device, cache, &size, data);
+        if (res != VK_SUCCESS) {
+                wlr_vk_error("vkGetPipelineCacheData", res);
+                free(data);
+                return;
+        }
+
+        struct PipelineCacheHeader header;
+        fill_header(phdev, &header);
+        header.data_size = size;
+
+        // $XDG_CACHE_HOME itself might not exist yet either
+        char *parent_end = strrchr(dir, '/');
+        if (parent_end != NULL && parent_end != dir) {
+                *parent_end = '\0';
+                mkdir(dir, 0700);
+                *parent_end = '/';
+        }
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+                wlr_log_errno(WLR_ERROR, "Couldn't create %s", dir);
+                free(data);
+                return;
+        }
+
+        FILE *file = fopen(tmp_path, "wb");
+        if (file == NULL) {
+                wlr_log_errno(WLR_ERROR, "Couldn't open %s", tmp_path);
+                free(data);
+                return;
+        }
+
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+                && fwrite(data, 1, size, file) == size
+                && fflush(file) == 0
+                && fsync(fileno(file)) == 0;
+        ok = fclose(file) == 0 && ok;
+        free(data);
+
+        if (!ok || rename(tmp_path, path) != 0) {
+                wlr_log_errno(WLR_ERROR, "Couldn't write pipeline cache %s", path);
+                unlink(tmp_path);
+                return;
+        }
+
+        wlr_log(WLR_INFO, "Saved pipeline cache (%zu bytes) in %5.3f ms",
+                size, (get_time() - start_time) * 1000);
+}
@@ -0,0 +1,19 @@
+#ifndef vulkan_pipeline_cache_h_INCLUDED
+#define vulkan_pipeline_cache_h_INCLUDED
+
+#include <stdbool.h>
+#include <vulkan/vulkan.h>
+
+// Keeps compiled pipelines around between runs in
+// $XDG_CACHE_HOME/vkwc/pipelines.bin, so we don't have to wait for the driver
+// to compile every shader on startup.
+
+// Creates a pipeline cache, filled from disk if there's a file that was
+// written by the same device and driver. Sets *warm if it was.
+VkPipelineCache vulkan_load_pipeline_cache(VkDevice device, VkPhysicalDevice phdev, bool *warm);
+
+// Writes the cache back out. Goes through a temporary file and rename() so a
+// crash halfway through can't leave a broken cache behind.
+void vulkan_save_pipeline_cache(VkDevice device, VkPhysicalDevice phdev, VkPipelineCache cache);
+
+#endif // vulkan_pipeline_cache_h_INCLUDED
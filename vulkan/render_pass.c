@@ -3,11 +3,14 @@
 #include <assert.h>
 
 // This is the render pass for when we're rendering windows: it outputs to the
-// intermediate and UV.
+// intermediate, UV and surface ID.
 // In render_texture, the intermediate will have been in SHADER_READ_ONLY so
 // the blur pass could read it, so we need prev_intermediate_layout.
+// prev_uv_layout is used for both UV and ID. It can only be UNDEFINED if
+// clear is set and the whole image is getting repainted, otherwise the parts
+// outside the render area get lost.
 void create_render_pass(VkDevice device, VkFormat format, VkImageLayout prev_intermediate_layout,
-                bool clear, VkRenderPass *rpass) {
+                VkImageLayout prev_uv_layout, bool clear, VkRenderPass *rpass) {
 	// Intermediate
 	VkAttachmentDescription intermediate_attach = {
 		.format = format,
@@ -24,8 +27,17 @@ void create_render_pass(VkDevice device, VkFormat format, VkImageLayout prev_int
 		.samples = VK_SAMPLE_COUNT_1_BIT,
 		.loadOp = clear ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_LOAD,
 		.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-		.initialLayout = clear ? VK_IMAGE_LAYOUT_UNDEFINED
-                        : VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+		.initialLayout = prev_uv_layout,
+		.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+	};
+
+	// Surface ID
+	VkAttachmentDescription id_attach = {
+		.format = ID_FORMAT,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.loadOp = clear ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_LOAD,
+		.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+		.initialLayout = prev_uv_layout,
 		.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
 	};
 
@@ -39,7 +51,14 @@ void create_render_pass(VkDevice device, VkFormat format, VkImageLayout prev_int
 		.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
 	};
 
-	VkAttachmentReference render_attachments[] = {intermediate_out_ref, uv_attach_ref};
+	VkAttachmentReference id_attach_ref = {
+		.attachment = 2,
+		.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+	};
+
+	VkAttachmentReference render_attachments[] = {
+                intermediate_out_ref, uv_attach_ref, id_attach_ref
+        };
 
 	VkSubpassDescription render_subpass = {
 		.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
@@ -55,10 +74,14 @@ void create_render_pass(VkDevice device, VkFormat format, VkImageLayout prev_int
         // things, vertex buffer reads wait on transfer writes and texture
         // reads wait on color attachment output
 	deps[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+        // The blur reads the intermediate from a fragment or compute shader
+        // right before we write to it again
 	deps[0].srcStageMask = VK_PIPELINE_STAGE_HOST_BIT |
 		VK_PIPELINE_STAGE_TRANSFER_BIT |
 		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT |
-		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
 	deps[0].srcAccessMask = VK_ACCESS_HOST_WRITE_BIT |
 		VK_ACCESS_TRANSFER_WRITE_BIT |
 		VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
@@ -82,6 +105,7 @@ void create_render_pass(VkDevice device, VkFormat format, VkImageLayout prev_int
 	VkAttachmentDescription attachments[] = {
                 intermediate_attach,
                 uv_attach,
+                id_attach,
         };
 
 	VkRenderPassCreateInfo rpass_info = {0};
@@ -240,14 +264,16 @@ void create_postprocess_render_pass(VkDevice device, VkFormat format, VkRenderPa
 		.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
 	};
 
-        // Screen output
+        // Screen output. Stays in GENERAL, which is what the acquire barrier
+        // leaves it in - going through UNDEFINED would throw away the parts
+        // outside the damage that we want to keep.
 	VkAttachmentDescription screen_attach = {
 		.format = format,
 		.samples = VK_SAMPLE_COUNT_1_BIT,
 		.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
 		.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-		.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+		.initialLayout = VK_IMAGE_LAYOUT_GENERAL,
+		.finalLayout = VK_IMAGE_LAYOUT_GENERAL,
 	};
 
 	// Attachment references
@@ -300,7 +326,7 @@ void begin_render_pass(VkCommandBuffer cbuf, VkFramebuffer framebuffer,
                 int screen_width, int screen_height) {
 	// Clear attachments
 	VkClearValue clear_values[4] = {0};
-	// Intermediate color
+	// Intermediate color. UV and ID get cleared to 0, which means no surface.
 	clear_values[0].color.float32[0] = 0;
 	clear_values[0].color.float32[1] = 0;
 	clear_values[0].color.float32[2] = 0;
@@ -4,15 +4,21 @@
 #include <vulkan/vulkan.h>
 #include <stdbool.h>
 
-static const VkFormat UV_FORMAT = VK_FORMAT_R8G8B8A8_UNORM;
+// 16 bits per coordinate so UVs are still exact on big windows
+static const VkFormat UV_FORMAT = VK_FORMAT_R16G16_UNORM;
+// Surface IDs, 0 means no surface. See SurfaceTable in surface.h.
+static const VkFormat ID_FORMAT = VK_FORMAT_R32_UINT;
 static const VkFormat BLUR_FORMAT = VK_FORMAT_B8G8R8A8_SRGB;
+// How blur.comp sees the blur images. Same size as BLUR_FORMAT, and storage
+// support for it is mandatory.
+static const VkFormat BLUR_STORAGE_FORMAT = VK_FORMAT_R8G8B8A8_UNORM;
 
 void begin_render_pass(VkCommandBuffer cbuf, VkFramebuffer framebuffer,
                 VkRenderPass rpass, VkRect2D render_area,
                 int screen_width, int screen_height);
 
 void create_render_pass(VkDevice device, VkFormat format, VkImageLayout prev_intermediate_layout,
-                bool clear, VkRenderPass *rpass);
+                VkImageLayout prev_uv_layout, bool clear, VkRenderPass *rpass);
 
 void create_postprocess_render_pass(VkDevice device, VkFormat format, VkRenderPass *rpass);
 
@@ -1,13 +1,17 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <drm_fourcc.h>
+#include <linux/dma-buf.h>
 #include <vulkan/vulkan.h>
 #include <wlr/render/interface.h>
 #include <wlr/types/wlr_drm.h>
@@ -25,14 +29,17 @@
 #include "vulkan/shaders/common.vert.h"
 #include "vulkan/shaders/texture.vert.h"
 #include "vulkan/shaders/texture.frag.h"
+#include "vulkan/shaders/id.frag.h"
 #include "vulkan/shaders/simple_texture.frag.h"
 #include "vulkan/shaders/quad.frag.h"
 #include "vulkan/shaders/postprocess.vert.h"
 #include "vulkan/shaders/postprocess.frag.h"
 #include "vulkan/shaders/blur.frag.h"
+#include "vulkan/shaders/blur.comp.h"
 #include "vulkan/util.h"
 #include "vulkan/render_pass.h"
 #include "vulkan/pipeline.h"
+#include "vulkan/pipeline_cache.h"
 #include "vulkan/timer.h"
 #include "../util.h"
 
@@ -75,13 +82,14 @@ static void mat3_to_mat4(const float mat3[9], float mat4[4][4]) {
 // renderer
 // util
 
-struct wlr_vk_descriptor_pool *vulkan_alloc_texture_ds(struct wlr_vk_renderer *renderer,
-                VkDescriptorSet *ds) {
+// Pools have room for count sets, with either a sampler or a storage image
+static struct wlr_vk_descriptor_pool *alloc_ds(struct wlr_vk_renderer *renderer,
+                VkDescriptorSetLayout layout, VkDescriptorSet *ds) {
 	VkResult res;
 	VkDescriptorSetAllocateInfo ds_info = {0};
 	ds_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	ds_info.descriptorSetCount = 1;
-	ds_info.pSetLayouts = &renderer->tex_desc_layout;
+	ds_info.pSetLayouts = &layout;
 
 	bool found = false;
 	struct wlr_vk_descriptor_pool *pool;
@@ -105,15 +113,17 @@ struct wlr_vk_descriptor_pool *vulkan_alloc_texture_ds(struct wlr_vk_renderer *r
 		}
 
 		pool->free = count;
-		VkDescriptorPoolSize pool_size = {0};
-		pool_size.descriptorCount = count;
-		pool_size.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		VkDescriptorPoolSize pool_sizes[2] = {0};
+		pool_sizes[0].descriptorCount = count;
+		pool_sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		pool_sizes[1].descriptorCount = count;
+		pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
 
 		VkDescriptorPoolCreateInfo dpool_info = {0};
 		dpool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 		dpool_info.maxSets = count;
-		dpool_info.poolSizeCount = 1;
-		dpool_info.pPoolSizes = &pool_size;
+		dpool_info.poolSizeCount = sizeof(pool_sizes) / sizeof(pool_sizes[0]);
+		dpool_info.pPoolSizes = pool_sizes;
 		dpool_info.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
 
 		res = vkCreateDescriptorPool(renderer->dev->dev, &dpool_info, NULL,
@@ -138,6 +148,11 @@ struct wlr_vk_descriptor_pool *vulkan_alloc_texture_ds(struct wlr_vk_renderer *r
 	return pool;
 }
 
+struct wlr_vk_descriptor_pool *vulkan_alloc_texture_ds(struct wlr_vk_renderer *renderer,
+                VkDescriptorSet *ds) {
+        return alloc_ds(renderer, renderer->tex_desc_layout, ds);
+}
+
 void vulkan_free_ds(struct wlr_vk_renderer *renderer,
 		struct wlr_vk_descriptor_pool *pool, VkDescriptorSet ds) {
 	vkFreeDescriptorSets(renderer->dev->dev, pool->pool, 1, &ds);
@@ -155,10 +170,12 @@ static void destroy_render_format_setup(struct wlr_vk_renderer *renderer,
 	vkDestroyRenderPass(dev, setup->rpass_clear, NULL);
 	vkDestroyRenderPass(dev, setup->quad_rpass, NULL);
 	vkDestroyRenderPass(dev, setup->quad_clear_rpass, NULL);
+	vkDestroyRenderPass(dev, setup->quad_damage_rpass, NULL);
 	vkDestroyRenderPass(dev, setup->postprocess_rpass, NULL);
 	vkDestroyRenderPass(dev, setup->simple_rpass, NULL);
 	vkDestroyPipeline(dev, setup->simple_tex_pipe, NULL);
 	vkDestroyPipeline(dev, setup->tex_pipe, NULL);
+	vkDestroyPipeline(dev, setup->id_pipe, NULL);
 	vkDestroyPipeline(dev, setup->quad_pipe, NULL);
         for (int i = 0; i < BLUR_PASSES; i++) {
 	        vkDestroyPipeline(dev, setup->blur_pipes[i], NULL);
@@ -182,14 +199,18 @@ static void shared_buffer_destroy(struct wlr_vk_renderer *r,
 	if (buffer->buffer) {
 		vkDestroyBuffer(r->dev->dev, buffer->buffer, NULL);
 	}
-	if (buffer->memory) {
-		vkFreeMemory(r->dev->dev, buffer->memory, NULL);
-	}
+	vulkan_mem_free(&r->allocator, &buffer->memory);
 
 	wl_list_remove(&buffer->link);
 	free(buffer);
 }
 
+// Frame that whatever is recorded into the stage cb right now will be part of
+static uint32_t stage_frame(struct wlr_vk_renderer *r) {
+	struct wlr_vk_frame_slot *slot = &r->frame_slots[r->frame_slot_idx];
+	return slot->recording ? slot->frame : r->frame + 1;
+}
+
 struct wlr_vk_buffer_span vulkan_get_stage_span(struct wlr_vk_renderer *r,
 		VkDeviceSize size) {
 	// try to find free span
@@ -224,6 +245,7 @@ struct wlr_vk_buffer_span vulkan_get_stage_span(struct wlr_vk_renderer *r,
 		struct wlr_vk_allocation *a = &buf->allocs[buf->allocs_size - 1];
 		a->start = start;
 		a->size = size;
+		buf->frame = stage_frame(r);
 		return (struct wlr_vk_buffer_span) {
 			.buffer = buf,
 			.alloc = *a,
@@ -267,24 +289,9 @@ struct wlr_vk_buffer_span vulkan_get_stage_span(struct wlr_vk_renderer *r,
 		goto error;
 	}
 
-	VkMemoryRequirements mem_reqs;
-	vkGetBufferMemoryRequirements(r->dev->dev, buf->buffer, &mem_reqs);
-
-	VkMemoryAllocateInfo mem_info = {0};
-	mem_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	mem_info.allocationSize = mem_reqs.size;
-	mem_info.memoryTypeIndex = vulkan_find_mem_type(r->dev,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, mem_reqs.memoryTypeBits);
-	res = vkAllocateMemory(r->dev->dev, &mem_info, NULL, &buf->memory);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkAllocatorMemory", res);
-		goto error;
-	}
-
-	res = vkBindBufferMemory(r->dev->dev, buf->buffer, buf->memory, 0);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkBindBufferMemory", res);
+	if (!vulkan_mem_alloc_buffer(&r->allocator, buf->buffer,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &buf->memory)) {
 		goto error;
 	}
 
@@ -303,6 +310,7 @@ struct wlr_vk_buffer_span vulkan_get_stage_span(struct wlr_vk_renderer *r,
 	buf->allocs_size = 1u;
 	buf->allocs[0].start = 0u;
 	buf->allocs[0].size = size;
+	buf->frame = stage_frame(r);
 	return (struct wlr_vk_buffer_span) {
 		.buffer = buf,
 		.alloc = buf->allocs[0],
@@ -328,142 +336,864 @@ struct wlr_vk_format_props *vulkan_format_props_from_drm(
 	return NULL;
 }
 
-// buffer import
-static void destroy_render_buffer(struct wlr_vk_render_buffer *buffer) {
-	wl_list_remove(&buffer->link);
-	wl_list_remove(&buffer->buffer_destroy.link);
+// frame slots
 
-	assert(buffer->renderer->current_render_buffer != buffer);
+// Not in older kernel headers
+#ifndef DMA_BUF_IOCTL_IMPORT_SYNC_FILE
+struct dma_buf_import_sync_file {
+	__u32 flags;
+	__s32 fd;
+};
+#define DMA_BUF_IOCTL_IMPORT_SYNC_FILE _IOW(DMA_BUF_BASE, 3, struct dma_buf_import_sync_file)
+#endif
 
-	VkDevice dev = buffer->renderer->dev->dev;
+// Must only be called once the slot's fence has signalled
+static void retire_frame_slot(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_frame_slot *slot) {
+        assert(slot->pending);
 
-	vkDestroyImageView(dev, buffer->screen_view, NULL);
-	vkDestroyImage(dev, buffer->screen, NULL);
+        VkResult res = vkResetFences(renderer->dev->dev, 1, &slot->fence);
+        if (res != VK_SUCCESS) {
+                wlr_vk_error("vkResetFences", res);
+                exit(1);
+        }
+        slot->pending = false;
+
+        // Recycles the frame's command buffers and every transient one
+        // taken since the slot was last reset. The frame waited for its
+        // uploads, so the transfer ones are done too.
+        struct wlr_vk_cb_arena *arenas[] = { &slot->transient, &slot->transfer };
+        for (size_t i = 0; i < sizeof(arenas) / sizeof(arenas[0]); i++) {
+                if (arenas[i]->pool == VK_NULL_HANDLE) {
+                        continue;
+                }
+                res = vkResetCommandPool(renderer->dev->dev, arenas[i]->pool, 0);
+                if (res != VK_SUCCESS) {
+                        wlr_vk_error("vkResetCommandPool", res);
+                        exit(1);
+                }
+                arenas[i]->used = 0;
+        }
 
-        vkDestroyImage(dev, buffer->intermediate, NULL);
-        vkDestroyImageView(dev, buffer->intermediate_view, NULL);
-        vkFreeMemory(dev, buffer->intermediate_mem, NULL);
+        // A fence signal covers everything submitted before it too, so slots
+        // can be retired out of order without lying about this
+        if (slot->frame > renderer->completed_frame) {
+                renderer->completed_frame = slot->frame;
+        }
 
-        for (int i = 0; i < BLUR_PASSES; i++) {
-                vkDestroyImage(dev, buffer->blurs[i], NULL);
-                vkDestroyImageView(dev, buffer->blur_views[i], NULL);
-                vkFreeMemory(dev, buffer->blur_mems[i], NULL);
-                vkDestroyFramebuffer(dev, buffer->blur_framebuffers[i], NULL);
+        // Release staging buffers the GPU is done copying from
+	struct wlr_vk_shared_buffer *buf;
+	wl_list_for_each(buf, &renderer->stage.buffers, link) {
+                if (buf->frame <= renderer->completed_frame) {
+		        buf->allocs_size = 0u;
+                }
+	}
+
+        // Destroy textures that were waiting for the GPU to stop using them
+        struct wlr_vk_texture *texture, *tmp_tex;
+        wl_list_for_each_safe(texture, tmp_tex, &renderer->destroy_textures, destroy_link) {
+                if (texture->last_used <= renderer->completed_frame) {
+                        wlr_log(WLR_DEBUG, "Destroy texture %p", texture);
+                        wl_list_remove(&texture->destroy_link);
+                        vulkan_texture_destroy(texture);
+                }
         }
+}
 
-        vkDestroyFramebuffer(dev, buffer->framebuffer, NULL);
-        vkDestroyFramebuffer(dev, buffer->simple_framebuffer, NULL);
+static void wait_frame_slot(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_frame_slot *slot) {
+        VkResult res = vkWaitForFences(renderer->dev->dev, 1, &slot->fence, VK_TRUE, UINT64_MAX);
+        if (res != VK_SUCCESS) {
+                wlr_vk_error("vkWaitForFences", res);
+                exit(1);
+        }
+        retire_frame_slot(renderer, slot);
+}
 
-	vkDestroyImage(dev, buffer->uv, NULL);
-	vkDestroyImageView(dev, buffer->uv_view, NULL);
-	vkFreeMemory(dev, buffer->uv_mem, NULL);
+void vulkan_poll_frames(struct wlr_vk_renderer *renderer) {
+        for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+                struct wlr_vk_frame_slot *slot = &renderer->frame_slots[i];
+                if (slot->pending
+                                && vkGetFenceStatus(renderer->dev->dev, slot->fence) == VK_SUCCESS) {
+                        retire_frame_slot(renderer, slot);
+                }
+        }
+}
 
-	vkDestroyBuffer(dev, buffer->host_uv, NULL);
-	vkFreeMemory(dev, buffer->host_uv_mem, NULL);
+void vulkan_wait_frame(struct wlr_vk_renderer *renderer, uint32_t frame) {
+        if (frame <= renderer->completed_frame) {
+                return;
+        }
 
-	for (size_t i = 0u; i < buffer->mem_count; ++i) {
-		vkFreeMemory(dev, buffer->memories[i], NULL);
-	}
+        for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+                struct wlr_vk_frame_slot *slot = &renderer->frame_slots[i];
+                if (slot->pending && slot->frame <= frame) {
+                        wait_frame_slot(renderer, slot);
+                }
+        }
+}
 
-	free(buffer);
+struct wlr_vk_frame_slot *vulkan_begin_frame(struct wlr_vk_renderer *renderer) {
+        struct wlr_vk_frame_slot *slot = &renderer->frame_slots[renderer->frame_slot_idx];
+        assert(!slot->recording);
+
+        // Only blocks if the CPU is more than FRAMES_IN_FLIGHT frames ahead
+        if (slot->pending) {
+                wait_frame_slot(renderer, slot);
+        }
+
+        // The render buffer's images are about to be overwritten, so the GPU
+        // has to be done with the last frame that drew into them. With a
+        // double buffered swapchain this is usually already the case.
+        if (renderer->current_render_buffer != NULL) {
+                vulkan_wait_frame(renderer, renderer->current_render_buffer->frame);
+        }
+
+        renderer->frame++;
+        slot->frame = renderer->frame;
+        slot->recording = true;
+
+        renderer->cb = slot->cb;
+
+        cbuf_begin_onetime(slot->cb);
+        gpu_profiler_begin_frame(slot->cb, slot->frame);
+
+        return slot;
 }
 
-static struct wlr_vk_render_buffer *get_render_buffer(
-		struct wlr_vk_renderer *renderer, struct wlr_buffer *wlr_buffer) {
-	struct wlr_vk_render_buffer *buffer;
-	wl_list_for_each(buffer, &renderer->render_buffers, link) {
-		if (buffer->wlr_buffer == wlr_buffer) {
-			return buffer;
-		}
-	}
-	return NULL;
+static VkCommandBuffer arena_take(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_cb_arena *arena) {
+        if (arena->used == arena->capacity) {
+                size_t capacity = arena->capacity == 0 ? 4 : arena->capacity * 2;
+                VkCommandBuffer *cbs = realloc(arena->cbs, capacity * sizeof(*cbs));
+                if (cbs == NULL) {
+                        wlr_log_errno(WLR_ERROR, "Allocation failed");
+                        exit(1);
+                }
+
+                VkCommandBufferAllocateInfo info = {0};
+                info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+                info.commandPool = arena->pool;
+                info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+                info.commandBufferCount = capacity - arena->capacity;
+                VkResult res = vkAllocateCommandBuffers(renderer->dev->dev, &info,
+                        &cbs[arena->capacity]);
+                if (res != VK_SUCCESS) {
+                        wlr_vk_error("vkAllocateCommandBuffers", res);
+                        exit(1);
+                }
+
+                arena->cbs = cbs;
+                arena->capacity = capacity;
+        }
+
+        VkCommandBuffer cb = arena->cbs[arena->used++];
+        cbuf_begin_onetime(cb);
+        return cb;
 }
 
-static void handle_render_buffer_destroy(struct wl_listener *listener, void *data) {
-	struct wlr_vk_render_buffer *buffer =
-		wl_container_of(listener, buffer, buffer_destroy);
-	destroy_render_buffer(buffer);
+// The slot the next frame will be recorded into, once its last frame is done.
+// Its pools can only be handed out from after that, since that's when they get
+// reset.
+static struct wlr_vk_frame_slot *get_free_slot(struct wlr_vk_renderer *renderer) {
+        struct wlr_vk_frame_slot *slot = &renderer->frame_slots[renderer->frame_slot_idx];
+        if (slot->pending) {
+                wait_frame_slot(renderer, slot);
+        }
+        return slot;
 }
 
-static void alloc_memory(struct wlr_vk_renderer *renderer,
-		VkMemoryRequirements requirements, VkMemoryPropertyFlagBits properties,
-                VkDeviceMemory *memory) {
-	int type = vulkan_find_mem_type(renderer->dev, properties, requirements.memoryTypeBits);
-	if (type < 0) {
-		wlr_log(WLR_ERROR, "Couldn't find suitable memory type");
-		exit(1);
-	}
+VkCommandBuffer begin_transient_cb(struct wlr_vk_renderer *renderer) {
+        return arena_take(renderer, &get_free_slot(renderer)->transient);
+}
 
-	VkMemoryAllocateInfo alloc_info = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		.allocationSize = requirements.size,
-		.memoryTypeIndex = type,
-	};
+// Like begin_transient_cb, but for the transfer queue
+static VkCommandBuffer begin_transfer_cb(struct wlr_vk_renderer *renderer) {
+        struct wlr_vk_frame_slot *slot = get_free_slot(renderer);
+        return arena_take(renderer, renderer->dev->has_transfer_queue
+                ? &slot->transfer : &slot->transient);
+}
 
-	VkResult res = vkAllocateMemory(renderer->dev->dev, &alloc_info, NULL, memory);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkAllocateMemory failed", res);
-		exit(1);
-	}
+// vkQueueSubmit with a single batch. Semaphores can be a mix of binary and
+// timeline ones, values are ignored for binary ones.
+static bool queue_submit(struct wlr_vk_renderer *renderer, VkQueue queue,
+                uint32_t cb_count, const VkCommandBuffer *cbs,
+                uint32_t wait_count, const VkSemaphore *waits,
+                const uint64_t *wait_values, const VkPipelineStageFlags *wait_stages,
+                uint32_t signal_count, const VkSemaphore *signals,
+                const uint64_t *signal_values, VkFence fence) {
+        VkTimelineSemaphoreSubmitInfoKHR timeline_info = {
+                .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+                .waitSemaphoreValueCount = wait_values != NULL ? wait_count : 0,
+                .pWaitSemaphoreValues = wait_values,
+                .signalSemaphoreValueCount = signal_values != NULL ? signal_count : 0,
+                .pSignalSemaphoreValues = signal_values,
+        };
+
+        VkSubmitInfo submit_info = {0};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        if (wait_values != NULL || signal_values != NULL) {
+                submit_info.pNext = &timeline_info;
+        }
+        submit_info.commandBufferCount = cb_count;
+        submit_info.pCommandBuffers = cbs;
+        submit_info.waitSemaphoreCount = wait_count;
+        submit_info.pWaitSemaphores = waits;
+        submit_info.pWaitDstStageMask = wait_stages;
+        submit_info.signalSemaphoreCount = signal_count;
+        submit_info.pSignalSemaphores = signals;
+
+        VkResult res = vkQueueSubmit(queue, 1, &submit_info, fence);
+        if (res != VK_SUCCESS) {
+                wlr_vk_error("vkQueueSubmit", res);
+                return false;
+        }
+
+        return true;
 }
 
-void render_buffer_create_descriptor_sets(struct wlr_vk_renderer *renderer,
-                struct wlr_vk_render_buffer *buffer) {
+static bool wait_renderer_fence(struct wlr_vk_renderer *renderer) {
+        VkResult res = vkWaitForFences(renderer->dev->dev, 1, &renderer->fence, VK_TRUE, UINT64_MAX);
+        if (res != VK_SUCCESS) {
+                wlr_vk_error("vkWaitForFences", res);
+                return false;
+        }
+
+        res = vkResetFences(renderer->dev->dev, 1, &renderer->fence);
+        if (res != VK_SUCCESS) {
+                wlr_vk_error("vkResetFences", res);
+                return false;
+        }
+
+        return true;
+}
+
+bool submit_transient_cb(struct wlr_vk_renderer *renderer, VkCommandBuffer cb, bool wait) {
+        VkResult res = vkEndCommandBuffer(cb);
+        if (res != VK_SUCCESS) {
+                wlr_vk_error("vkEndCommandBuffer", res);
+                return false;
+        }
+
+        if (!queue_submit(renderer, renderer->dev->queue, 1, &cb, 0, NULL, NULL, NULL,
+                        0, NULL, NULL, wait ? renderer->fence : VK_NULL_HANDLE)) {
+                return false;
+        }
+
+        // Without waiting, the slot's next fence covers it, since that
+        // frame is submitted later on the same queue
+        if (!wait) {
+                return true;
+        }
+
+        return wait_renderer_fence(renderer);
+}
+
+VkCommandBuffer vulkan_record_stage_cb(struct wlr_vk_renderer *renderer) {
+        struct wlr_vk_frame_slot *slot = &renderer->frame_slots[renderer->frame_slot_idx];
+        if (!slot->stage_recording) {
+                slot->stage_cb = begin_transfer_cb(renderer);
+                slot->stage_recording = true;
+                slot->stage_wait_frame = 0;
+        }
+
+        return slot->stage_cb;
+}
+
+void vulkan_stage_wait_frame(struct wlr_vk_renderer *renderer, uint32_t frame) {
+        struct wlr_vk_frame_slot *slot = &renderer->frame_slots[renderer->frame_slot_idx];
+        assert(slot->stage_recording);
+        // Textures uploaded earlier in the same stage cb are tagged with a
+        // frame that hasn't been submitted yet
+        if (frame > renderer->frame) {
+                frame = renderer->frame;
+        }
+        if (frame > slot->stage_wait_frame) {
+                slot->stage_wait_frame = frame;
+        }
+}
+
+// Ends the stage cb and, if uploads have their own queue, submits it there.
+// Otherwise graphics_cb is set to it and the caller has to submit it on the
+// graphics queue. On the transfer queue it waits for the graphics timeline to
+// reach stage_wait_frame and signals transfer_timeline with the incremented
+// renderer->transfer_point.
+static bool flush_stage_cb(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_frame_slot *slot, VkFence fence, VkCommandBuffer *graphics_cb) {
+        *graphics_cb = VK_NULL_HANDLE;
+        if (!slot->stage_recording) {
+                return true;
+        }
+        slot->stage_recording = false;
+
+        VkResult res = vkEndCommandBuffer(slot->stage_cb);
+        if (res != VK_SUCCESS) {
+                wlr_vk_error("vkEndCommandBuffer", res);
+                return false;
+        }
+
+        if (!renderer->dev->has_transfer_queue) {
+                *graphics_cb = slot->stage_cb;
+                return true;
+        }
+
+        // A frame that is still being recorded can't have sampled anything
+        // we're uploading, and waiting on it would deadlock
+        assert(!slot->recording || slot->stage_wait_frame < slot->frame);
+
+        uint64_t wait_value = slot->stage_wait_frame;
+        VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        uint64_t signal_value = ++renderer->transfer_point;
+        return queue_submit(renderer, renderer->dev->transfer_queue, 1, &slot->stage_cb,
+                1, &renderer->graphics_timeline, &wait_value, &wait_stage,
+                1, &renderer->transfer_timeline, &signal_value, fence);
+}
+
+bool vulkan_submit_stage_wait(struct wlr_vk_renderer *renderer) {
+        struct wlr_vk_frame_slot *slot = &renderer->frame_slots[renderer->frame_slot_idx];
+        if (!slot->stage_recording) {
+                return true;
+        }
+
+        VkCommandBuffer graphics_cb;
+        if (!flush_stage_cb(renderer, slot, renderer->fence, &graphics_cb)) {
+                return false;
+        }
+        if (graphics_cb != VK_NULL_HANDLE && !queue_submit(renderer, renderer->dev->queue,
+                        1, &graphics_cb, 0, NULL, NULL, NULL, 0, NULL, NULL, renderer->fence)) {
+                return false;
+        }
+
+        return wait_renderer_fence(renderer);
+}
+
+// Attaches a sync_file that signals when the slot is done to every plane of
+// the render buffer's dmabuf, so whoever reads it next (KMS, the parent
+// compositor) waits for the GPU instead of us.
+static bool sync_render_buffer(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_render_buffer *render_buf,
+                struct wlr_vk_frame_slot *slot) {
+        if (!renderer->dev->implicit_sync_interop) {
+                return false;
+        }
+
+        struct wlr_dmabuf_attributes dmabuf = {0};
+        if (!wlr_buffer_get_dmabuf(render_buf->wlr_buffer, &dmabuf)) {
+                wlr_log(WLR_ERROR, "sync_render_buffer: not a dmabuf");
+                return false;
+        }
+
+        VkSemaphoreGetFdInfoKHR get_fence_fd_info = {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR,
+                .semaphore = slot->semaphore,
+                .handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+        };
+        int sync_file_fd = -1;
+        VkResult res = renderer->dev->api.getSemaphoreFdKHR(renderer->dev->dev,
+                &get_fence_fd_info, &sync_file_fd);
+        if (res != VK_SUCCESS) {
+                wlr_vk_error("vkGetSemaphoreFdKHR", res);
+                return false;
+        }
+
+        // A sync_file of -1 means the semaphore had already signalled
+        if (sync_file_fd < 0) {
+                return true;
+        }
+
+        bool ok = true;
+        for (int i = 0; i < dmabuf.n_planes; i++) {
+                struct dma_buf_import_sync_file data = {
+                        .flags = DMA_BUF_SYNC_WRITE,
+                        .fd = sync_file_fd,
+                };
+                int ret;
+                do {
+                        ret = ioctl(dmabuf.fd[i], DMA_BUF_IOCTL_IMPORT_SYNC_FILE, &data);
+                } while (ret != 0 && (errno == EINTR || errno == EAGAIN));
+                if (ret != 0) {
+                        wlr_log_errno(WLR_ERROR, "DMA_BUF_IOCTL_IMPORT_SYNC_FILE failed");
+                        ok = false;
+                        break;
+                }
+        }
+
+        close(sync_file_fd);
+        return ok;
+}
+
+bool vulkan_submit_frame(struct wlr_vk_renderer *renderer) {
+        struct wlr_vk_frame_slot *slot = &renderer->frame_slots[renderer->frame_slot_idx];
+        struct wlr_vk_render_buffer *render_buf = renderer->current_render_buffer;
+        struct wlr_vk_device *dev = renderer->dev;
+        assert(slot->recording);
+        assert(render_buf != NULL);
+
+        gpu_profiler_end_frame();
+        VkResult res = vkEndCommandBuffer(slot->cb);
+        if (res != VK_SUCCESS) {
+                slot->recording = false;
+                wlr_vk_error("vkEndCommandBuffer", res);
+                return false;
+        }
+
+        // Uploads go first. On the graphics queue the barriers recorded with
+        // them make the frame wait for them, on the transfer queue the
+        // frame waits for transfer_timeline.
+        VkCommandBuffer cbs[2];
+        uint32_t cb_count = 0;
+        uint64_t prev_transfer_point = renderer->transfer_point;
+        VkCommandBuffer stage_cb;
+        bool ok = flush_stage_cb(renderer, slot, VK_NULL_HANDLE, &stage_cb);
+        slot->recording = false;
+        if (!ok) {
+                return false;
+        }
+        if (stage_cb != VK_NULL_HANDLE) {
+                cbs[cb_count++] = stage_cb;
+        }
+        cbs[cb_count++] = slot->cb;
+
+        VkSemaphore waits[1];
+        uint64_t wait_values[1];
+        VkPipelineStageFlags wait_stages[1];
+        uint32_t wait_count = 0;
+        if (renderer->transfer_point != prev_transfer_point) {
+                waits[wait_count] = renderer->transfer_timeline;
+                wait_values[wait_count] = renderer->transfer_point;
+                wait_stages[wait_count] = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+                wait_count++;
+        }
+
+        VkSemaphore signals[2];
+        uint64_t signal_values[2];
+        uint32_t signal_count = 0;
+        if (dev->has_transfer_queue) {
+                signals[signal_count] = renderer->graphics_timeline;
+                signal_values[signal_count] = slot->frame;
+                signal_count++;
+        }
+        if (dev->implicit_sync_interop) {
+                signals[signal_count] = slot->semaphore;
+                signal_values[signal_count] = 0; // binary
+                signal_count++;
+        }
+
+        if (!queue_submit(renderer, dev->queue, cb_count, cbs,
+                        wait_count, waits, dev->has_transfer_queue ? wait_values : NULL, wait_stages,
+                        signal_count, signals, dev->has_transfer_queue ? signal_values : NULL,
+                        slot->fence)) {
+                return false;
+        }
+
+        slot->pending = true;
+        render_buf->frame = slot->frame;
+        renderer->frame_slot_idx = (renderer->frame_slot_idx + 1) % FRAMES_IN_FLIGHT;
+
+        if (!sync_render_buffer(renderer, render_buf, slot)) {
+                if (renderer->dev->implicit_sync_interop) {
+                        // The semaphore stays signalled if it couldn't be
+                        // exported, so stop using it altogether
+                        wlr_log(WLR_ERROR, "Implicit sync failed, waiting for the GPU from now on");
+                        renderer->dev->implicit_sync_interop = false;
+                }
+
+                // Nobody downstream can wait for the GPU, so we have to
+                vulkan_wait_frame(renderer, slot->frame);
+        }
+
+        return true;
+}
+
+// transient sets
+static void destroy_transient_set(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_transient_set *set) {
+	VkDevice dev = renderer->dev->dev;
+
+        vkDestroyImage(dev, set->intermediate, NULL);
+        vkDestroyImageView(dev, set->intermediate_view, NULL);
+        vulkan_mem_free(&renderer->allocator, &set->intermediate_mem);
+
+        for (int i = 0; i < BLUR_PASSES; i++) {
+                vkDestroyImage(dev, set->blurs[i], NULL);
+                vkDestroyImageView(dev, set->blur_views[i], NULL);
+                vkDestroyImageView(dev, set->blur_storage_views[i], NULL);
+                vulkan_mem_free(&renderer->allocator, &set->blur_mems[i]);
+                vkDestroyFramebuffer(dev, set->blur_framebuffers[i], NULL);
+        }
+
+        vkDestroyFramebuffer(dev, set->framebuffer, NULL);
+
+	vkDestroyImage(dev, set->uv, NULL);
+	vkDestroyImageView(dev, set->uv_view, NULL);
+	vulkan_mem_free(&renderer->allocator, &set->uv_mem);
+
+	vkDestroyImage(dev, set->id, NULL);
+	vkDestroyImageView(dev, set->id_view, NULL);
+	vulkan_mem_free(&renderer->allocator, &set->id_mem);
+}
+
+static void unref_transients(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_transients *transients) {
+        assert(transients->ref_count > 0);
+        if (--transients->ref_count > 0) {
+                return;
+        }
+
+        // Every set might still be in use by a frame in flight
+        for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+                vulkan_wait_frame(renderer, transients->sets[i].frame);
+                destroy_transient_set(renderer, &transients->sets[i]);
+        }
+        vkDestroyBuffer(renderer->dev->dev, transients->readback, NULL);
+        vulkan_mem_free(&renderer->allocator, &transients->readback_mem);
+
+        wlr_log(WLR_DEBUG, "Destroyed %ux%u transient sets",
+                transients->width, transients->height);
+        wl_list_remove(&transients->link);
+        free(transients);
+}
+
+// Render targets can't do without their memory, so this gives up if there's
+// none
+static void alloc_image_memory(struct wlr_vk_renderer *renderer, VkImage image,
+                struct vulkan_mem_alloc *alloc) {
+        if (!vulkan_mem_alloc_image(&renderer->allocator, image, VULKAN_MEM_OPTIMAL,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, alloc)) {
+                wlr_log(WLR_ERROR, "Couldn't allocate render buffer memory");
+                exit(1);
+        }
+}
+
+static void transient_set_create_descriptor_sets(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_transient_set *set) {
         // TODO: Make sure the descriptor pools get destroyed
 
         // Intermediate image
         struct wlr_vk_descriptor_pool *dpool = vulkan_alloc_texture_ds(renderer,
-                &buffer->intermediate_set);
+                &set->intermediate_set);
         assert(dpool != NULL);
 
         VkDescriptorImageInfo img_info = {0};
-        img_info.imageView = buffer->intermediate_view;
+        img_info.imageView = set->intermediate_view;
         img_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
         VkWriteDescriptorSet write = {0};
         write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
         write.descriptorCount = 1;
         write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        write.dstSet = buffer->intermediate_set;
+        write.dstSet = set->intermediate_set;
         write.pImageInfo = &img_info;
 
         vkUpdateDescriptorSets(renderer->dev->dev, 1, &write, 0, NULL);
 
         // Blur images
         for (int i = 0; i < BLUR_PASSES; i++) {
-                dpool = vulkan_alloc_texture_ds(renderer, &buffer->blur_sets[i]);
+                dpool = vulkan_alloc_texture_ds(renderer, &set->blur_sets[i]);
                 assert(dpool != NULL);
 
-                img_info.imageView = buffer->blur_views[i];
+                img_info.imageView = set->blur_views[i];
                 img_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
                 write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
                 write.descriptorCount = 1;
                 write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-                write.dstSet = buffer->blur_sets[i];
+                write.dstSet = set->blur_sets[i];
+                write.pImageInfo = &img_info;
+
+                vkUpdateDescriptorSets(renderer->dev->dev, 1, &write, 0, NULL);
+        }
+
+        // Blur images again, but for writing from blur.comp
+        for (int i = 0; i < BLUR_PASSES && renderer->compute_blur_supported; i++) {
+                dpool = alloc_ds(renderer, renderer->storage_desc_layout,
+                        &set->blur_storage_sets[i]);
+                assert(dpool != NULL);
+
+                img_info.imageView = set->blur_storage_views[i];
+                img_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+                write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                write.descriptorCount = 1;
+                write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+                write.dstSet = set->blur_storage_sets[i];
                 write.pImageInfo = &img_info;
 
                 vkUpdateDescriptorSets(renderer->dev->dev, 1, &write, 0, NULL);
         }
 
         // UV buffer
-        dpool = vulkan_alloc_texture_ds(renderer, &buffer->uv_set);
+        dpool = vulkan_alloc_texture_ds(renderer, &set->uv_set);
         assert(dpool != NULL);
 
-        img_info.imageView = buffer->uv_view;
+        img_info.imageView = set->uv_view;
         img_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
         write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
         write.descriptorCount = 1;
         write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        write.dstSet = buffer->uv_set;
+        write.dstSet = set->uv_set;
         write.pImageInfo = &img_info;
 
-        vkUpdateDescriptorSets(renderer->dev->dev, 1, &write, 0, NULL);
+        vkUpdateDescriptorSets(renderer->dev->dev, 1, &write, 0, NULL);
+}
+
+static void create_transient_set(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_transients *transients, VkFormat format,
+                struct wlr_vk_transient_set *set) {
+	VkResult res;
+	VkDevice dev = renderer->dev->dev;
+        uint32_t width = transients->width, height = transients->height;
+
+        // Create the intermediate image.
+        create_image(renderer->dev->phdev, renderer->dev->dev, format,
+                VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT
+                        | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT,
+                width, height,
+                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+                        | VK_IMAGE_USAGE_SAMPLED_BIT,
+                0, &set->intermediate);
+
+        alloc_image_memory(renderer, set->intermediate, &set->intermediate_mem);
+
+        create_image_view(renderer->dev->dev, format,
+                set->intermediate, VK_IMAGE_ASPECT_COLOR_BIT,
+                &set->intermediate_view);
+
+        // Create the blur images. For the compute blur they also need to be
+        // writable through a BLUR_STORAGE_FORMAT view, which BLUR_FORMAT
+        // itself doesn't support.
+        VkImageUsageFlags blur_usage =
+                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+        VkImageCreateFlags blur_flags = 0;
+        if (renderer->compute_blur_supported) {
+                blur_usage |= VK_IMAGE_USAGE_STORAGE_BIT;
+                blur_flags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT
+                        | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT;
+        }
+        for (int i = 0; i < BLUR_PASSES; i++) {
+                int blur_width = width / (2 << i);
+                int blur_height = height / (2 << i);
+                if (blur_width < 1) blur_width = 1;
+                if (blur_height < 1) blur_height = 1;
+                create_image(renderer->dev->phdev, renderer->dev->dev, BLUR_FORMAT,
+                        VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT,
+                        blur_width, blur_height, blur_usage, blur_flags, &set->blurs[i]);
+
+                alloc_image_memory(renderer, set->blurs[i], &set->blur_mems[i]);
+
+                create_image_view_with_usage(renderer->dev->dev, BLUR_FORMAT,
+                        set->blurs[i], VK_IMAGE_ASPECT_COLOR_BIT,
+                        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                        &set->blur_views[i]);
+
+                if (renderer->compute_blur_supported) {
+                        create_image_view_with_usage(renderer->dev->dev, BLUR_STORAGE_FORMAT,
+                                set->blurs[i], VK_IMAGE_ASPECT_COLOR_BIT,
+                                VK_IMAGE_USAGE_STORAGE_BIT, &set->blur_storage_views[i]);
+                }
+        }
+
+	// Create attachment to write UV coordinates into
+	create_image(renderer->dev->phdev, renderer->dev->dev,
+                UV_FORMAT, VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT,
+		width, height,
+		VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+                        | VK_IMAGE_USAGE_SAMPLED_BIT
+                        | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+                        | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                0, &set->uv);
+
+	alloc_image_memory(renderer, set->uv, &set->uv_mem);
+
+        create_image_view(renderer->dev->dev, UV_FORMAT, set->uv,
+                VK_IMAGE_ASPECT_COLOR_BIT, &set->uv_view);
+
+	// And one for surface IDs. It's only sampled so it can be in
+	// SHADER_READ_ONLY along with the UV image between frames.
+	create_image(renderer->dev->phdev, renderer->dev->dev,
+                ID_FORMAT, VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT,
+		width, height,
+		VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+                        | VK_IMAGE_USAGE_SAMPLED_BIT
+                        | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                0, &set->id);
+
+	alloc_image_memory(renderer, set->id, &set->id_mem);
+
+        create_image_view(renderer->dev->dev, ID_FORMAT, set->id,
+                VK_IMAGE_ASPECT_COLOR_BIT, &set->id_view);
+
+	// Create framebuffers
+        // This is for the intermediate pass - it doesn't include the
+        // final image
+        VkImageView intermediate_attachs[] = {
+                set->intermediate_view,
+                set->uv_view,
+                set->id_view,
+        };
+        VkFramebufferCreateInfo fb_info = {0};
+        fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        fb_info.attachmentCount =
+                sizeof(intermediate_attachs) / sizeof(intermediate_attachs[0]);
+        fb_info.pAttachments = intermediate_attachs;
+        fb_info.width = width;
+        fb_info.height = height;
+        fb_info.layers = 1u;
+        fb_info.renderPass = transients->render_setup->rpass;
+
+        res = vkCreateFramebuffer(dev, &fb_info, NULL, &set->framebuffer);
+        assert(res == VK_SUCCESS);
+
+        // This is for the blur passes
+        for (int i = 0; i < BLUR_PASSES; i++) {
+                VkFramebufferCreateInfo blur_fb_info = {0};
+                blur_fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+                blur_fb_info.width = width / (2 << i);
+                blur_fb_info.height = height / (2 << i);
+                if (blur_fb_info.width < 1) blur_fb_info.width = 1;
+                if (blur_fb_info.height < 1) blur_fb_info.height = 1;
+                blur_fb_info.layers = 1u;
+
+                blur_fb_info.attachmentCount = 1;
+                blur_fb_info.pAttachments = &set->blur_views[i];
+                blur_fb_info.renderPass = transients->render_setup->blur_rpass[i];
+
+                res = vkCreateFramebuffer(dev, &blur_fb_info, NULL,
+                        &set->blur_framebuffers[i]);
+                assert(res == VK_SUCCESS);
+        }
+
+        transient_set_create_descriptor_sets(renderer, set);
+}
+
+// Render buffers of the same size and format share their transient sets
+static struct wlr_vk_transients *get_transients(struct wlr_vk_renderer *renderer,
+                uint32_t width, uint32_t height, VkFormat format,
+                struct wlr_vk_render_format_setup *setup) {
+        struct wlr_vk_transients *transients;
+        wl_list_for_each(transients, &renderer->transients, link) {
+                if (transients->width == width && transients->height == height
+                                && transients->render_setup == setup) {
+                        transients->ref_count++;
+                        return transients;
+                }
+        }
+
+        transients = calloc(1, sizeof(*transients));
+        if (transients == NULL) {
+		wlr_log_errno(WLR_ERROR, "Allocation failed");
+                exit(1);
+        }
+        transients->width = width;
+        transients->height = height;
+        transients->render_setup = setup;
+        transients->ref_count = 1;
+
+        for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+                create_transient_set(renderer, transients, format, &transients->sets[i]);
+        }
+
+        // Readback ring for the pixel under the cursor
+	VkBufferCreateInfo readback_info = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = FRAMES_IN_FLIGHT * sizeof(struct wlr_vk_uv_readback),
+		.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+	};
+
+	VkResult res = vkCreateBuffer(renderer->dev->dev, &readback_info, NULL,
+                &transients->readback);
+	assert(res == VK_SUCCESS);
+
+	if (!vulkan_mem_alloc_buffer(&renderer->allocator, transients->readback,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+			| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+			| VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+			&transients->readback_mem)) {
+		wlr_log(WLR_ERROR, "Couldn't allocate UV readback memory");
+		exit(1);
+	}
+        // The memory might have been used for something else before, and
+        // frame has to start out as 0
+        transients->readbacks = transients->readback_mem.map;
+        memset(transients->readbacks, 0, readback_info.size);
+
+        wlr_log(WLR_DEBUG, "Created %d %ux%u transient sets", FRAMES_IN_FLIGHT,
+                width, height);
+        wl_list_insert(&renderer->transients, &transients->link);
+
+        return transients;
+}
+
+struct wlr_vk_transient_set *vulkan_transient_set(struct wlr_vk_renderer *renderer) {
+        assert(renderer->current_render_buffer != NULL);
+        struct wlr_vk_transients *transients = renderer->current_render_buffer->transients;
+        assert(transients != NULL);
+        return &transients->sets[renderer->frame_slot_idx];
+}
+
+int vulkan_transient_age(struct wlr_vk_renderer *renderer) {
+        struct wlr_vk_transients *transients = renderer->current_render_buffer->transients;
+        struct wlr_vk_transient_set *set = vulkan_transient_set(renderer);
+        if (set->drawn == 0) {
+                return 0;
+        }
+        return transients->frame_count - set->drawn + 1;
+}
+
+// buffer import
+static void destroy_render_buffer(struct wlr_vk_render_buffer *buffer) {
+	wl_list_remove(&buffer->link);
+	wl_list_remove(&buffer->buffer_destroy.link);
+
+	assert(buffer->renderer->current_render_buffer != buffer);
+
+        // The buffer's images might still be in use by a frame in flight
+        vulkan_wait_frame(buffer->renderer, buffer->frame);
+
+	VkDevice dev = buffer->renderer->dev->dev;
+
+        vkDestroyFramebuffer(dev, buffer->simple_framebuffer, NULL);
+        for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+                vkDestroyFramebuffer(dev, buffer->postprocess_framebuffers[i], NULL);
+        }
+
+	vkDestroyImageView(dev, buffer->screen_view, NULL);
+	vkDestroyImage(dev, buffer->screen, NULL);
+
+        if (buffer->transients != NULL) {
+                unref_transients(buffer->renderer, buffer->transients);
+        }
+
+	for (size_t i = 0u; i < buffer->mem_count; ++i) {
+		vkFreeMemory(dev, buffer->memories[i], NULL);
+	}
+
+	free(buffer);
+}
+
+static struct wlr_vk_render_buffer *get_render_buffer(
+		struct wlr_vk_renderer *renderer, struct wlr_buffer *wlr_buffer) {
+	struct wlr_vk_render_buffer *buffer;
+	wl_list_for_each(buffer, &renderer->render_buffers, link) {
+		if (buffer->wlr_buffer == wlr_buffer) {
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+static void handle_render_buffer_destroy(struct wl_listener *listener, void *data) {
+	struct wlr_vk_render_buffer *buffer =
+		wl_container_of(listener, buffer, buffer_destroy);
+	destroy_render_buffer(buffer);
 }
 
 // This gets called once for every swapchain image and once whenever the cursor
-// changes. Each cursor image gets its own render buffer.
+// changes. Each cursor image gets its own render buffer, so this only makes
+// what vulkan_begin and vulkan_end need. Anything render.c draws into also
+// gets transient sets, see vulkan_prepare_render_buffer.
 static struct wlr_vk_render_buffer *create_render_buffer(
 		struct wlr_vk_renderer *renderer, struct wlr_buffer *wlr_buffer) {
 	VkResult res;
@@ -508,170 +1238,62 @@ static struct wlr_vk_render_buffer *create_render_buffer(
 		renderer, fmt->format.vk_format);
         assert(buffer->render_setup != NULL);
 
-        // Create the intermediate image.
-        create_image(renderer->dev->phdev, renderer->dev->dev, fmt->format.vk_format,
-                VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT
-                        | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT,
-                dmabuf.width, dmabuf.height,
-                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
-                        | VK_IMAGE_USAGE_SAMPLED_BIT,
-                &buffer->intermediate);
-
-        VkMemoryRequirements mem_reqs;
-        vkGetImageMemoryRequirements(renderer->dev->dev, buffer->intermediate,
-                &mem_reqs);
-
-        alloc_memory(renderer, mem_reqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                &buffer->intermediate_mem);
-
-        res = vkBindImageMemory(renderer->dev->dev, buffer->intermediate,
-                buffer->intermediate_mem, 0);
-        assert(res == VK_SUCCESS);
-
-        create_image_view(renderer->dev->dev, fmt->format.vk_format,
-                buffer->intermediate, VK_IMAGE_ASPECT_COLOR_BIT,
-                &buffer->intermediate_view);
-
-        // Create the blur images
-        for (int i = 0; i < BLUR_PASSES; i++) {
-                int width = dmabuf.width / (2 << i);
-                int height = dmabuf.height / (2 << i);
-                if (width < 1) width = 1;
-                if (height < 1) height = 1;
-                create_image(renderer->dev->phdev, renderer->dev->dev, BLUR_FORMAT,
-                        VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT,
-                        width, height,
-                        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-                        &buffer->blurs[i]);
-
-                vkGetImageMemoryRequirements(renderer->dev->dev, buffer->blurs[i],
-                        &mem_reqs);
-
-                alloc_memory(renderer, mem_reqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                        &buffer->blur_mems[i]);
-
-                res = vkBindImageMemory(renderer->dev->dev, buffer->blurs[i],
-                        buffer->blur_mems[i], 0);
-                assert(res == VK_SUCCESS);
-
-                create_image_view(renderer->dev->dev, BLUR_FORMAT,
-                        buffer->blurs[i], VK_IMAGE_ASPECT_COLOR_BIT,
-                        &buffer->blur_views[i]);
-        }
-
-	// Create attachment to write UV coordinates into
-	create_image(renderer->dev->phdev, renderer->dev->dev,
-                UV_FORMAT, VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT,
-		dmabuf.width, dmabuf.height,
-		VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
-                        | VK_IMAGE_USAGE_SAMPLED_BIT
-                        | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
-                        | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-                &buffer->uv);
-
-	vkGetImageMemoryRequirements(renderer->dev->dev, buffer->uv, &mem_reqs);
-	alloc_memory(renderer, mem_reqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &buffer->uv_mem);
-
-	res = vkBindImageMemory(renderer->dev->dev, buffer->uv, buffer->uv_mem, 0);
-	assert(res == VK_SUCCESS);
-
-        create_image_view(renderer->dev->dev, UV_FORMAT, buffer->uv,
-                VK_IMAGE_ASPECT_COLOR_BIT, &buffer->uv_view);
-
-	// Create host-visible UV buffer
-	VkBufferCreateInfo host_uv_info = {
-		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-		.size = dmabuf.width * dmabuf.height * 12,
-		.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-	};
-
-	res = vkCreateBuffer(renderer->dev->dev, &host_uv_info, NULL, &buffer->host_uv);
-	assert(res == VK_SUCCESS);
-
-	vkGetBufferMemoryRequirements(renderer->dev->dev, buffer->host_uv, &mem_reqs);
-	alloc_memory(renderer, mem_reqs,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
-		| VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
-	        &buffer->host_uv_mem);
-
-	res = vkBindBufferMemory(renderer->dev->dev, buffer->host_uv, buffer->host_uv_mem, 0);
-	assert(res == VK_SUCCESS);
-
-	// Create framebuffers
-        // This is for the intermediate pass - it doesn't include the
-        // final image
-        VkImageView intermediate_attachs[] = {
-                buffer->intermediate_view,
-                buffer->uv_view,
-        };
+        // This is the for the simple rendering used in this file, which
+        // doesn't even have UV
         VkFramebufferCreateInfo fb_info = {0};
         fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        fb_info.attachmentCount =
-                sizeof(intermediate_attachs) / sizeof(intermediate_attachs[0]);
-        fb_info.pAttachments = intermediate_attachs;
+        fb_info.attachmentCount = 1;
+        fb_info.pAttachments = &buffer->screen_view;
         fb_info.width = dmabuf.width;
         fb_info.height = dmabuf.height;
         fb_info.layers = 1u;
-        fb_info.renderPass = buffer->render_setup->rpass;
-
-        res = vkCreateFramebuffer(dev, &fb_info, NULL, &buffer->framebuffer);
-        assert(res == VK_SUCCESS);
-
-        // This is the for the simple rendering used in this file, which
-        // doesn't even have UV
-        fb_info.attachmentCount = 1;
-        fb_info.pAttachments = &buffer->screen_view;
         fb_info.renderPass = buffer->render_setup->simple_rpass;
 
         res = vkCreateFramebuffer(dev, &fb_info, NULL,
                 &buffer->simple_framebuffer);
         assert(res == VK_SUCCESS);
 
-        // This is for the blur passes
-        for (int i = 0; i < BLUR_PASSES; i++) {
-                VkFramebufferCreateInfo blur_fb_info = {0};
-                blur_fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-                blur_fb_info.width = dmabuf.width / (2 << i);
-                blur_fb_info.height = dmabuf.height / (2 << i);
-                if (blur_fb_info.width < 1) blur_fb_info.width = 1;
-                if (blur_fb_info.height < 1) blur_fb_info.height = 1;
-                blur_fb_info.layers = 1u;
+	buffer->buffer_destroy.notify = handle_render_buffer_destroy;
+	wl_signal_add(&wlr_buffer->events.destroy, &buffer->buffer_destroy);
+	wl_list_insert(&renderer->render_buffers, &buffer->link);
 
-                blur_fb_info.attachmentCount = 1;
-                blur_fb_info.pAttachments = &buffer->blur_views[i];
-                blur_fb_info.renderPass = buffer->render_setup->blur_rpass[i];
+	return buffer;
+}
 
-                res = vkCreateFramebuffer(dev, &blur_fb_info, NULL,
-                        &buffer->blur_framebuffers[i]);
-                assert(res == VK_SUCCESS);
+void vulkan_prepare_render_buffer(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_render_buffer *buffer) {
+        if (buffer->transients != NULL) {
+                return;
         }
 
+        uint32_t width = buffer->wlr_buffer->width, height = buffer->wlr_buffer->height;
+        buffer->transients = get_transients(renderer, width, height,
+                buffer->render_setup->render_format, buffer->render_setup);
+
         // This is for the postprocess pass - does include the final
         // image and is created with a different render pass.
-        VkImageView postprocess_attachs[] = {
-                buffer->intermediate_view,
-                buffer->uv_view,
-                buffer->screen_view,
-        };
-
-        fb_info.attachmentCount =
-                sizeof(postprocess_attachs) / sizeof(postprocess_attachs[0]);
-        fb_info.pAttachments = postprocess_attachs;
-        fb_info.renderPass = buffer->render_setup->postprocess_rpass;
-
-        res = vkCreateFramebuffer(dev, &fb_info, NULL,
-                &buffer->postprocess_framebuffer);
-        assert(res == VK_SUCCESS);
-
-	buffer->buffer_destroy.notify = handle_render_buffer_destroy;
-	wl_signal_add(&wlr_buffer->events.destroy, &buffer->buffer_destroy);
-	wl_list_insert(&renderer->render_buffers, &buffer->link);
-
-        render_buffer_create_descriptor_sets(renderer, buffer);
-
-	return buffer;
+        for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+                struct wlr_vk_transient_set *set = &buffer->transients->sets[i];
+                VkImageView postprocess_attachs[] = {
+                        set->intermediate_view,
+                        set->uv_view,
+                        buffer->screen_view,
+                };
+
+                VkFramebufferCreateInfo fb_info = {0};
+                fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+                fb_info.attachmentCount =
+                        sizeof(postprocess_attachs) / sizeof(postprocess_attachs[0]);
+                fb_info.pAttachments = postprocess_attachs;
+                fb_info.width = width;
+                fb_info.height = height;
+                fb_info.layers = 1u;
+                fb_info.renderPass = buffer->render_setup->postprocess_rpass;
+
+                VkResult res = vkCreateFramebuffer(renderer->dev->dev, &fb_info, NULL,
+                        &buffer->postprocess_framebuffers[i]);
+                assert(res == VK_SUCCESS);
+        }
 }
 
 // Interface implementation
@@ -712,8 +1334,11 @@ static void vulkan_begin(struct wlr_renderer *wlr_renderer, uint32_t width, uint
 	renderer->render_height = height;
 	renderer->bound_pipe = VK_NULL_HANDLE;
 
+        // Only the cursor comes through here
+        vulkan_prepare_render_setup(renderer, render_buf->render_setup, WLR_VK_USAGE_SIMPLE);
+
+        vulkan_begin_frame(renderer);
         VkCommandBuffer cbuf = renderer->cb;
-        cbuf_begin_onetime(cbuf);
 
         VkRect2D rect = {{0, 0}, {width, height}};
         renderer->scissor = rect;
@@ -725,37 +1350,21 @@ static void vulkan_begin(struct wlr_renderer *wlr_renderer, uint32_t width, uint
 static void vulkan_end(struct wlr_renderer *wlr_renderer) {
 	struct wlr_vk_renderer *renderer = vulkan_get_renderer(wlr_renderer);
 	assert(renderer->current_render_buffer);
-        struct wlr_vk_render_buffer *render_buf = renderer->current_render_buffer;
         VkCommandBuffer cbuf = renderer->cb;
 
         vkCmdEndRenderPass(cbuf);
 
         // Submit
         double start_time = get_time();
-        cbuf_submit_wait(renderer->dev->queue, cbuf);
+        if (!vulkan_submit_frame(renderer)) {
+                wlr_log(WLR_ERROR, "Couldn't submit cursor frame");
+        }
         double elapsed = (get_time() - start_time) * 1000;
-        printf("Cursor submit took %5.2f ms\n", elapsed);
+        wlr_log(WLR_DEBUG, "Cursor submit took %5.2f ms", elapsed);
 
 	renderer->bound_pipe = VK_NULL_HANDLE;
         renderer->render_width = 0u;
         renderer->render_height = 0u;
-
-        // Destroy pending textures
-        struct wlr_vk_texture *texture, *tmp_tex;
-        wl_list_for_each_safe(texture, tmp_tex, &renderer->destroy_textures, destroy_link) {
-                printf("Destroy texture %p\n", texture);
-                wlr_texture_destroy(&texture->wlr_texture);
-        }
-
-        // This marks it as the most recent I think
-        renderer->frame++;
-        render_buf->frame = renderer->frame;
-
-        // "release stage allocations", not sure what it really does
-	struct wlr_vk_shared_buffer *buf;
-	wl_list_for_each(buf, &renderer->stage.buffers, link) {
-		buf->allocs_size = 0u;
-	}
 }
 
 // This only gets used by the cursor I think. I use the function with the same
@@ -934,7 +1543,17 @@ static void vulkan_destroy(struct wlr_renderer *wlr_renderer) {
 
 	assert(!renderer->current_render_buffer);
 
-	// stage.cb automatically freed with command pool
+        // Nothing can be destroyed while frames are still in flight
+        vkDeviceWaitIdle(dev->dev);
+        for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+                if (renderer->frame_slots[i].pending) {
+                        retire_frame_slot(renderer, &renderer->frame_slots[i]);
+                }
+        }
+        // Including anything recorded but never submitted
+        renderer->completed_frame = UINT32_MAX;
+
+	// Stage command buffers are freed with the frame slots' command pools
 	struct wlr_vk_shared_buffer *buf, *tmp_buf;
 	wl_list_for_each_safe(buf, tmp_buf, &renderer->stage.buffers, link) {
 		shared_buffer_destroy(renderer, buf);
@@ -945,6 +1564,11 @@ static void vulkan_destroy(struct wlr_renderer *wlr_renderer) {
 		vulkan_texture_destroy(tex);
 	}
 
+	wl_list_for_each_safe(tex, tex_tmp, &renderer->destroy_textures, destroy_link) {
+                wl_list_remove(&tex->destroy_link);
+		vulkan_texture_destroy(tex);
+	}
+
 	struct wlr_vk_render_buffer *render_buffer, *render_buffer_tmp;
 	wl_list_for_each_safe(render_buffer, render_buffer_tmp,
 			&renderer->render_buffers, link) {
@@ -966,19 +1590,42 @@ static void vulkan_destroy(struct wlr_renderer *wlr_renderer) {
 	vkDestroyShaderModule(dev->dev, renderer->vert_module, NULL);
 	vkDestroyShaderModule(dev->dev, renderer->tex_vert_module, NULL);
 	vkDestroyShaderModule(dev->dev, renderer->tex_frag_module, NULL);
+	vkDestroyShaderModule(dev->dev, renderer->id_frag_module, NULL);
 	vkDestroyShaderModule(dev->dev, renderer->simple_tex_frag_module, NULL);
 	vkDestroyShaderModule(dev->dev, renderer->quad_frag_module, NULL);
 	vkDestroyShaderModule(dev->dev, renderer->blur_frag_module, NULL);
+	vkDestroyShaderModule(dev->dev, renderer->blur_comp_module, NULL);
 	vkDestroyShaderModule(dev->dev, renderer->postprocess_vert_module, NULL);
 	vkDestroyShaderModule(dev->dev, renderer->postprocess_frag_module, NULL);
 
 	vkDestroyFence(dev->dev, renderer->fence, NULL);
+        vkDestroySemaphore(dev->dev, renderer->graphics_timeline, NULL);
+        vkDestroySemaphore(dev->dev, renderer->transfer_timeline, NULL);
+        vkDestroySemaphore(dev->dev, renderer->readback_semaphores[0], NULL);
+        vkDestroySemaphore(dev->dev, renderer->readback_semaphores[1], NULL);
+        for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+                struct wlr_vk_frame_slot *slot = &renderer->frame_slots[i];
+                // Command buffers are freed with the command pools
+                vkDestroyCommandPool(dev->dev, slot->transient.pool, NULL);
+                free(slot->transient.cbs);
+                vkDestroyCommandPool(dev->dev, slot->transfer.pool, NULL);
+                free(slot->transfer.cbs);
+                vkDestroyFence(dev->dev, slot->fence, NULL);
+                vkDestroySemaphore(dev->dev, slot->semaphore, NULL);
+        }
+        gpu_profiler_finish();
+        // Everything with memory has been destroyed by now
+        vulkan_allocator_finish(&renderer->allocator);
+        // Everything's been compiled by now
+        vulkan_save_pipeline_cache(dev->dev, dev->phdev, renderer->pipeline_cache);
+        vkDestroyPipelineCache(dev->dev, renderer->pipeline_cache, NULL);
+
+	vkDestroyPipeline(dev->dev, renderer->blur_compute_pipe, NULL);
+	vkDestroyPipelineLayout(dev->dev, renderer->compute_pipe_layout, NULL);
+	vkDestroyDescriptorSetLayout(dev->dev, renderer->storage_desc_layout, NULL);
 	vkDestroyPipelineLayout(dev->dev, renderer->pipe_layout, NULL);
 	vkDestroyDescriptorSetLayout(dev->dev, renderer->tex_desc_layout, NULL);
 	vkDestroySampler(dev->dev, renderer->sampler, NULL);
-	vkDestroyCommandPool(dev->dev, renderer->command_pool, NULL);
-
-        vkDestroyQueryPool(dev->dev, renderer->query_pool, NULL);
 
 	struct wlr_vk_instance *ini = dev->instance;
 	vulkan_device_destroy(dev);
@@ -1046,57 +1693,91 @@ static bool vulkan_read_pixels(struct wlr_renderer *wlr_renderer,
 	}
         printf("vulkan_read_pixels: dst_image at %p\n", dst_image);
 
-	VkMemoryRequirements mem_reqs;
-	vkGetImageMemoryRequirements(dev, dst_image, &mem_reqs);
-
-	int mem_type = vulkan_find_mem_type(vk_renderer->dev,
+	struct vulkan_mem_alloc dst_img_memory;
+	if (!vulkan_mem_alloc_image(&vk_renderer->allocator, dst_image, VULKAN_MEM_LINEAR,
 			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
 			VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
-			mem_reqs.memoryTypeBits);
-	if (mem_type < 0) {
-		wlr_log(WLR_ERROR, "vulkan_read_pixels: could not find adequate memory type");
-		goto destroy_image;
-	}
-
-	VkMemoryAllocateInfo mem_alloc_info = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-	};
-	mem_alloc_info.allocationSize = mem_reqs.size;
-	mem_alloc_info.memoryTypeIndex = mem_type;
-
-	VkDeviceMemory dst_img_memory;
-	res = vkAllocateMemory(dev, &mem_alloc_info, NULL, &dst_img_memory);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkAllocateMemory", res);
+			&dst_img_memory)) {
+		wlr_log(WLR_ERROR, "vulkan_read_pixels: could not allocate memory");
 		goto destroy_image;
 	}
-	res = vkBindImageMemory(dev, dst_image, dst_img_memory, 0);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkBindImageMemory", res);
-		goto free_memory;
-	}
 
-	VkCommandBuffer cb = vk_renderer->stage.cb;
-        cbuf_begin_onetime(cb);
+        // The copy can run on the transfer queue, but blits (format
+        // conversion) need a graphics queue
+        bool on_transfer_queue = vk_renderer->dev->has_transfer_queue
+                && src_format == dst_format;
+        uint32_t graphics_family = vk_renderer->dev->queue_family;
+        uint32_t transfer_family = vk_renderer->dev->transfer_queue_family;
+        // The transfer queue can be a second queue of the graphics family.
+        // Then there's nothing to hand over, the semaphores alone order the
+        // submissions and the transfer side does the layout transitions.
+        bool change_family = graphics_family != transfer_family;
+        VkCommandBuffer cb;
+
+        if (on_transfer_queue) {
+                // Hand the render buffer over to the transfer queue once the
+                // frame that drew into it is done
+                VkCommandBuffer release_cb = begin_transient_cb(vk_renderer);
+                if (change_family) {
+                        vulkan_image_ownership_cbuf(release_cb,
+                                src_image, VK_IMAGE_ASPECT_COLOR_BIT,
+                                VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                graphics_family, transfer_family,
+                                VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, 0,
+                                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+                }
+                res = vkEndCommandBuffer(release_cb);
+                if (res != VK_SUCCESS) {
+                        wlr_vk_error("vkEndCommandBuffer", res);
+                        goto free_memory;
+                }
+                if (!queue_submit(vk_renderer, vk_renderer->dev->queue, 1, &release_cb,
+                                0, NULL, NULL, NULL,
+                                1, &vk_renderer->readback_semaphores[0], NULL, VK_NULL_HANDLE)) {
+                        goto free_memory;
+                }
+
+                cb = begin_transfer_cb(vk_renderer);
+                if (change_family) {
+                        vulkan_image_ownership_cbuf(cb,
+                                src_image, VK_IMAGE_ASPECT_COLOR_BIT,
+                                VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                graphics_family, transfer_family,
+                                0, VK_ACCESS_TRANSFER_READ_BIT,
+                                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+                } else {
+                        // Has to come after the semaphore wait, which is at
+                        // the transfer stage
+                        vulkan_image_transition_cbuf(cb,
+                                src_image, VK_IMAGE_ASPECT_COLOR_BIT,
+                                VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                0, VK_ACCESS_TRANSFER_READ_BIT,
+                                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                1);
+                }
+        } else {
+                cb = begin_transient_cb(vk_renderer);
+
+                // The frame that drew into the render buffer is submitted but
+                // probably not done yet, so wait for its color writes
+                vulkan_image_transition_cbuf(cb,
+                        src_image, VK_IMAGE_ASPECT_COLOR_BIT,
+                        VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+                        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        1);
+        }
 
-        vulkan_image_transition(vk_renderer->dev->dev, vk_renderer->dev->queue,
-                vk_renderer->command_pool,
+        vulkan_image_transition_cbuf(cb,
                 dst_image, VK_IMAGE_ASPECT_COLOR_BIT,
                 VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                 VK_ACCESS_NONE, VK_ACCESS_TRANSFER_WRITE_BIT,
-                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                1);
-
-        vulkan_image_transition(vk_renderer->dev->dev, vk_renderer->dev->queue,
-                vk_renderer->command_pool,
-                src_image, VK_IMAGE_ASPECT_COLOR_BIT,
-                VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                VK_ACCESS_MEMORY_READ_BIT, VK_ACCESS_TRANSFER_READ_BIT,
-                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
                 1);
 
-	if (blit_supported) {
+	if (blit_supported && !on_transfer_queue) {
 		VkOffset3D blit_size = {
 			.x = width,
 			.y = height,
@@ -1118,7 +1799,9 @@ static bool vulkan_read_pixels(struct wlr_renderer *wlr_renderer,
 				dst_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 				1, &image_blit_region, VK_FILTER_NEAREST);
 	} else {
-		wlr_log(WLR_DEBUG, "vulkan_read_pixels: blit unsupported, falling back to vkCmdCopyImage.");
+		if (!on_transfer_queue) {
+			wlr_log(WLR_DEBUG, "vulkan_read_pixels: blit unsupported, falling back to vkCmdCopyImage.");
+		}
 		VkImageCopy image_region = {
 			.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
 			.srcSubresource.layerCount = 1,
@@ -1138,22 +1821,77 @@ static bool vulkan_read_pixels(struct wlr_renderer *wlr_renderer,
 				dst_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &image_region);
 	}
 
-        vulkan_image_transition(vk_renderer->dev->dev, vk_renderer->dev->queue,
-                vk_renderer->command_pool,
+        // Makes the copy visible to the host once the fence has signalled
+        vulkan_image_transition_cbuf(cb,
                 dst_image, VK_IMAGE_ASPECT_COLOR_BIT,
                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
-                VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_NONE,
-                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                1);
-        vulkan_image_transition(vk_renderer->dev->dev, vk_renderer->dev->queue,
-                vk_renderer->command_pool,
-                src_image, VK_IMAGE_ASPECT_COLOR_BIT,
-                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
-                VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_MEMORY_READ_BIT,
-                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
                 1);
 
-        cbuf_submit_wait(vk_renderer->dev->queue, cb);
+        if (on_transfer_queue) {
+                // And give it back to the graphics queue
+                if (change_family) {
+                        vulkan_image_ownership_cbuf(cb,
+                                src_image, VK_IMAGE_ASPECT_COLOR_BIT,
+                                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
+                                transfer_family, graphics_family,
+                                VK_ACCESS_TRANSFER_READ_BIT, 0,
+                                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+                } else {
+                        vulkan_image_transition_cbuf(cb,
+                                src_image, VK_IMAGE_ASPECT_COLOR_BIT,
+                                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
+                                VK_ACCESS_TRANSFER_READ_BIT, 0,
+                                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                1);
+                }
+                res = vkEndCommandBuffer(cb);
+                if (res != VK_SUCCESS) {
+                        wlr_vk_error("vkEndCommandBuffer", res);
+                        goto free_memory;
+                }
+                VkPipelineStageFlags copy_wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+                if (!queue_submit(vk_renderer, vk_renderer->dev->transfer_queue, 1, &cb,
+                                1, &vk_renderer->readback_semaphores[0], NULL, &copy_wait_stage,
+                                1, &vk_renderer->readback_semaphores[1], NULL, VK_NULL_HANDLE)) {
+                        goto free_memory;
+                }
+
+                VkCommandBuffer acquire_cb = begin_transient_cb(vk_renderer);
+                if (change_family) {
+                        vulkan_image_ownership_cbuf(acquire_cb,
+                                src_image, VK_IMAGE_ASPECT_COLOR_BIT,
+                                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
+                                transfer_family, graphics_family,
+                                0, VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+                }
+                res = vkEndCommandBuffer(acquire_cb);
+                if (res != VK_SUCCESS) {
+                        wlr_vk_error("vkEndCommandBuffer", res);
+                        goto free_memory;
+                }
+                VkPipelineStageFlags acquire_wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+                if (!queue_submit(vk_renderer, vk_renderer->dev->queue, 1, &acquire_cb,
+                                1, &vk_renderer->readback_semaphores[1], NULL, &acquire_wait_stage,
+                                0, NULL, NULL, vk_renderer->fence)
+                                || !wait_renderer_fence(vk_renderer)) {
+                        goto free_memory;
+                }
+        } else {
+                vulkan_image_transition_cbuf(cb,
+                        src_image, VK_IMAGE_ASPECT_COLOR_BIT,
+                        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
+                        VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_MEMORY_READ_BIT,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        1);
+
+                if (!submit_transient_cb(vk_renderer, cb, true)) {
+                        goto free_memory;
+                }
+        }
 
 	VkImageSubresource img_sub_res = {
 		.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
@@ -1163,12 +1901,8 @@ static bool vulkan_read_pixels(struct wlr_renderer *wlr_renderer,
 	VkSubresourceLayout img_sub_layout;
 	vkGetImageSubresourceLayout(dev, dst_image, &img_sub_res, &img_sub_layout);
 
-	const char *d;
-	res = vkMapMemory(dev, dst_img_memory, 0, VK_WHOLE_SIZE, 0, (void **)&d);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkMapMemory", res);
-		goto free_memory;
-	}
+	// Mapped for as long as the allocation exists
+	const char *d = dst_img_memory.map;
 	d += img_sub_layout.offset;
 
 	unsigned char *p = (unsigned char *)data + dst_y * stride;
@@ -1184,9 +1918,8 @@ static bool vulkan_read_pixels(struct wlr_renderer *wlr_renderer,
 	}
 
 	success = true;
-	vkUnmapMemory(dev, dst_img_memory);
 free_memory:
-	vkFreeMemory(dev, dst_img_memory, NULL);
+	vulkan_mem_free(&vk_renderer->allocator, &dst_img_memory);
 destroy_image:
 	vkDestroyImage(dev, dst_image, NULL);
 
@@ -1229,7 +1962,8 @@ void create_tex_desc_layout(VkDevice device, VkSampler tex_sampler,
                 .binding = 0,
                 .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
                 .descriptorCount = 1,
-                .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+                // blur.comp reads through these too
+                .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
                 .pImmutableSamplers = &tex_sampler,
         };
 
@@ -1243,6 +1977,25 @@ void create_tex_desc_layout(VkDevice device, VkSampler tex_sampler,
 	assert(res == VK_SUCCESS);
 }
 
+// Descriptor layout for an image blur.comp writes to
+void create_storage_desc_layout(VkDevice device, VkDescriptorSetLayout *layout) {
+	VkDescriptorSetLayoutBinding binding = {
+                .binding = 0,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                .descriptorCount = 1,
+                .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        };
+
+	VkDescriptorSetLayoutCreateInfo layout_info = {
+                .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+                .bindingCount = 1,
+                .pBindings = &binding,
+        };
+
+	VkResult res = vkCreateDescriptorSetLayout(device, &layout_info, NULL, layout);
+	assert(res == VK_SUCCESS);
+}
+
 // Creates static render data, such as sampler, layouts and shader modules
 // for the given rednerer.
 // Cleanup is done by destroying the renderer.
@@ -1308,6 +2061,12 @@ void init_static_render_data(struct wlr_vk_renderer *renderer) {
 	res = vkCreateShaderModule(dev, &sinfo, NULL, &renderer->tex_frag_module);
         assert(res == VK_SUCCESS);
 
+	// id frag
+	sinfo.codeSize = sizeof(id_frag_data);
+	sinfo.pCode = id_frag_data;
+	res = vkCreateShaderModule(dev, &sinfo, NULL, &renderer->id_frag_module);
+        assert(res == VK_SUCCESS);
+
 	// quad frag
 	sinfo.codeSize = sizeof(quad_frag_data);
 	sinfo.pCode = quad_frag_data;
@@ -1331,6 +2090,141 @@ void init_static_render_data(struct wlr_vk_renderer *renderer) {
 	sinfo.pCode = postprocess_frag_data;
 	res = vkCreateShaderModule(dev, &sinfo, NULL, &renderer->postprocess_frag_module);
         assert(res == VK_SUCCESS);
+
+        // Compute blur. Doesn't depend on the render format since the blur
+        // images always use BLUR_FORMAT, so there's only one pipeline.
+        VkFormatProperties storage_props;
+        vkGetPhysicalDeviceFormatProperties(renderer->dev->phdev, BLUR_STORAGE_FORMAT,
+                &storage_props);
+        renderer->compute_blur_supported = storage_props.optimalTilingFeatures
+                & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT;
+        renderer->compute_blur = renderer->compute_blur_supported;
+        if (!renderer->compute_blur_supported) {
+                wlr_log(WLR_INFO, "No storage image support, blur will use render passes");
+                return;
+        }
+
+        create_storage_desc_layout(dev, &renderer->storage_desc_layout);
+
+        // Reads one texture, writes another
+        VkDescriptorSetLayout compute_desc_layouts[] =
+                {renderer->tex_desc_layout, renderer->storage_desc_layout};
+        create_compute_pipeline_layout(dev,
+                sizeof(compute_desc_layouts) / sizeof(compute_desc_layouts[0]),
+                compute_desc_layouts, sizeof(struct BlurComputePushConstants),
+                &renderer->compute_pipe_layout);
+
+	// blur comp
+	sinfo.codeSize = sizeof(blur_comp_data);
+	sinfo.pCode = blur_comp_data;
+	res = vkCreateShaderModule(dev, &sinfo, NULL, &renderer->blur_comp_module);
+        assert(res == VK_SUCCESS);
+
+        create_compute_pipeline(dev, renderer->pipeline_cache, renderer->blur_comp_module,
+                renderer->compute_pipe_layout, &renderer->blur_compute_pipe);
+}
+
+struct pipeline_job {
+        VkShaderModule vert_module, frag_module;
+        VkRenderPass rpass;
+        int output_attach_count;
+        uint32_t write_mask;
+        VkPipeline *pipe;
+};
+
+struct pipeline_worker {
+        struct wlr_vk_renderer *renderer;
+        struct pipeline_job *jobs;
+        int job_count;
+};
+
+static void run_pipeline_jobs(struct wlr_vk_renderer *renderer,
+                struct pipeline_job *jobs, int job_count) {
+        for (int i = 0; i < job_count; i++) {
+                create_pipeline(renderer->dev->dev, renderer->pipeline_cache,
+                        jobs[i].vert_module, jobs[i].frag_module,
+                        jobs[i].rpass, jobs[i].output_attach_count, jobs[i].write_mask,
+                        renderer->pipe_layout, jobs[i].pipe);
+        }
+}
+
+static void *pipeline_worker_run(void *data) {
+        struct pipeline_worker *worker = data;
+        run_pipeline_jobs(worker->renderer, worker->jobs, worker->job_count);
+        return NULL;
+}
+
+// Creates the pipelines for usage if they don't exist yet. The full set is
+// split in two: the blur and postprocess pipelines compile on a worker thread
+// while we do the rest here. vkCreateGraphicsPipelines is fine with that as
+// long as the pipelines are different, and the pipeline cache does its own
+// locking.
+void vulkan_prepare_render_setup(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_render_format_setup *setup, enum wlr_vk_render_usage usage) {
+        if ((setup->usages & usage) == usage) {
+                return;
+        }
+
+        double start_time = get_time();
+
+        if (usage & WLR_VK_USAGE_SIMPLE && !(setup->usages & WLR_VK_USAGE_SIMPLE)) {
+                struct pipeline_job job = {
+                        renderer->vert_module, renderer->simple_tex_frag_module,
+                        setup->simple_rpass, 1, WRITE_COLOR, &setup->simple_tex_pipe
+                };
+                run_pipeline_jobs(renderer, &job, 1);
+                setup->usages |= WLR_VK_USAGE_SIMPLE;
+        }
+
+        if (usage & WLR_VK_USAGE_FULL && !(setup->usages & WLR_VK_USAGE_FULL)) {
+                // UV and ID only get written by id_pipe
+                struct pipeline_job main_jobs[] = {
+                        {renderer->tex_vert_module, renderer->tex_frag_module,
+                                setup->rpass, 3, WRITE_COLOR, &setup->tex_pipe},
+                        {renderer->tex_vert_module, renderer->id_frag_module,
+                                setup->rpass, 3, WRITE_UV | WRITE_ID, &setup->id_pipe},
+                        {renderer->vert_module, renderer->quad_frag_module,
+                                setup->rpass, 3, WRITE_COLOR, &setup->quad_pipe},
+                };
+
+                // We can use the postprocess vert shader because it does
+                // exactly what we want it to: outputs a fullscreen quad.
+                struct pipeline_job worker_jobs[BLUR_PASSES + 1];
+                for (int i = 0; i < BLUR_PASSES; i++) {
+                        worker_jobs[i] = (struct pipeline_job) {
+                                renderer->tex_vert_module, renderer->blur_frag_module,
+                                setup->blur_rpass[i], 1 /* Only one output attachment */,
+                                WRITE_COLOR, &setup->blur_pipes[i]
+                        };
+                }
+                worker_jobs[BLUR_PASSES] = (struct pipeline_job) {
+                        renderer->postprocess_vert_module, renderer->postprocess_frag_module,
+                        setup->postprocess_rpass, 1, WRITE_COLOR, &setup->postprocess_pipe
+                };
+
+                struct pipeline_worker worker = {
+                        renderer, worker_jobs, sizeof(worker_jobs) / sizeof(worker_jobs[0])
+                };
+                pthread_t thread;
+                bool threaded = pthread_create(&thread, NULL, pipeline_worker_run, &worker) == 0;
+                if (!threaded) {
+                        wlr_log(WLR_ERROR, "Couldn't start pipeline worker, "
+                                "compiling everything here");
+                        pipeline_worker_run(&worker);
+                }
+
+                run_pipeline_jobs(renderer, main_jobs, sizeof(main_jobs) / sizeof(main_jobs[0]));
+
+                if (threaded) {
+                        pthread_join(thread, NULL);
+                }
+                setup->usages |= WLR_VK_USAGE_FULL;
+        }
+
+        wlr_log(WLR_INFO, "Created %s pipelines for format %d in %5.3f ms (%s pipeline cache)",
+                usage & WLR_VK_USAGE_FULL ? "full" : "simple", setup->render_format,
+                (get_time() - start_time) * 1000,
+                renderer->pipeline_cache_warm ? "warm" : "cold");
 }
 
 static struct wlr_vk_render_format_setup *find_or_create_render_setup(
@@ -1351,14 +2245,21 @@ static struct wlr_vk_render_format_setup *find_or_create_render_setup(
 
 	setup->render_format = format;
 
+        // To compare cold and warm pipeline caches
+        double start_time = get_time();
+
         create_render_pass(renderer->dev->dev, format, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-                false, &setup->rpass);
+                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, false, &setup->rpass);
         create_render_pass(renderer->dev->dev, format, VK_IMAGE_LAYOUT_UNDEFINED,
-                true, &setup->rpass_clear);
+                VK_IMAGE_LAYOUT_UNDEFINED, true, &setup->rpass_clear);
         create_render_pass(renderer->dev->dev, format, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-                false, &setup->quad_rpass);
+                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, false, &setup->quad_rpass);
         create_render_pass(renderer->dev->dev, format, VK_IMAGE_LAYOUT_UNDEFINED,
-                true, &setup->quad_clear_rpass);
+                VK_IMAGE_LAYOUT_UNDEFINED, true, &setup->quad_clear_rpass);
+        // Both images are left in SHADER_READ_ONLY by the previous frame's
+        // postprocess pass
+        create_render_pass(renderer->dev->dev, format, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, true, &setup->quad_damage_rpass);
 
         create_postprocess_render_pass(renderer->dev->dev, format, &setup->postprocess_rpass);
         for (int i = 0; i < BLUR_PASSES; i++) {
@@ -1366,31 +2267,11 @@ static struct wlr_vk_render_format_setup *find_or_create_render_setup(
         }
         create_simple_render_pass(renderer->dev->dev, format, &setup->simple_rpass);
 
-        // Create pipelines
-        // We can use the postprocess vert shader because it does exactly what
-        // we want it to: outputs a fullscreen quad.
-        create_pipeline(renderer->dev->dev,
-                renderer->tex_vert_module, renderer->tex_frag_module,
-                setup->rpass, 2, renderer->pipe_layout, &setup->tex_pipe);
-
-        create_pipeline(renderer->dev->dev,
-                renderer->vert_module, renderer->simple_tex_frag_module,
-                setup->simple_rpass, 1, renderer->pipe_layout, &setup->simple_tex_pipe);
-
-        create_pipeline(renderer->dev->dev,
-                renderer->vert_module, renderer->quad_frag_module,
-                setup->rpass, 2, renderer->pipe_layout, &setup->quad_pipe);
-
-        for (int i = 0; i < BLUR_PASSES; i++) {
-                create_pipeline(renderer->dev->dev,
-                        renderer->tex_vert_module, renderer->blur_frag_module,
-                        setup->blur_rpass[i], 1 /* Only one output attachment */,
-                        renderer->pipe_layout, &setup->blur_pipes[i]);
-        }
+        wlr_log(WLR_INFO, "Created render passes for format %d in %5.3f ms", format,
+                (get_time() - start_time) * 1000);
 
-        create_pipeline(renderer->dev->dev,
-                renderer->postprocess_vert_module, renderer->postprocess_frag_module,
-                setup->postprocess_rpass, 1, renderer->pipe_layout, &setup->postprocess_pipe);
+        // Pipelines are made by vulkan_prepare_render_setup once we know
+        // what the buffer is used for
 
 	wl_list_insert(&renderer->render_format_setups, &setup->link);
 	return setup;
@@ -1399,6 +2280,75 @@ static struct wlr_vk_render_format_setup *find_or_create_render_setup(
 	return NULL;
 }
 
+static bool create_arena_pool(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_cb_arena *arena, uint32_t queue_family) {
+	// No RESET_COMMAND_BUFFER_BIT, the whole pool is reset once the slot's
+	// frame is done.
+	VkCommandPoolCreateInfo cpool_info = {0};
+	cpool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	cpool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	cpool_info.queueFamilyIndex = queue_family;
+	VkResult res = vkCreateCommandPool(renderer->dev->dev, &cpool_info, NULL, &arena->pool);
+	if (res != VK_SUCCESS) {
+		wlr_vk_error("vkCreateCommandPool", res);
+		return false;
+	}
+
+        return true;
+}
+
+static bool init_frame_slot(struct wlr_vk_renderer *renderer,
+                struct wlr_vk_frame_slot *slot) {
+        VkDevice dev = renderer->dev->dev;
+        VkResult res;
+
+	// command pools
+        if (!create_arena_pool(renderer, &slot->transient, renderer->dev->queue_family)) {
+                return false;
+        }
+        if (renderer->dev->has_transfer_queue && !create_arena_pool(renderer,
+                        &slot->transfer, renderer->dev->transfer_queue_family)) {
+                return false;
+        }
+
+	VkCommandBufferAllocateInfo cbuf_alloc_info = {0};
+	cbuf_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	cbuf_alloc_info.commandBufferCount = 1u;
+	cbuf_alloc_info.commandPool = slot->transient.pool;
+	cbuf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	res = vkAllocateCommandBuffers(dev, &cbuf_alloc_info, &slot->cb);
+	if (res != VK_SUCCESS) {
+		wlr_vk_error("vkAllocateCommandBuffers", res);
+		return false;
+	}
+
+	VkFenceCreateInfo fence_info = {0};
+	fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	res = vkCreateFence(dev, &fence_info, NULL, &slot->fence);
+	if (res != VK_SUCCESS) {
+		wlr_vk_error("vkCreateFence", res);
+		return false;
+	}
+
+        if (renderer->dev->implicit_sync_interop) {
+                VkExportSemaphoreCreateInfo export_info = {
+                        .sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO,
+                        .handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+                };
+                VkSemaphoreCreateInfo sem_info = {
+                        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                        .pNext = &export_info,
+                };
+                res = vkCreateSemaphore(dev, &sem_info, NULL, &slot->semaphore);
+                if (res != VK_SUCCESS) {
+                        wlr_vk_error("vkCreateSemaphore", res);
+                        return false;
+                }
+        }
+
+        return true;
+}
+
 struct wlr_renderer *vulkan_renderer_create_for_device(struct wlr_vk_device *dev) {
 	struct wlr_vk_renderer *renderer;
 	VkResult res;
@@ -1408,6 +2358,7 @@ struct wlr_renderer *vulkan_renderer_create_for_device(struct wlr_vk_device *dev
 	}
 
 	renderer->dev = dev;
+        renderer->layered_blur = true;
 	wlr_renderer_init(&renderer->wlr_renderer, &renderer_impl);
 	wl_list_init(&renderer->stage.buffers);
 	wl_list_init(&renderer->destroy_textures);
@@ -1416,31 +2367,30 @@ struct wlr_renderer *vulkan_renderer_create_for_device(struct wlr_vk_device *dev
 	wl_list_init(&renderer->descriptor_pools);
 	wl_list_init(&renderer->render_format_setups);
 	wl_list_init(&renderer->render_buffers);
+	wl_list_init(&renderer->transients);
+        vulkan_allocator_init(&renderer->allocator, dev->dev, &dev->mem_props,
+                dev->buffer_image_granularity);
 
-	init_static_render_data(renderer);
+        double start_time = get_time();
+        renderer->pipeline_cache = vulkan_load_pipeline_cache(dev->dev, dev->phdev,
+                &renderer->pipeline_cache_warm);
 
-	// command pool
-	VkCommandPoolCreateInfo cpool_info = {0};
-	cpool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	cpool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-	cpool_info.queueFamilyIndex = dev->queue_family;
-	res = vkCreateCommandPool(dev->dev, &cpool_info, NULL,
-		&renderer->command_pool);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkCreateCommandPool", res);
-		goto error;
+	init_static_render_data(renderer);
+        wlr_log(WLR_INFO, "Static render data created in %5.3f ms (%s pipeline cache)",
+                (get_time() - start_time) * 1000,
+                renderer->pipeline_cache_warm ? "warm" : "cold");
+
+	// frame slots
+	for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+		if (!init_frame_slot(renderer, &renderer->frame_slots[i])) {
+			goto error;
+		}
 	}
 
-	VkCommandBufferAllocateInfo cbuf_alloc_info = {0};
-	cbuf_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	cbuf_alloc_info.commandBufferCount = 1u;
-	cbuf_alloc_info.commandPool = renderer->command_pool;
-	cbuf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	res = vkAllocateCommandBuffers(dev->dev, &cbuf_alloc_info, &renderer->cb);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkAllocateCommandBuffers", res);
-		goto error;
-	}
+        // Query pools for the GPU scopes, with NDEBUG this does nothing
+        if (!gpu_profiler_init(dev->dev, dev->instance->timestamp_period)) {
+                goto error;
+        }
 
 	VkFenceCreateInfo fence_info = {0};
 	fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
@@ -1451,27 +2401,33 @@ struct wlr_renderer *vulkan_renderer_create_for_device(struct wlr_vk_device *dev
 		goto error;
 	}
 
-	// staging command buffer
-	VkCommandBufferAllocateInfo cmd_buf_info = {0};
-	cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	cmd_buf_info.commandPool = renderer->command_pool;
-	cmd_buf_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	cmd_buf_info.commandBufferCount = 1u;
-	res = vkAllocateCommandBuffers(dev->dev, &cmd_buf_info,
-		&renderer->stage.cb);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkAllocateCommandBuffers", res);
-		goto error;
-	}
-
-        // Timestamp query pool
-        VkQueryPoolCreateInfo query_info = {0};
-        query_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
-        query_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
-        query_info.queryCount = TIMER_COUNT * 2;
+	// semaphores between the graphics and transfer queue
+	if (dev->has_transfer_queue) {
+		VkSemaphoreTypeCreateInfoKHR timeline_info = {
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR,
+			.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR,
+			.initialValue = 0,
+		};
+		VkSemaphoreCreateInfo timeline_sem_info = {
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+			.pNext = &timeline_info,
+		};
+		VkSemaphoreCreateInfo binary_sem_info = {
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		};
 
-        res = vkCreateQueryPool(dev->dev, &query_info, NULL, &renderer->query_pool);
-        assert(res == VK_SUCCESS);
+		if (vkCreateSemaphore(dev->dev, &timeline_sem_info, NULL,
+					&renderer->graphics_timeline) != VK_SUCCESS
+				|| vkCreateSemaphore(dev->dev, &timeline_sem_info, NULL,
+					&renderer->transfer_timeline) != VK_SUCCESS
+				|| vkCreateSemaphore(dev->dev, &binary_sem_info, NULL,
+					&renderer->readback_semaphores[0]) != VK_SUCCESS
+				|| vkCreateSemaphore(dev->dev, &binary_sem_info, NULL,
+					&renderer->readback_semaphores[1]) != VK_SUCCESS) {
+			wlr_log(WLR_ERROR, "vkCreateSemaphore failed");
+			goto error;
+		}
+	}
 
 	return &renderer->wlr_renderer;
 
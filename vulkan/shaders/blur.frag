@@ -5,7 +5,7 @@ layout(set = 0, binding = 0) uniform sampler2D tex;
 layout(std140, push_constant) uniform UBO {
 	mat4 proj;
         vec4 color;
-        vec2 surface_id;
+        uvec2 surface_id;
         vec2 surface_dims;
         vec2 screen_dims;
         // 0 = downsampling, 1 = upsampling, 2 = downsample but threshold first
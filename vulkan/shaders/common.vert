@@ -5,7 +5,7 @@
 layout(std140, push_constant, row_major) uniform UBO {
 	mat4 proj;
         vec4 color;
-        vec2 surface_id;
+        uvec2 surface_id;
 } data;
 
 layout(location = 0) out vec2 uv;
@@ -0,0 +1,25 @@
+#version 450
+
+// Drawn after texture.frag with the same quad. Only writes where the window
+// is, so the padding around it doesn't hide what's underneath.
+
+layout(std140, push_constant) uniform UBO {
+	mat4 proj;
+        vec4 color;
+        uvec2 surface_id;
+        vec2 surface_dims;
+} data;
+
+layout(location = 0) in vec2 uv;
+
+layout(location = 1) out vec4 out_uv;
+layout(location = 2) out uint out_id;
+
+void main() {
+        if (uv.x <= 0 || uv.x >= 1 || uv.y <= 0 || uv.y >= 1) {
+                discard;
+        }
+
+        out_uv = vec4(uv, 0, 1);
+        out_id = data.surface_id.x;
+}
@@ -1,15 +1,13 @@
 #version 450
 
 layout(location = 0) out vec4 out_color;
-layout(location = 1) out vec4 out_uv;
 
 layout(std140, push_constant, row_major) uniform UBO {
 	mat4 proj;
         vec4 color;
-        vec2 surface_id;
+        uvec2 surface_id;
 } data;
 
 void main() {
 	out_color = data.color;
-	out_uv = vec4(0);
 }
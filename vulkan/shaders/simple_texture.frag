@@ -6,7 +6,7 @@ layout(set = 0, binding = 0) uniform sampler2D tex;
 layout(std140, push_constant, row_major) uniform UBO {
 	mat4 proj;
         vec4 color;
-        vec2 surface_id;
+        uvec2 surface_id;
         vec2 screen_dims;
 } data;
 
@@ -8,7 +8,7 @@ layout(set = 1, binding = 0) uniform sampler2D tex;
 layout(std140, push_constant) uniform UBO {
 	mat4 proj;
         vec4 color;
-        vec2 surface_id;
+        uvec2 surface_id;
         vec2 surface_dims;
         vec2 screen_dims;
         float is_focused;
@@ -17,8 +17,8 @@ layout(std140, push_constant) uniform UBO {
 layout(location = 0) in vec2 uv;
 layout(location = 1) in vec2 global_uv;
 
+// UV and surface ID are written by id.frag
 layout(location = 0) out vec4 out_color;
-layout(location = 1) out vec4 out_uv;
 
 vec3 colors[8] = {
         vec3(0, 0, 0),
@@ -134,7 +134,6 @@ void main() {
                 background *= (1 - opacity);
 
                 out_color = vec4(window.rgb + background, alpha);
-                out_uv = vec4(uv, data.surface_id.x, 1);
 
                 // Overlay noise
                 float noise = random_float(uv);
@@ -149,6 +148,5 @@ void main() {
         } else {
                 // We're outside the window
                 out_color = get_outside_color(uv);
-                out_uv = vec4(0);
         }
 }
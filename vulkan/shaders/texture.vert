@@ -5,7 +5,7 @@
 layout(std140, push_constant) uniform UBO {
 	mat4 proj;
         vec4 color;
-        vec2 surface_id;
+        uvec2 surface_id;
         vec2 surface_dims;
 } data;
 
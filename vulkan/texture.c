@@ -32,33 +32,38 @@ static VkImageAspectFlagBits mem_plane_aspect(unsigned i) {
 	}
 }
 
-// Will transition the texture to shaderReadOnlyOptimal layout for reading
-// from fragment shader later on
+// Uploads all the given rectangles of data with a single staging span and a
+// single copy. Only records into the stage cb, the upload is executed right
+// before the next frame. Will transition the texture to shaderReadOnlyOptimal
+// layout for reading from fragment shader later on.
 static bool write_pixels(struct wlr_texture *wlr_texture,
-		uint32_t stride, uint32_t width, uint32_t height, uint32_t src_x,
-		uint32_t src_y, uint32_t dst_x, uint32_t dst_y, const void *vdata,
-		VkImageLayout old_layout, VkPipelineStageFlags src_stage,
-		VkAccessFlags src_access) {
-	VkResult res;
+		uint32_t stride, const pixman_box32_t *rects, int rects_len,
+		const void *vdata, VkImageLayout old_layout,
+		VkPipelineStageFlags src_stage, VkAccessFlags src_access) {
 	struct wlr_vk_texture *texture = vulkan_get_texture(wlr_texture);
 	struct wlr_vk_renderer *renderer = texture->renderer;
-	VkDevice dev = texture->renderer->dev->dev;
-
-	// Make sure assumptions are met
-	assert(src_x + width <= texture->wlr_texture.width);
-	assert(src_y + height <= texture->wlr_texture.height);
-	assert(dst_x + width <= texture->wlr_texture.width);
-	assert(dst_y + height <= texture->wlr_texture.height);
 
 	const struct wlr_pixel_format_info *format_info = drm_get_pixel_format_info(
 			texture->format->drm_format);
 	assert(format_info);
 
 	// Deferred upload by transfer; using staging buffer
-	// Calculate maximum side needed
+	// Calculate size needed for all rects together
 	uint32_t bsize = 0;
 	unsigned bytespb = format_info->bpp / 8;
-	bsize += height * bytespb * width;
+	for (int i = 0; i < rects_len; i++) {
+		const pixman_box32_t *rect = &rects[i];
+		// Make sure assumptions are met
+		assert(rect->x1 >= 0 && rect->y1 >= 0);
+		assert((uint32_t) rect->x2 <= texture->wlr_texture.width);
+		assert((uint32_t) rect->y2 <= texture->wlr_texture.height);
+
+		bsize += (rect->y2 - rect->y1) * bytespb * (rect->x2 - rect->x1);
+	}
+
+	if (bsize == 0) {
+		return true;
+	}
 
 	// Get staging buffer
 	struct wlr_vk_buffer_span span = vulkan_get_stage_span(renderer, bsize);
@@ -67,82 +72,101 @@ static bool write_pixels(struct wlr_texture *wlr_texture,
 		return false;
 	}
 
-	void *vmap;
-	res = vkMapMemory(dev, span.buffer->memory, span.alloc.start,
-		bsize, 0, &vmap);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkMapMemory", res);
+	VkBufferImageCopy *copies = calloc(rects_len, sizeof(*copies));
+	if (copies == NULL) {
+		wlr_log_errno(WLR_ERROR, "Allocation failed");
 		return false;
 	}
-	char *map = (char *)vmap;
+
+	// Stage buffers stay mapped
+	char *vmap = (char *)span.buffer->memory.map + span.alloc.start;
+	char *map = vmap;
+
+	// write data into staging buffer span, one packed region per rect
+	for (int i = 0; i < rects_len; i++) {
+		const pixman_box32_t *rect = &rects[i];
+		uint32_t width = rect->x2 - rect->x1;
+		uint32_t height = rect->y2 - rect->y1;
+		uint32_t packed_stride = bytespb * width;
+		uint32_t buf_off = span.alloc.start + (map - (char *)vmap);
+		// vkCmdCopyBufferToImage wants 4-byte aligned offsets, which we
+		// get for free with 32 bit formats
+		assert(buf_off % 4 == 0);
+
+		const char *pdata = vdata; // data iterator
+		pdata += stride * rect->y1;
+		pdata += bytespb * rect->x1;
+
+		if (rect->x1 == 0 && width == texture->wlr_texture.width &&
+				stride == packed_stride) {
+			memcpy(map, pdata, packed_stride * height);
+			map += packed_stride * height;
+		} else {
+			for (unsigned j = 0u; j < height; ++j) {
+				memcpy(map, pdata, packed_stride);
+				pdata += stride;
+				map += packed_stride;
+			}
+		}
+
+		copies[i] = (VkBufferImageCopy) {
+			.imageExtent = { width, height, 1 },
+			.imageOffset = { rect->x1, rect->y1, 0 },
+			.bufferOffset = buf_off,
+			.bufferRowLength = width,
+			.bufferImageHeight = height,
+			.imageSubresource = {
+				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.mipLevel = 0,
+				.baseArrayLayer = 0,
+				.layerCount = 1,
+			},
+		};
+	}
+
+	assert((uint32_t)(map - (char *)vmap) == bsize);
 
 	// record staging cb
 	// will be executed before next frame
-        printf("write_pixels with image %p\n", texture->image);
-	vulkan_image_transition(renderer->dev->dev, renderer->dev->queue, renderer->command_pool,
+	VkCommandBuffer cbuf = vulkan_record_stage_cb(renderer);
+
+	VkPipelineStageFlags dst_stage = VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT;
+	VkAccessFlags dst_access = VK_ACCESS_SHADER_READ_BIT;
+	if (renderer->dev->has_transfer_queue) {
+		// Barriers don't reach across queues, and a transfer queue
+		// doesn't know about graphics stages anyway. Frames still
+		// sampling the texture are waited for with a semaphore
+		// instead, and the frame waits for the upload the same way.
+		// Earlier uploads in the same stage cb are still ordered by
+		// the barrier.
+		vulkan_stage_wait_frame(renderer, texture->last_used);
+		src_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+		src_access = VK_ACCESS_TRANSFER_WRITE_BIT;
+		dst_stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+		dst_access = 0;
+	}
+
+	vulkan_image_transition_cbuf(cbuf,
                 texture->image, VK_IMAGE_ASPECT_COLOR_BIT,
 		old_layout, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                 src_access, VK_ACCESS_TRANSFER_WRITE_BIT,
                 src_stage, VK_PIPELINE_STAGE_TRANSFER_BIT,
                 1);
 
-	// upload data
-	const char *pdata = vdata; // data iterator
-
-	uint32_t packed_stride = bytespb * width;
-	uint32_t buf_off = span.alloc.start + (map - (char *)vmap);
-
-	// write data into staging buffer span
-	pdata += stride * src_y;
-	pdata += bytespb * src_x;
-
-	if (src_x == 0 && width == texture->wlr_texture.width &&
-			stride == packed_stride) {
-		memcpy(map, pdata, packed_stride * height);
-		map += packed_stride * height;
-	} else {
-		for (unsigned i = 0u; i < height; ++i) {
-			memcpy(map, pdata, packed_stride);
-			pdata += stride;
-			map += packed_stride;
-		}
-	}
-
-	VkBufferImageCopy copy;
-	copy.imageExtent.width = width;
-	copy.imageExtent.height = height;
-	copy.imageExtent.depth = 1;
-	copy.imageOffset.x = dst_x;
-	copy.imageOffset.y = dst_y;
-	copy.imageOffset.z = 0;
-	copy.bufferOffset = buf_off;
-	copy.bufferRowLength = width;
-	copy.bufferImageHeight = height;
-	copy.imageSubresource.mipLevel = 0;
-	copy.imageSubresource.baseArrayLayer = 0;
-	copy.imageSubresource.layerCount = 1;
-	copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-
-	assert((uint32_t)(map - (char *)vmap) == bsize);
-	vkUnmapMemory(dev, span.buffer->memory);
-
-        VkCommandBuffer cbuf;
-        cbuf_alloc(renderer->dev->dev, renderer->command_pool, &cbuf);
-        cbuf_begin_onetime(cbuf);
-
 	vkCmdCopyBufferToImage(cbuf, span.buffer->buffer, texture->image,
-		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, rects_len, copies);
 
 	vulkan_image_transition_cbuf(cbuf,
                 texture->image, VK_IMAGE_ASPECT_COLOR_BIT,
 		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-                VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
-                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
+                VK_ACCESS_TRANSFER_WRITE_BIT, dst_access,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, dst_stage,
                 1);
 
-        cbuf_submit_wait(renderer->dev->queue, cbuf);
+	free(copies);
 
-	texture->last_used = renderer->frame;
+	// The span was tagged with the frame the stage cb belongs to
+	texture->last_used = span.buffer->frame;
 
 	return true;
 }
@@ -159,23 +183,16 @@ static bool vulkan_texture_update_from_buffer(struct wlr_texture *wlr_texture,
         }
         assert(data != NULL);
 
-	// The user can pass multiple rectangles. So we iterate over them.
+	// The user can pass multiple rectangles. They all go into one copy.
 	int rects_len = 0;
 	pixman_box32_t *rects = pixman_region32_rectangles(damage, &rects_len);
 
-	bool is_ok;
-	for (int i = 0; i < rects_len; i++) {
-		int x = rects[i].x1, y = rects[i].y1;
-		int width = rects[i].x2 - rects[i].x1;
-		int height = rects[i].y2 - rects[i].y1;
-
-		is_ok = write_pixels(wlr_texture, stride, width, height,
-			x, y, x, y, data,
-			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	// A frame in flight might still be sampling from the texture, the
+	// barrier in write_pixels waits for it
+	bool is_ok = write_pixels(wlr_texture, stride, rects, rects_len, data,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
 
-		if (!is_ok) break;
-	}
 	wlr_buffer_end_data_ptr_access(buffer);
 
 	return is_ok;
@@ -187,6 +204,19 @@ void vulkan_texture_destroy(struct wlr_vk_texture *texture) {
 		return;
 	}
 
+	// If a frame in flight still samples from it, it gets destroyed once
+	// that frame is retired instead
+	struct wlr_vk_renderer *renderer = texture->renderer;
+	if (texture->last_used > renderer->completed_frame) {
+		wl_list_remove(&texture->link);
+		wl_list_init(&texture->link);
+		wl_list_remove(&texture->buffer_destroy.link);
+		wl_list_init(&texture->buffer_destroy.link);
+		texture->buffer = NULL;
+		wl_list_insert(&renderer->destroy_textures, &texture->destroy_link);
+		return;
+	}
+
 	wl_list_remove(&texture->link);
 	wl_list_remove(&texture->buffer_destroy.link);
 
@@ -201,6 +231,7 @@ void vulkan_texture_destroy(struct wlr_vk_texture *texture) {
 	for (unsigned i = 0u; i < texture->mem_count; ++i) {
 		vkFreeMemory(dev, texture->memories[i], NULL);
 	}
+	vulkan_mem_free(&texture->renderer->allocator, &texture->alloc);
 
 	free(texture);
 }
@@ -260,8 +291,6 @@ static struct wlr_texture *vulkan_texture_from_pixels(struct wlr_renderer *wlr_r
 	texture->format = &fmt->format;
 
 	// create image
-	unsigned mem_bits = 0xFFFFFFFF;
-
 	VkImageCreateInfo img_info = {0};
 	img_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 	img_info.imageType = VK_IMAGE_TYPE_2D;
@@ -274,10 +303,23 @@ static struct wlr_texture *vulkan_texture_from_pixels(struct wlr_renderer *wlr_r
 	img_info.extent = (VkExtent3D) { width, height, 1 };
 	img_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT;
 
+	// Written on the transfer queue and sampled on the graphics queue. Damage
+	// updates only touch part of the texture, so ownership transfers would
+	// need a graphics submission before every upload; concurrent sharing
+	// avoids that.
+	uint32_t queue_families[] = {
+		renderer->dev->queue_family,
+		renderer->dev->transfer_queue_family,
+	};
+	if (renderer->dev->has_transfer_queue
+			&& renderer->dev->transfer_queue_family != renderer->dev->queue_family) {
+		img_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		img_info.queueFamilyIndexCount = 2;
+		img_info.pQueueFamilyIndices = queue_families;
+	}
+
 	img_info.tiling = VK_IMAGE_TILING_OPTIMAL;
 	img_info.usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-	mem_bits = vulkan_find_mem_type(renderer->dev,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mem_bits);
 	VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
 	res = vkCreateImage(dev, &img_info, NULL, &texture->image);
@@ -288,24 +330,10 @@ static struct wlr_texture *vulkan_texture_from_pixels(struct wlr_renderer *wlr_r
 
         printf("vulkan_texture_from_pixels: new image at %p\n", texture->image);
 
-	// memory
-	VkMemoryRequirements mem_reqs;
-	vkGetImageMemoryRequirements(dev, texture->image, &mem_reqs);
-
-	VkMemoryAllocateInfo mem_info = {0};
-	mem_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	mem_info.allocationSize = mem_reqs.size;
-	mem_info.memoryTypeIndex = mem_bits & mem_reqs.memoryTypeBits;
-	res = vkAllocateMemory(dev, &mem_info, NULL, &texture->memories[0]);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkAllocatorMemory failed", res);
-		goto error;
-	}
-
-	texture->mem_count = 1;
-	res = vkBindImageMemory(dev, texture->image, texture->memories[0], 0);
-	if (res != VK_SUCCESS) {
-		wlr_vk_error("vkBindMemory failed", res);
+	// memory, out of a shared block
+	if (!vulkan_mem_alloc_image(&renderer->allocator, texture->image,
+			VULKAN_MEM_OPTIMAL, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			&texture->alloc)) {
 		goto error;
 	}
 
@@ -357,9 +385,9 @@ static struct wlr_texture *vulkan_texture_from_pixels(struct wlr_renderer *wlr_r
 	vkUpdateDescriptorSets(dev, 1, &ds_write, 0, NULL);
 
 	// write data
-	if (!write_pixels(&texture->wlr_texture, stride,
-			width, height, 0, 0, 0, 0, data, VK_IMAGE_LAYOUT_UNDEFINED,
-			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0)) {
+	pixman_box32_t full_rect = { 0, 0, width, height };
+	if (!write_pixels(&texture->wlr_texture, stride, &full_rect, 1, data,
+			VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0)) {
 		goto error;
 	}
 
@@ -1,51 +1,343 @@
 #include "timer.h"
 
+#ifndef NDEBUG
+
 #include <assert.h>
-#include <wlr/util/log.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <wlr/util/log.h>
+
+#include "../util.h"
+
+// Seconds between logging the stats
+#define GPU_REPORT_INTERVAL 1.0
+// Histogram buckets are log-scale, GPU_BUCKETS_PER_OCTAVE per doubling starting
+// at GPU_HISTOGRAM_MIN seconds, so 1 us to about 1 s
+#define GPU_HISTOGRAM_MIN 1e-6
+#define GPU_BUCKETS_PER_OCTAVE 4
+#define GPU_BUCKET_COUNT 80
+
+// One gpu_scope_begin/gpu_scope_end pair
+struct gpu_scope {
+        char label[GPU_LABEL_LENGTH];
+        // The start timestamp, the end is at query + 1
+        uint32_t query;
+};
+
+// The scopes of one frame
+struct gpu_frame_scopes {
+        VkQueryPool query_pool;
+        struct gpu_scope scopes[GPU_SCOPE_MAX];
+        uint32_t scope_count;
+        // Indices into scopes of the ones that haven't ended yet
+        uint32_t stack[GPU_SCOPE_DEPTH];
+        int depth;
+        // Value of wlr_vk_renderer.frame these are from
+        uint32_t frame;
+        // Submitted but not read back yet
+        bool pending;
+};
 
-char *TIMER_NAMES[TIMER_COUNT] = {
-        "Entire pipeline",
-        "render_begin",
-        "Most recent render_rect",
-        "Most recent render_texture",
-        "render_end",
-        "render_end subsection",
-        "render_begin subection",
-        "Most recent render_texture subsection",
-        "Most recent blur",
-        "Most recent blur subsection"
+struct gpu_histogram {
+        uint32_t buckets[GPU_BUCKET_COUNT];
+        uint32_t count;
+        float min;
+        double sum;
 };
 
-// Assumes the start timestamp is at start_idx and the end timestamp is at
-// start_idx + 1. Result is in seconds.
-double vulkan_get_elapsed(VkDevice device, VkQueryPool query_pool, double timestamp_period,
-                int start_idx) {
-        uint64_t timestamps[2];
-        VkResult res = vkGetQueryPoolResults(device, query_pool,
-                start_idx, 2, sizeof(timestamps), timestamps, sizeof(timestamps[0]),
-                VK_QUERY_RESULT_64_BIT);
+struct gpu_label_stats {
+        char label[GPU_LABEL_LENGTH];
+        // What's come in since the last report, and what came in the
+        // interval before that. Reports cover both, so they're about the
+        // last one or two seconds instead of everything since startup.
+        struct gpu_histogram current, previous;
+};
+
+static struct {
+        VkDevice device;
+        // Nanoseconds per timestamp tick
+        float timestamp_period;
+
+        struct gpu_frame_scopes frames[GPU_PROFILER_FRAMES];
+        // Where gpu_scope_begin records to, NULL outside of a frame
+        struct gpu_frame_scopes *current;
+
+        struct gpu_label_stats *labels;
+        size_t label_count, label_capacity;
+        // Scopes come in the same order every frame, so the next label is
+        // usually right after the last one found
+        size_t last_label;
+
+        // Since the last report
+        uint32_t dropped_scopes, dropped_frames;
+        double last_report;
+} profiler;
 
-        if (res == VK_NOT_READY) {
-                return -1;
-        } else if (res != VK_SUCCESS) {
-                wlr_log(WLR_ERROR, "Couldn't get timestamp: %d", res);
-                exit(1);
+bool gpu_profiler_init(VkDevice device, float timestamp_period) {
+        profiler.device = device;
+        profiler.timestamp_period = timestamp_period;
+        profiler.last_report = get_time();
+
+        for (int i = 0; i < GPU_PROFILER_FRAMES; i++) {
+                VkQueryPoolCreateInfo query_info = {0};
+                query_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+                query_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+                query_info.queryCount = GPU_SCOPE_MAX * 2;
+                VkResult res = vkCreateQueryPool(device, &query_info, NULL,
+                        &profiler.frames[i].query_pool);
+                if (res != VK_SUCCESS) {
+                        wlr_log(WLR_ERROR, "vkCreateQueryPool failed: %d", res);
+                        return false;
+                }
         }
 
-        // Divide by 1000000000 to convert ns to ms
-        double elapsed = ((double) (timestamps[1] - timestamps[0]))
-                * timestamp_period / 1000000000;
+        return true;
+}
+
+void gpu_profiler_finish() {
+        // Renderer creation failed before getting to us
+        if (profiler.device == VK_NULL_HANDLE) return;
 
-        return elapsed;
+        for (int i = 0; i < GPU_PROFILER_FRAMES; i++) {
+                vkDestroyQueryPool(profiler.device, profiler.frames[i].query_pool, NULL);
+        }
+        free(profiler.labels);
+        memset(&profiler, 0, sizeof(profiler));
 }
 
-void vulkan_start_timer(VkCommandBuffer cbuf, VkQueryPool query_pool, int timer_idx) {
+void gpu_scope_begin(VkCommandBuffer cbuf, const char *fmt, ...) {
+        struct gpu_frame_scopes *scopes = profiler.current;
+        assert(scopes != NULL);
+
+        // Still counted, so gpu_scope_end knows there's nothing to end
+        int depth = scopes->depth++;
+        if (depth >= GPU_SCOPE_DEPTH) {
+                profiler.dropped_scopes++;
+                return;
+        }
+        if (scopes->scope_count >= GPU_SCOPE_MAX) {
+                scopes->stack[depth] = UINT32_MAX;
+                profiler.dropped_scopes++;
+                return;
+        }
+
+        uint32_t idx = scopes->scope_count++;
+        struct gpu_scope *scope = &scopes->scopes[idx];
+        scope->query = idx * 2;
+        scopes->stack[depth] = idx;
+
+        // Parent's label, then this one
+        int len = 0;
+        if (depth > 0 && scopes->stack[depth - 1] != UINT32_MAX) {
+                struct gpu_scope *parent = &scopes->scopes[scopes->stack[depth - 1]];
+                len = strlen(parent->label);
+                // Leave room for the slash and the terminator
+                if (len > (int) sizeof(scope->label) - 2) len = sizeof(scope->label) - 2;
+                memcpy(scope->label, parent->label, len);
+                scope->label[len++] = '/';
+        }
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(scope->label + len, sizeof(scope->label) - len, fmt, args);
+        va_end(args);
+
         vkCmdWriteTimestamp(cbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                query_pool, timer_idx);
+                scopes->query_pool, scope->query);
 }
 
-void vulkan_end_timer(VkCommandBuffer cbuf, VkQueryPool query_pool, int timer_idx) {
+void gpu_scope_end(VkCommandBuffer cbuf) {
+        struct gpu_frame_scopes *scopes = profiler.current;
+        assert(scopes != NULL);
+        assert(scopes->depth > 0);
+
+        int depth = --scopes->depth;
+        if (depth >= GPU_SCOPE_DEPTH || scopes->stack[depth] == UINT32_MAX) {
+                return;
+        }
+
+        struct gpu_scope *scope = &scopes->scopes[scopes->stack[depth]];
         vkCmdWriteTimestamp(cbuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-                query_pool, timer_idx + 1);
+                scopes->query_pool, scope->query + 1);
+}
+
+static struct gpu_label_stats *find_label(const char *label) {
+        for (size_t i = 0; i < profiler.label_count; i++) {
+                size_t idx = (profiler.last_label + i) % profiler.label_count;
+                if (strcmp(profiler.labels[idx].label, label) == 0) {
+                        profiler.last_label = idx;
+                        return &profiler.labels[idx];
+                }
+        }
+
+        if (profiler.label_count == profiler.label_capacity) {
+                size_t new_capacity = profiler.label_capacity == 0 ? 64 : profiler.label_capacity * 2;
+                struct gpu_label_stats *new_labels = realloc(profiler.labels,
+                        new_capacity * sizeof(*new_labels));
+                assert(new_labels != NULL);
+                profiler.labels = new_labels;
+                profiler.label_capacity = new_capacity;
+        }
+
+        struct gpu_label_stats *stats = &profiler.labels[profiler.label_count];
+        memset(stats, 0, sizeof(*stats));
+        strcpy(stats->label, label);
+        profiler.last_label = profiler.label_count++;
+        return stats;
+}
+
+static void histogram_add(struct gpu_histogram *histogram, float elapsed) {
+        int bucket = 0;
+        if (elapsed > GPU_HISTOGRAM_MIN) {
+                bucket = log2f(elapsed / GPU_HISTOGRAM_MIN) * GPU_BUCKETS_PER_OCTAVE;
+                if (bucket >= GPU_BUCKET_COUNT) bucket = GPU_BUCKET_COUNT - 1;
+        }
+        histogram->buckets[bucket]++;
+        if (histogram->count == 0 || elapsed < histogram->min) histogram->min = elapsed;
+        histogram->count++;
+        histogram->sum += elapsed;
+}
+
+// Upper edge of the bucket, so p99 errs on the high side, by at most a bucket
+// (about 19%)
+static float bucket_top(int bucket) {
+        return GPU_HISTOGRAM_MIN * exp2f((float) (bucket + 1) / GPU_BUCKETS_PER_OCTAVE);
+}
+
+static void report() {
+        for (size_t i = 0; i < profiler.label_count; i++) {
+                struct gpu_label_stats *stats = &profiler.labels[i];
+                struct gpu_histogram *cur = &stats->current, *prev = &stats->previous;
+                uint32_t n = cur->count + prev->count;
+
+                if (n == 0) {
+                        // Hasn't shown up for two intervals, e.g. the surface
+                        // is gone. Swap-remove and look at whatever took its
+                        // place.
+                        profiler.labels[i] = profiler.labels[--profiler.label_count];
+                        i--;
+                        continue;
+                }
+
+                float min = cur->count == 0 ? prev->min
+                        : prev->count == 0 ? cur->min
+                        : fminf(cur->min, prev->min);
+                double avg = (cur->sum + prev->sum) / n;
+
+                // Smallest bucket with 99% of the samples at or below it
+                uint32_t p99_rank = (n * 99 + 99) / 100;
+                uint32_t seen = 0;
+                int p99_bucket = 0;
+                for (; p99_bucket < GPU_BUCKET_COUNT - 1; p99_bucket++) {
+                        seen += cur->buckets[p99_bucket] + prev->buckets[p99_bucket];
+                        if (seen >= p99_rank) break;
+                }
+
+                wlr_log(WLR_DEBUG, "\t[GPU] %-40s min %6.3f ms, avg %6.3f ms, p99 %6.3f ms (%u samples)",
+                        stats->label, min * 1000, avg * 1000, bucket_top(p99_bucket) * 1000, n);
+
+                *prev = *cur;
+                memset(cur, 0, sizeof(*cur));
+        }
+        profiler.last_label = 0;
+
+        if (profiler.dropped_scopes > 0) {
+                wlr_log(WLR_ERROR, "Dropped %u GPU scopes, raise GPU_SCOPE_MAX or GPU_SCOPE_DEPTH",
+                        profiler.dropped_scopes);
+                profiler.dropped_scopes = 0;
+        }
+        if (profiler.dropped_frames > 0) {
+                wlr_log(WLR_DEBUG, "\t[GPU] Timestamps of %u frames weren't ready in time",
+                        profiler.dropped_frames);
+                profiler.dropped_frames = 0;
+        }
+}
+
+// Returns false if the GPU isn't done with the frame yet
+static bool harvest_frame(struct gpu_frame_scopes *scopes) {
+        // Timestamp, then availability
+        static uint64_t results[GPU_SCOPE_MAX * 2][2];
+
+        uint32_t query_count = scopes->scope_count * 2;
+        if (query_count > 0) {
+                VkResult res = vkGetQueryPoolResults(profiler.device, scopes->query_pool,
+                        0, query_count, query_count * sizeof(results[0]), results,
+                        sizeof(results[0]),
+                        VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+                if (res == VK_NOT_READY) {
+                        return false;
+                } else if (res != VK_SUCCESS) {
+                        // Not worth taking everything down for
+                        wlr_log(WLR_ERROR, "Couldn't get timestamps of frame %u: %d",
+                                scopes->frame, res);
+                        scopes->pending = false;
+                        return true;
+                }
+        }
+
+        for (uint32_t i = 0; i < scopes->scope_count; i++) {
+                struct gpu_scope *scope = &scopes->scopes[i];
+                uint64_t *start = results[scope->query], *end = results[scope->query + 1];
+                // VK_SUCCESS means all of them, but better safe than sorry
+                if (!start[1] || !end[1]) continue;
+
+                // Divide by 1000000000 to convert ns to s
+                double elapsed = (double) (end[0] - start[0])
+                        * profiler.timestamp_period / 1000000000;
+                histogram_add(&find_label(scope->label)->current, elapsed);
+        }
+
+        scopes->pending = false;
+        return true;
+}
+
+void gpu_profiler_begin_frame(VkCommandBuffer cbuf, uint32_t frame) {
+        assert(profiler.current == NULL);
+
+        // Oldest first, and stop at the first one that isn't done. The GPU
+        // finishes frames in order, so the rest won't be either.
+        for (uint32_t age = GPU_PROFILER_FRAMES - 1; age >= GPU_HARVEST_DELAY; age--) {
+                struct gpu_frame_scopes *scopes = &profiler.frames[(frame - age) % GPU_PROFILER_FRAMES];
+                if (!scopes->pending || scopes->frame != frame - age) continue;
+                if (!harvest_frame(scopes)) break;
+        }
+
+        struct gpu_frame_scopes *scopes = &profiler.frames[frame % GPU_PROFILER_FRAMES];
+        if (scopes->pending) {
+                // Rather lose the timings than wait for them
+                profiler.dropped_frames++;
+                scopes->pending = false;
+        }
+
+        // How many scopes there'll be isn't known yet, so all of them
+        vkCmdResetQueryPool(cbuf, scopes->query_pool, 0, GPU_SCOPE_MAX * 2);
+        scopes->scope_count = 0;
+        scopes->depth = 0;
+        scopes->frame = frame;
+        profiler.current = scopes;
+
+        double now = get_time();
+        if (now - profiler.last_report >= GPU_REPORT_INTERVAL) {
+                report();
+                profiler.last_report = now;
+        }
 }
+
+void gpu_profiler_end_frame() {
+        struct gpu_frame_scopes *scopes = profiler.current;
+        assert(scopes != NULL);
+        profiler.current = NULL;
+
+        if (scopes->depth != 0) {
+                // The end timestamp of some scope never gets written, so the
+                // frame would never become available
+                wlr_log(WLR_ERROR, "Frame ended with %d GPU scopes still open", scopes->depth);
+                return;
+        }
+        scopes->pending = true;
+}
+
+#endif // NDEBUG
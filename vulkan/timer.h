@@ -1,27 +1,55 @@
 #ifndef vulkan_timer_h_INCLUDED
 #define vulkan_timer_h_INCLUDED
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <vulkan/vulkan.h>
 
-#define TIMER_EVERYTHING 0
-#define TIMER_RENDER_BEGIN 2
-#define TIMER_RENDER_RECT 4
-#define TIMER_RENDER_TEXTURE 6
-#define TIMER_RENDER_END 8
-#define TIMER_RENDER_END_1 10
-#define TIMER_RENDER_BEGIN_1 12
-#define TIMER_RENDER_TEXTURE_1 14
-#define TIMER_BLUR 16
-#define TIMER_BLUR_1 18
-#define TIMER_COUNT 10 // Half the total number of indices
+// Most scopes one frame can have, each one takes two queries. Scopes past this
+// are dropped.
+#define GPU_SCOPE_MAX 512
+// How deep scopes can be nested
+#define GPU_SCOPE_DEPTH 16
+// Longest label, including the labels of the scopes it's nested in
+#define GPU_LABEL_LENGTH 96
+// How many frames the profiler keeps query pools for. A frame's timestamps
+// are read GPU_HARVEST_DELAY frames after it was recorded if they're
+// available by then, otherwise they get more chances until its pool is needed
+// again. Has to be more than FRAMES_IN_FLIGHT, so a pool is never reset while
+// the GPU might still be writing to it.
+#define GPU_PROFILER_FRAMES 4
+#define GPU_HARVEST_DELAY 2
 
-extern char *TIMER_NAMES[TIMER_COUNT];
+// Release builds don't write any timestamps at all, so profiling can't cost
+// anything there
+#ifndef NDEBUG
 
-double vulkan_get_elapsed(VkDevice device, VkQueryPool query_pool, double timestamp_period,
-                int start_idx);
+bool gpu_profiler_init(VkDevice device, float timestamp_period);
+void gpu_profiler_finish();
 
-void vulkan_start_timer(VkCommandBuffer cbuf, VkQueryPool query_pool, int timer_idx);
+// Reads back whatever older frames have finished, then starts recording scopes
+// for this one into cbuf, until gpu_profiler_end_frame. Never waits for the
+// GPU. Logs min, avg and p99 of every label about once a second.
+void gpu_profiler_begin_frame(VkCommandBuffer cbuf, uint32_t frame);
+void gpu_profiler_end_frame();
 
-void vulkan_end_timer(VkCommandBuffer cbuf, VkQueryPool query_pool, int timer_idx);
+// Times everything recorded into cbuf until the matching gpu_scope_end. Label
+// is printf-style, e.g. gpu_scope_begin(cbuf, "surface %u", surface->id).
+// Scopes can be nested, and get the labels of the ones around them in front,
+// e.g. "frame/layer 0/blur/pass 2".
+void gpu_scope_begin(VkCommandBuffer cbuf, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+void gpu_scope_end(VkCommandBuffer cbuf);
+
+#else
+
+static inline bool gpu_profiler_init(VkDevice device, float timestamp_period) { return true; }
+static inline void gpu_profiler_finish() {}
+static inline void gpu_profiler_begin_frame(VkCommandBuffer cbuf, uint32_t frame) {}
+static inline void gpu_profiler_end_frame() {}
+static inline void gpu_scope_begin(VkCommandBuffer cbuf, const char *fmt, ...) {}
+static inline void gpu_scope_end(VkCommandBuffer cbuf) {}
+
+#endif // NDEBUG
 
 #endif // vulkan_timer_h_INCLUDED
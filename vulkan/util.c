@@ -10,12 +10,11 @@
 int vulkan_find_mem_type(struct wlr_vk_device *dev,
 		VkMemoryPropertyFlags flags, uint32_t req_bits) {
 
-	VkPhysicalDeviceMemoryProperties props;
-	vkGetPhysicalDeviceMemoryProperties(dev->phdev, &props);
+	const VkPhysicalDeviceMemoryProperties *props = &dev->mem_props;
 
-	for (unsigned i = 0u; i < props.memoryTypeCount; ++i) {
+	for (unsigned i = 0u; i < props->memoryTypeCount; ++i) {
 		if (req_bits & (1 << i)) {
-			if ((props.memoryTypes[i].propertyFlags & flags) == flags) {
+			if ((props->memoryTypes[i].propertyFlags & flags) == flags) {
 				return i;
 			}
 		}
@@ -24,29 +23,6 @@ int vulkan_find_mem_type(struct wlr_vk_device *dev,
 	return -1;
 }
 
-void cbuf_alloc(VkDevice device, VkCommandPool cpool, VkCommandBuffer *cbuf) {
-        VkCommandBufferAllocateInfo info = {0};
-        info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        info.commandPool = cpool;
-        info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        info.commandBufferCount = 1;
-
-        VkResult res = vkAllocateCommandBuffers(device, &info, cbuf);
-        assert(res == VK_SUCCESS);
-}
-
-void cbuf_submit_wait(VkQueue queue, VkCommandBuffer cbuf) {
-        vkEndCommandBuffer(cbuf);
-
-        VkSubmitInfo info = {0};
-        info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        info.commandBufferCount = 1;
-        info.pCommandBuffers = &cbuf;
-
-        vkQueueSubmit(queue, 1, &info, VK_NULL_HANDLE);
-        vkQueueWaitIdle(queue);
-}
-
 void cbuf_begin_onetime(VkCommandBuffer cbuf) {
         VkCommandBufferBeginInfo info = {0};
         info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -54,42 +30,49 @@ void cbuf_begin_onetime(VkCommandBuffer cbuf) {
         vkBeginCommandBuffer(cbuf, &info);
 }
 
-void vulkan_image_transition(VkDevice device, VkQueue queue, VkCommandPool cpool,
+void vulkan_image_transition_cbuf(VkCommandBuffer cbuf,
                 VkImage image, VkImageAspectFlags aspect,
                 VkImageLayout old_lt, VkImageLayout new_lt,
                 VkAccessFlags src_access, VkAccessFlags dst_access,
                 VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage,
                 uint32_t mip_levels) {
+	VkImageMemoryBarrier barrier = {0};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = old_lt;
+	barrier.newLayout = new_lt;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = aspect;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = mip_levels;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+	barrier.srcAccessMask = src_access;
+	barrier.dstAccessMask = dst_access;
 
-	VkCommandBuffer cbuf;
-	cbuf_alloc(device, cpool, &cbuf);
-	cbuf_begin_onetime(cbuf);
-
-        vulkan_image_transition_cbuf(cbuf, image, aspect, old_lt, new_lt,
-                src_access, dst_access,
-                src_stage, dst_stage,
-                mip_levels);
-
-	cbuf_submit_wait(queue, cbuf);
-	vkFreeCommandBuffers(device, cpool, 1, &cbuf);
+	vkCmdPipelineBarrier(cbuf, src_stage, dst_stage, 0, 0, NULL, 0, NULL, 1, &barrier);
 }
 
-void vulkan_image_transition_cbuf(VkCommandBuffer cbuf,
+void vulkan_image_ownership_cbuf(VkCommandBuffer cbuf,
                 VkImage image, VkImageAspectFlags aspect,
                 VkImageLayout old_lt, VkImageLayout new_lt,
+                uint32_t src_family, uint32_t dst_family,
                 VkAccessFlags src_access, VkAccessFlags dst_access,
-                VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage,
-                uint32_t mip_levels) {
+                VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage) {
 	VkImageMemoryBarrier barrier = {0};
 	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 	barrier.oldLayout = old_lt;
 	barrier.newLayout = new_lt;
-	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        // Within one family both halves would be plain layout transitions,
+        // and the second one would start from the wrong layout
+        assert(src_family != dst_family);
+	barrier.srcQueueFamilyIndex = src_family;
+	barrier.dstQueueFamilyIndex = dst_family;
 	barrier.image = image;
 	barrier.subresourceRange.aspectMask = aspect;
 	barrier.subresourceRange.baseMipLevel = 0;
-	barrier.subresourceRange.levelCount = mip_levels;
+	barrier.subresourceRange.levelCount = 1;
 	barrier.subresourceRange.baseArrayLayer = 0;
 	barrier.subresourceRange.layerCount = 1;
 	barrier.srcAccessMask = src_access;
@@ -166,7 +149,8 @@ void vulkan_clear_image(VkCommandBuffer cbuf, VkImage image, float color[4]) {
 
 void create_image(VkPhysicalDevice phys_dev, VkDevice device,
 		VkFormat format, VkFormatFeatureFlagBits features,
-                int width, int height, VkImageUsageFlagBits usage, VkImage *image) {
+                int width, int height, VkImageUsageFlagBits usage,
+                VkImageCreateFlags flags, VkImage *image) {
 	VkFormatProperties format_props;
 	vkGetPhysicalDeviceFormatProperties(phys_dev, format, &format_props);
 	if ((format_props.optimalTilingFeatures & features) != features) {
@@ -177,6 +161,7 @@ void create_image(VkPhysicalDevice phys_dev, VkDevice device,
 
 	struct VkImageCreateInfo info = {
 		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.flags = flags,
 		.imageType = VK_IMAGE_TYPE_2D,
 		.format = format,
 		.extent.width = width,
@@ -200,8 +185,21 @@ void create_image(VkPhysicalDevice phys_dev, VkDevice device,
 
 void create_image_view(VkDevice device, VkFormat format, VkImage image,
                 VkImageAspectFlagBits aspect, VkImageView *view) {
+        create_image_view_with_usage(device, format, image, aspect, 0, view);
+}
+
+// Images created with VK_IMAGE_CREATE_EXTENDED_USAGE_BIT can have usages
+// that only some of their view formats support. Views in the other formats
+// have to narrow it down with usage. 0 means the image's usage.
+void create_image_view_with_usage(VkDevice device, VkFormat format, VkImage image,
+                VkImageAspectFlagBits aspect, VkImageUsageFlags usage, VkImageView *view) {
+        VkImageViewUsageCreateInfo usage_info = {
+                .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_USAGE_CREATE_INFO,
+                .usage = usage,
+        };
         VkImageViewCreateInfo view_info = {
                 .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                .pNext = usage != 0 ? &usage_info : NULL,
                 .image = image,
                 .viewType = VK_IMAGE_VIEW_TYPE_2D,
                 .format = format,
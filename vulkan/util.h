@@ -6,38 +6,43 @@
 
 bool vulkan_has_extension(size_t count, const char **exts, const char *find);
 
-void vulkan_image_transition(VkDevice device, VkQueue queue, VkCommandPool cpool,
+void vulkan_image_transition_cbuf(VkCommandBuffer cbuf,
                 VkImage image, VkImageAspectFlags aspect,
                 VkImageLayout old_lt, VkImageLayout new_lt,
                 VkAccessFlags src_access, VkAccessFlags dst_access,
                 VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage,
                 uint32_t mip_levels);
 
-void vulkan_image_transition_cbuf(VkCommandBuffer cbuf,
+// Like vulkan_image_transition_cbuf, but also moves the image between queue
+// families. Has to be recorded on both queues with the same layouts and
+// families: the release on the source queue and the acquire on the
+// destination queue, with a semaphore in between. The families must differ,
+// two queues of the same family only need a normal transition on one of them.
+void vulkan_image_ownership_cbuf(VkCommandBuffer cbuf,
                 VkImage image, VkImageAspectFlags aspect,
                 VkImageLayout old_lt, VkImageLayout new_lt,
+                uint32_t src_family, uint32_t dst_family,
                 VkAccessFlags src_access, VkAccessFlags dst_access,
-                VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage,
-                uint32_t mip_levels);
+                VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage);
 
 void vulkan_copy_image(VkCommandBuffer cbuf, VkImage src, VkImage dst,
                 VkImageAspectFlagBits aspect,
                 int src_x, int src_y, int dst_x, int dst_y,
                 int width, int height);
 
-void cbuf_alloc(VkDevice device, VkCommandPool cpool, VkCommandBuffer *cbuf);
-
-void cbuf_submit_wait(VkQueue queue, VkCommandBuffer cbuf);
-
 void cbuf_begin_onetime(VkCommandBuffer cbuf);
 
 void vulkan_clear_image(VkCommandBuffer cbuf, VkImage image, float color[4]);
 
 void create_image(VkPhysicalDevice phys_dev, VkDevice device,
 		VkFormat format, VkFormatFeatureFlagBits features,
-                int width, int height, VkImageUsageFlagBits usage, VkImage *image);
+                int width, int height, VkImageUsageFlagBits usage,
+                VkImageCreateFlags flags, VkImage *image);
 
 void create_image_view(VkDevice device, VkFormat format, VkImage image,
                 VkImageAspectFlagBits aspect, VkImageView *view);
 
+void create_image_view_with_usage(VkDevice device, VkFormat format, VkImage image,
+                VkImageAspectFlagBits aspect, VkImageUsageFlags usage, VkImageView *view);
+
 #endif // vulkan_util_h_INCLUDED
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <stdio.h>
@@ -383,6 +384,27 @@ VkPhysicalDevice vulkan_find_drm_phdev(struct wlr_vk_instance *ini, int drm_fd)
 	return VK_NULL_HANDLE;
 }
 
+// DMA_BUF_IOCTL_IMPORT_SYNC_FILE showed up in Linux 6.0 and there's no good
+// way to probe for it without a dmabuf at hand, so go by the kernel version.
+static bool kernel_has_sync_file_import(void) {
+	struct utsname utsname = {0};
+	if (uname(&utsname) != 0) {
+		wlr_log_errno(WLR_ERROR, "uname failed");
+		return false;
+	}
+
+	if (strcmp(utsname.sysname, "Linux") != 0) {
+		return false;
+	}
+
+	int major = 0, minor = 0;
+	if (sscanf(utsname.release, "%d.%d", &major, &minor) != 2) {
+		return false;
+	}
+
+	return major >= 6;
+}
+
 struct wlr_vk_device *vulkan_device_create(struct wlr_vk_instance *ini,
 		VkPhysicalDevice phdev, size_t ext_count, const char **exts) {
 	VkResult res;
@@ -419,6 +441,11 @@ struct wlr_vk_device *vulkan_device_create(struct wlr_vk_instance *ini,
 	dev->phdev = phdev;
 	dev->instance = ini;
 	dev->drm_fd = -1;
+
+        vkGetPhysicalDeviceMemoryProperties(phdev, &dev->mem_props);
+        VkPhysicalDeviceProperties phdev_props;
+        vkGetPhysicalDeviceProperties(phdev, &phdev_props);
+        dev->buffer_image_granularity = phdev_props.limits.bufferImageGranularity;
 	dev->extensions = calloc(16 + ext_count, sizeof(*ini->extensions));
 	if (!dev->extensions) {
 		wlr_log_errno(WLR_ERROR, "allocation failed");
@@ -459,6 +486,32 @@ struct wlr_vk_device *vulkan_device_create(struct wlr_vk_instance *ini,
 		dev->extensions[dev->extension_count++] = names[i];
 	}
 
+	// Optional, needed to sync a separate transfer queue with rendering
+	const char *timeline_ext = VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME;
+	bool has_timeline = false;
+	if (!find_extensions(avail_ext_props, avail_extc, &timeline_ext, 1)) {
+		VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR,
+		};
+		VkPhysicalDeviceFeatures2 features2 = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+			.pNext = &timeline_features,
+		};
+		vkGetPhysicalDeviceFeatures2(phdev, &features2);
+		has_timeline = timeline_features.timelineSemaphore;
+	}
+	if (has_timeline) {
+		dev->extensions[dev->extension_count++] = timeline_ext;
+	}
+
+	// Optional, lets us hand KMS a fence instead of waiting for the GPU
+	// before every commit
+	const char *sync_fd_ext = VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME;
+	bool has_sync_fd_ext = !find_extensions(avail_ext_props, avail_extc, &sync_fd_ext, 1);
+	if (has_sync_fd_ext) {
+		dev->extensions[dev->extension_count++] = sync_fd_ext;
+	}
+
 	// queue families
 	{
 		uint32_t qfam_count;
@@ -481,14 +534,60 @@ struct wlr_vk_device *vulkan_device_create(struct wlr_vk_instance *ini,
 		}
 
 		assert(graphics_found);
+
+		// Look for a queue for uploads and readbacks. A transfer-only
+		// family is usually backed by a DMA engine, so that's best.
+		// Otherwise any other family, and as a last resort a second
+		// queue of the graphics family. Families that can't copy at
+		// arbitrary offsets are no good, we upload damage rects.
+		int best_score = 0;
+		for (unsigned i = 0u; has_timeline && i < qfam_count; ++i) {
+			VkQueueFamilyProperties *props = &queue_props[i];
+			VkExtent3D gran = props->minImageTransferGranularity;
+			bool can_copy = props->queueFlags & (VK_QUEUE_TRANSFER_BIT
+				| VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT);
+			if (!can_copy || gran.width != 1 || gran.height != 1 || gran.depth != 1) {
+				continue;
+			}
+
+			int score = 0;
+			if (i != dev->queue_family) {
+				bool transfer_only = !(props->queueFlags
+					& (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT));
+				score = transfer_only ? 3 : 2;
+			} else if (props->queueCount > 1) {
+				score = 1;
+			}
+
+			if (score > best_score) {
+				best_score = score;
+				dev->transfer_queue_family = i;
+			}
+		}
+		dev->has_transfer_queue = best_score > 0;
+	}
+
+	const float prios[] = {1.f, 1.f};
+	VkDeviceQueueCreateInfo qinfos[2] = {0};
+	uint32_t qinfo_count = 1;
+	qinfos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+	qinfos[0].queueFamilyIndex = dev->queue_family;
+	qinfos[0].queueCount = 1;
+	qinfos[0].pQueuePriorities = prios;
+	if (dev->has_transfer_queue) {
+		if (dev->transfer_queue_family == dev->queue_family) {
+			qinfos[0].queueCount = 2;
+		} else {
+			qinfos[1] = qinfos[0];
+			qinfos[1].queueFamilyIndex = dev->transfer_queue_family;
+			qinfo_count = 2;
+		}
 	}
 
-	const float prio = 1.f;
-	VkDeviceQueueCreateInfo qinfo = {0};
-	qinfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-	qinfo.queueFamilyIndex = dev->queue_family;
-	qinfo.queueCount = 1;
-	qinfo.pQueuePriorities = &prio;
+	VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR,
+		.timelineSemaphore = VK_TRUE,
+	};
 
 	// enable independentBlend
 	VkPhysicalDeviceFeatures phys_dev_features;
@@ -499,10 +598,10 @@ struct wlr_vk_device *vulkan_device_create(struct wlr_vk_instance *ini,
 	enabled_features.independentBlend = VK_TRUE;
 
 	VkDeviceCreateInfo dev_info = {0};
-	dev_info.pNext = NULL;
+	dev_info.pNext = has_timeline ? &timeline_features : NULL;
 	dev_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-	dev_info.queueCreateInfoCount = 1u;
-	dev_info.pQueueCreateInfos = &qinfo;
+	dev_info.queueCreateInfoCount = qinfo_count;
+	dev_info.pQueueCreateInfos = qinfos;
 	dev_info.enabledExtensionCount = dev->extension_count;
 	dev_info.ppEnabledExtensionNames = dev->extensions;
 	dev_info.pEnabledFeatures = &enabled_features;
@@ -515,6 +614,17 @@ struct wlr_vk_device *vulkan_device_create(struct wlr_vk_instance *ini,
 
 
 	vkGetDeviceQueue(dev->dev, dev->queue_family, 0, &dev->queue);
+	if (dev->has_transfer_queue) {
+		uint32_t idx = dev->transfer_queue_family == dev->queue_family ? 1 : 0;
+		vkGetDeviceQueue(dev->dev, dev->transfer_queue_family, idx,
+			&dev->transfer_queue);
+		wlr_log(WLR_INFO, "Using queue family %u for transfers (graphics: %u)",
+			dev->transfer_queue_family, dev->queue_family);
+	} else {
+		dev->transfer_queue_family = dev->queue_family;
+		dev->transfer_queue = dev->queue;
+		wlr_log(WLR_INFO, "No separate transfer queue, uploads share the graphics queue");
+	}
 
 	// load api
 	dev->api.getMemoryFdPropertiesKHR = (PFN_vkGetMemoryFdPropertiesKHR)
@@ -525,6 +635,28 @@ struct wlr_vk_device *vulkan_device_create(struct wlr_vk_instance *ini,
 		goto error;
 	}
 
+	if (has_sync_fd_ext) {
+		dev->api.getSemaphoreFdKHR = (PFN_vkGetSemaphoreFdKHR)
+			vkGetDeviceProcAddr(dev->dev, "vkGetSemaphoreFdKHR");
+
+		VkPhysicalDeviceExternalSemaphoreInfo ext_sem_info = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_SEMAPHORE_INFO,
+			.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+		};
+		VkExternalSemaphoreProperties ext_sem_props = {
+			.sType = VK_STRUCTURE_TYPE_EXTERNAL_SEMAPHORE_PROPERTIES,
+		};
+		vkGetPhysicalDeviceExternalSemaphoreProperties(phdev,
+			&ext_sem_info, &ext_sem_props);
+
+		dev->implicit_sync_interop = dev->api.getSemaphoreFdKHR != NULL
+			&& (ext_sem_props.externalSemaphoreFeatures
+				& VK_EXTERNAL_SEMAPHORE_FEATURE_EXPORTABLE_BIT)
+			&& kernel_has_sync_file_import();
+	}
+	wlr_log(WLR_INFO, "Implicit sync interop %s",
+		dev->implicit_sync_interop ? "enabled" : "unavailable, waiting for the GPU every frame");
+
 	// - check device format support -
 	size_t max_fmts;
 	const struct wlr_vk_format *fmts = vulkan_get_format_list(&max_fmts);